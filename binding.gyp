@@ -9,6 +9,7 @@
         'src/error.cpp',
         'src/options.cpp',
         'src/future.cpp',
+        'src/compress.cpp',
         'src/utils.cpp'
       ],
       'cflags': ['-std=c++0x'],
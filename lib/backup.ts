@@ -0,0 +1,467 @@
+// Dump and restore a key range to / from a local file.
+//
+// Dump files are a sorted sequence of checksummed blocks followed by a sparse
+// index, so the file can be validated and restored without holding it in
+// memory. The layout is:
+//
+//   [magic: 'FDBDUMP1']
+//   block*:  [payload length: uint32 BE][crc32(payload): uint32 BE][payload]
+//   index:   per block: [varint first key length][first key]
+//                       [varint block offset][varint block length][varint row count]
+//   footer:  [index offset: uint64 BE][index length: uint32 BE][crc32(index): uint32 BE]
+//            [row count: uint64 BE][read version: 8 bytes][magic: 'FDBDUMP1']
+//
+// Each block payload is a list of entries, with each key stored relative to
+// the previous key in the same block:
+//
+//   [varint shared prefix length][varint suffix length][varint value length][suffix][value]
+//
+// Keys are stored relative to the dumped database's prefix, so a dump of one
+// subspace can be restored into another.
+
+import { promises as fsp } from 'fs'
+import { FileHandle } from 'fs/promises'
+import Database from './database'
+import FDBError from './error'
+import keySelector from './keySelector'
+import { StreamingMode, TransactionOptions } from './opts.g'
+import { TransactionProfile } from './opts'
+import { BulkLoadOptions, BulkLoadStats } from './bulk'
+import { defaultTransformer } from './transformer'
+import { asBuf, strNext } from './util'
+
+export interface DumpOptions {
+  /**
+   * Read every chunk at the same read version, so the dump is a consistent
+   * snapshot of the range. FDB only keeps 5 seconds of history, so with this
+   * set the whole range must be read inside that window, otherwise the dump
+   * fails with transaction_too_old. Defaults to true.
+   */
+  consistent?: undefined | boolean,
+
+  /** Approximate chunk size passed to getRangeSplitPoints. Defaults to 10MB. */
+  chunkBytes?: undefined | number,
+
+  /** Number of chunks read concurrently. Defaults to 8. */
+  concurrency?: undefined | number,
+
+  /** Target uncompressed payload size of each block. Defaults to 64kb. */
+  blockBytes?: undefined | number,
+
+  /** Options applied to the read transactions. */
+  transactionOptions?: undefined | TransactionOptions | TransactionProfile,
+}
+
+export interface DumpStats {
+  rows: number,
+  blocks: number,
+  fileBytes: number,
+  readVersion: Buffer, // The pinned read version, or the version of the first chunk if not consistent.
+  elapsedMs: number,
+}
+
+export type RestoreOptions = Omit<BulkLoadOptions, 'shardRange'> & {
+  /** Clear the target range covered by the dump before restoring. Defaults to false. */
+  clear?: undefined | boolean,
+}
+
+export interface DumpInfo {
+  rows: number,
+  blocks: number,
+  readVersion: Buffer,
+  /** First and last key in the dump, relative to the dumped prefix. */
+  firstKey: Buffer | null,
+  lastKey: Buffer | null,
+}
+
+const MAGIC = Buffer.from('FDBDUMP1', 'ascii')
+const BLOCK_HEADER_BYTES = 8
+const FOOTER_BYTES = 8 + 4 + 4 + 8 + 8 + MAGIC.length
+
+const DEFAULT_CHUNK_BYTES = 10e6
+const DEFAULT_CONCURRENCY = 8
+const DEFAULT_BLOCK_BYTES = 64 * 1024
+
+const ERR_TRANSACTION_TOO_OLD = 1007
+
+// **** Encoding helpers
+
+const CRC_TABLE = (() => {
+  const table = new Int32Array(256)
+  for (let n = 0; n < 256; n++) {
+    let c = n
+    for (let k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >>> 1) : c >>> 1
+    table[n] = c
+  }
+  return table
+})()
+
+/** Standard (IEEE) CRC32, as used by zlib. */
+export const crc32 = (buf: Buffer, start: number = 0, end: number = buf.length): number => {
+  let crc = -1
+  for (let i = start; i < end; i++) crc = CRC_TABLE[(crc ^ buf[i]) & 0xff] ^ (crc >>> 8)
+  return (crc ^ -1) >>> 0
+}
+
+// Unsigned LEB128. Offsets can exceed 2^32, so this avoids 32 bit bitwise ops.
+const varintLen = (n: number) => {
+  let len = 1
+  while (n >= 0x80) { n = Math.floor(n / 0x80); len++ }
+  return len
+}
+const writeVarint = (buf: Buffer, pos: number, n: number): number => {
+  while (n >= 0x80) {
+    buf[pos++] = (n % 0x80) | 0x80
+    n = Math.floor(n / 0x80)
+  }
+  buf[pos++] = n
+  return pos
+}
+
+class Reader {
+  buf: Buffer
+  pos = 0
+  constructor(buf: Buffer) { this.buf = buf }
+
+  varint(): number {
+    let result = 0, mul = 1
+    while (true) {
+      if (this.pos >= this.buf.length) throw Error('Corrupt dump: truncated varint')
+      const b = this.buf[this.pos++]
+      result += (b & 0x7f) * mul
+      if (b < 0x80) return result
+      mul *= 0x80
+    }
+  }
+
+  bytes(len: number): Buffer {
+    if (this.pos + len > this.buf.length) throw Error('Corrupt dump: truncated entry')
+    const result = this.buf.subarray(this.pos, this.pos + len)
+    this.pos += len
+    return result
+  }
+}
+
+const sharedPrefixLen = (a: Buffer, b: Buffer) => {
+  const max = Math.min(a.length, b.length)
+  let i = 0
+  while (i < max && a[i] === b[i]) i++
+  return i
+}
+
+type Block = {data: Buffer, firstKey: Buffer, count: number}
+
+class BlockBuilder {
+  private parts: Buffer[] = []
+  private size = 0
+  private prevKey: Buffer | null = null
+  private firstKey: Buffer | null = null
+  private count = 0
+
+  get payloadBytes() { return this.size }
+
+  add(key: Buffer, value: Buffer) {
+    const shared = this.prevKey == null ? 0 : sharedPrefixLen(this.prevKey, key)
+    const suffixLen = key.length - shared
+    const entry = Buffer.allocUnsafe(varintLen(shared) + varintLen(suffixLen) + varintLen(value.length) + suffixLen + value.length)
+    let pos = writeVarint(entry, 0, shared)
+    pos = writeVarint(entry, pos, suffixLen)
+    pos = writeVarint(entry, pos, value.length)
+    pos += key.copy(entry, pos, shared)
+    value.copy(entry, pos)
+
+    this.parts.push(entry)
+    this.size += entry.length
+    if (this.firstKey == null) this.firstKey = key
+    this.prevKey = key
+    this.count++
+  }
+
+  finish(): Block | null {
+    if (this.count === 0) return null
+    const data = Buffer.allocUnsafe(BLOCK_HEADER_BYTES + this.size)
+    let pos = BLOCK_HEADER_BYTES
+    for (let i = 0; i < this.parts.length; i++) pos += this.parts[i].copy(data, pos)
+    data.writeUInt32BE(this.size, 0)
+    data.writeUInt32BE(crc32(data, BLOCK_HEADER_BYTES), 4)
+
+    const block = {data, firstKey: this.firstKey!, count: this.count}
+    this.parts = []
+    this.size = 0
+    this.prevKey = this.firstKey = null
+    this.count = 0
+    return block
+  }
+}
+
+function *decodeBlock(payload: Buffer): Generator<[Buffer, Buffer]> {
+  const r = new Reader(payload)
+  let prevKey = Buffer.alloc(0)
+  while (r.pos < payload.length) {
+    const shared = r.varint()
+    const suffixLen = r.varint()
+    const valLen = r.varint()
+    if (shared > prevKey.length) throw Error('Corrupt dump: invalid shared prefix length')
+    const key = Buffer.allocUnsafe(shared + suffixLen)
+    prevKey.copy(key, 0, 0, shared)
+    r.bytes(suffixLen).copy(key, shared)
+    // Copy the value out so yielded values don't pin the whole block in memory.
+    const value = Buffer.from(r.bytes(valLen))
+    yield [key, value]
+    prevKey = key
+  }
+}
+
+// **** Dump
+
+// Read [begin, end) into blocks. Keys are stripped of the prefix.
+async function readChunk(rawDb: Database, prefix: Buffer, begin: Buffer, end: Buffer,
+    readVersion: Buffer | null, opts: DumpOptions, blockBytes: number): Promise<Block[]> {
+  const blocks: Block[] = []
+  const builder = new BlockBuilder()
+  const tn = rawDb.rawCreateTransaction(opts.transactionOptions).snapshot()
+  let start = keySelector.firstGreaterOrEqual(begin)
+
+  while (true) {
+    if (readVersion) tn.setReadVersion(readVersion)
+    try {
+      for await (const batch of tn._getRangeBatchNative(start, keySelector.firstGreaterOrEqual(end), {streamingMode: StreamingMode.WantAll})) {
+        for (let i = 0; i < batch.length; i++) {
+          const [key, value] = batch[i]
+          builder.add(key.subarray(prefix.length), value)
+          if (builder.payloadBytes >= blockBytes) blocks.push(builder.finish()!)
+        }
+        if (batch.length) start = keySelector.firstGreaterThan(batch[batch.length - 1][0])
+      }
+      break
+    } catch (e) {
+      if (!(e instanceof FDBError)) throw e
+      if (readVersion && e.code === ERR_TRANSACTION_TOO_OLD) {
+        throw new FDBError('dumpRange could not read the range inside the 5 second version window. Use {consistent: false}, or raise concurrency.', e.code)
+      }
+      // Throws if the error isn't retryable. Otherwise continue from the last key we read.
+      await tn.rawOnError(e.code)
+    }
+  }
+
+  const last = builder.finish()
+  if (last) blocks.push(last)
+  return blocks
+}
+
+/**
+ * Dump all key value pairs in [start, end) into a file at path. Keys are
+ * encoded using the database's key encoding.
+ *
+ * The range is split into chunks using getRangeSplitPoints, and chunks are
+ * read concurrently. By default every chunk is read at the same pinned read
+ * version, so the dump is a consistent snapshot.
+ */
+export async function dumpRange<KeyIn>(db: Database<KeyIn, any, any, any>,
+    start: KeyIn, end: KeyIn, path: string, opts: DumpOptions = {}): Promise<DumpStats> {
+  const startTime = Date.now()
+  const consistent = opts.consistent !== false
+  const concurrency = opts.concurrency || DEFAULT_CONCURRENCY
+  const blockBytes = opts.blockBytes || DEFAULT_BLOCK_BYTES
+
+  const prefix = db.subspace.prefix
+  const begin = asBuf(db.subspace.packKey(start))
+  const endBuf = asBuf(db.subspace.packKey(end))
+  const rawDb = db.getRoot()
+
+  const {points, readVersion} = await rawDb.doTn(async tn => ({
+    readVersion: await tn.getReadVersion(),
+    points: (await tn.getRangeSplitPoints(begin, endBuf, opts.chunkBytes || DEFAULT_CHUNK_BYTES)).map(asBuf),
+  }), opts.transactionOptions)
+
+  // getRangeSplitPoints includes the begin and end keys, but be defensive.
+  if (points.length === 0 || !points[0].equals(begin)) points.unshift(begin)
+  if (!points[points.length - 1].equals(endBuf)) points.push(endBuf)
+  const numChunks = points.length - 1
+
+  const file = await fsp.open(path, 'w')
+  const stats: DumpStats = {rows: 0, blocks: 0, fileBytes: 0, readVersion, elapsedMs: 0}
+  const index: {firstKey: Buffer, offset: number, length: number, count: number}[] = []
+
+  try {
+    let offset = 0
+    const write = async (buf: Buffer) => {
+      await file.write(buf, 0, buf.length, offset)
+      offset += buf.length
+    }
+    await write(MAGIC)
+
+    // Chunks are read concurrently, but written in order. We only start
+    // reading chunk i once chunk i - concurrency has been written, which
+    // bounds how much we hold in memory.
+    const pending: Promise<Block[]>[] = []
+    const startChunk = (i: number) => {
+      const p = readChunk(rawDb, prefix, points[i], points[i + 1], consistent ? readVersion : null, opts, blockBytes)
+      p.catch(() => {}) // Handled when awaited below.
+      pending[i] = p
+    }
+    for (let i = 0; i < Math.min(concurrency, numChunks); i++) startChunk(i)
+
+    for (let i = 0; i < numChunks; i++) {
+      const blocks = await pending[i]
+      delete pending[i]
+      if (i + concurrency < numChunks) startChunk(i + concurrency)
+
+      for (const block of blocks) {
+        index.push({firstKey: block.firstKey, offset, length: block.data.length, count: block.count})
+        stats.rows += block.count
+        await write(block.data)
+      }
+    }
+
+    let indexLen = 0
+    for (const e of index) {
+      indexLen += varintLen(e.firstKey.length) + e.firstKey.length
+        + varintLen(e.offset) + varintLen(e.length) + varintLen(e.count)
+    }
+    const indexBuf = Buffer.allocUnsafe(indexLen)
+    let pos = 0
+    for (const e of index) {
+      pos = writeVarint(indexBuf, pos, e.firstKey.length)
+      pos += e.firstKey.copy(indexBuf, pos)
+      pos = writeVarint(indexBuf, pos, e.offset)
+      pos = writeVarint(indexBuf, pos, e.length)
+      pos = writeVarint(indexBuf, pos, e.count)
+    }
+
+    const footer = Buffer.alloc(FOOTER_BYTES)
+    footer.writeBigUInt64BE(BigInt(offset), 0)
+    footer.writeUInt32BE(indexBuf.length, 8)
+    footer.writeUInt32BE(crc32(indexBuf), 12)
+    footer.writeBigUInt64BE(BigInt(stats.rows), 16)
+    readVersion.copy(footer, 24)
+    MAGIC.copy(footer, 32)
+
+    await write(indexBuf)
+    await write(footer)
+    stats.fileBytes = offset
+  } finally {
+    await file.close()
+  }
+
+  stats.blocks = index.length
+  stats.elapsedMs = Date.now() - startTime
+  return stats
+}
+
+// **** Restore
+
+type IndexEntry = {firstKey: Buffer, offset: number, length: number, count: number}
+
+async function readIndex(file: FileHandle): Promise<{index: IndexEntry[], rows: number, readVersion: Buffer}> {
+  const {size} = await file.stat()
+  if (size < MAGIC.length + FOOTER_BYTES) throw Error('Not a dump file (too short)')
+
+  const header = Buffer.alloc(MAGIC.length)
+  await file.read(header, 0, header.length, 0)
+  const footer = Buffer.alloc(FOOTER_BYTES)
+  await file.read(footer, 0, FOOTER_BYTES, size - FOOTER_BYTES)
+  if (!header.equals(MAGIC) || !footer.subarray(32).equals(MAGIC)) throw Error('Not a dump file (bad magic)')
+
+  const indexOffset = Number(footer.readBigUInt64BE(0))
+  const indexLen = footer.readUInt32BE(8)
+  if (indexOffset + indexLen + FOOTER_BYTES !== size) throw Error('Corrupt dump: bad index offset')
+
+  const indexBuf = Buffer.alloc(indexLen)
+  await file.read(indexBuf, 0, indexLen, indexOffset)
+  if (crc32(indexBuf) !== footer.readUInt32BE(12)) throw Error('Corrupt dump: index checksum mismatch')
+
+  const index: IndexEntry[] = []
+  const r = new Reader(indexBuf)
+  while (r.pos < indexBuf.length) {
+    const firstKey = Buffer.from(r.bytes(r.varint()))
+    index.push({firstKey, offset: r.varint(), length: r.varint(), count: r.varint()})
+  }
+
+  return {
+    index,
+    rows: Number(footer.readBigUInt64BE(16)),
+    readVersion: Buffer.from(footer.subarray(24, 32)),
+  }
+}
+
+async function readBlock(file: FileHandle, entry: IndexEntry): Promise<Buffer> {
+  const data = Buffer.allocUnsafe(entry.length)
+  const {bytesRead} = await file.read(data, 0, entry.length, entry.offset)
+  if (bytesRead !== entry.length) throw Error('Corrupt dump: truncated block')
+  const payloadLen = data.readUInt32BE(0)
+  if (payloadLen + BLOCK_HEADER_BYTES !== entry.length) throw Error('Corrupt dump: block length mismatch')
+  if (crc32(data, BLOCK_HEADER_BYTES) !== data.readUInt32BE(4)) {
+    throw Error(`Corrupt dump: checksum mismatch in block at offset ${entry.offset}`)
+  }
+  return data.subarray(BLOCK_HEADER_BYTES)
+}
+
+// Yield every pair in the file, validating block checksums as we go. The
+// next block is read while the current one is consumed.
+async function *readPairs(file: FileHandle, index: IndexEntry[]): AsyncGenerator<[Buffer, Buffer]> {
+  let next = index.length ? readBlock(file, index[0]) : null
+  for (let i = 0; i < index.length; i++) {
+    const payload = await next!
+    next = i + 1 < index.length ? readBlock(file, index[i + 1]) : null
+    if (next) next.catch(() => {}) // Handled when awaited.
+    yield* decodeBlock(payload)
+  }
+}
+
+const lastKeyOf = async (file: FileHandle, index: IndexEntry[]): Promise<Buffer | null> => {
+  if (index.length === 0) return null
+  let last: Buffer | null = null
+  for (const [key] of decodeBlock(await readBlock(file, index[index.length - 1]))) last = key
+  return last
+}
+
+/** Read the metadata of a dump file, and check its index is intact. */
+export async function inspectDump(path: string): Promise<DumpInfo> {
+  const file = await fsp.open(path, 'r')
+  try {
+    const {index, rows, readVersion} = await readIndex(file)
+    return {
+      rows,
+      blocks: index.length,
+      readVersion,
+      firstKey: index.length ? index[0].firstKey : null,
+      lastKey: await lastKeyOf(file, index),
+    }
+  } finally {
+    await file.close()
+  }
+}
+
+/**
+ * Load the contents of a dump file into the database, under the database's
+ * prefix. Rows are written in parallel, size-bounded transactions (see
+ * db.bulkLoad) which are aligned to the current shard boundaries of the
+ * target range.
+ *
+ * Like bulkLoad, the restore is not atomic. Block checksums are verified as
+ * the file is read, and a corrupt block aborts the restore.
+ */
+export async function restoreRange(db: Database<any, any, any, any>,
+    path: string, opts: RestoreOptions = {}): Promise<BulkLoadStats> {
+  const file = await fsp.open(path, 'r')
+  try {
+    const {index} = await readIndex(file)
+    // Write raw bytes under the target prefix.
+    const target = db.withKeyEncoding().withValueEncoding(defaultTransformer)
+    const prefix = db.subspace.prefix
+
+    const lastKey = await lastKeyOf(file, index)
+    const loadOpts: BulkLoadOptions = {...opts}
+    if (lastKey != null) {
+      const begin = Buffer.concat([prefix, index[0].firstKey])
+      const end = strNext(Buffer.concat([prefix, lastKey]))
+      loadOpts.shardRange = {begin, end}
+      if (opts.clear) await db.getRoot().clearRange(begin, end)
+    }
+
+    return await target.bulkLoad(readPairs(file, index), loadOpts)
+  } finally {
+    await file.close()
+  }
+}
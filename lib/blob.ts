@@ -0,0 +1,281 @@
+// Large values. FDB rejects values over 100KB, and transactions over 10MB, so
+// a blob is split into fixed size chunks and written across as many
+// transactions as it needs. Each blob is stored as
+//
+//   <prefix> + tuple.pack([name])           manifest: tuple.pack([gen, size, chunkSize])
+//   <prefix> + tuple.pack([name, gen, i])   chunk i
+//
+// where gen is random per write. Chunks are written first under a fresh gen,
+// and the manifest is only pointed at them in the last transaction, which
+// also clears every other generation of the blob. So readers always see a
+// complete blob, and the chunks of a write which failed part way are removed
+// by the next write or delete.
+//
+// Reads look up the manifest and then fetch groups of chunks concurrently,
+// each in its own snapshot transaction pinned to the manifest's read version.
+// Chunks are copied straight into a single preallocated buffer.
+
+import * as tuple from 'fdb-tuple'
+import { TupleItem } from 'fdb-tuple'
+import { randomBytes } from 'crypto'
+import { Readable } from 'stream'
+import Database from './database'
+import Transaction from './transaction'
+import FDBError from './error'
+import Subspace, { GetSubspace, root } from './subspace'
+import { defaultTransformer } from './transformer'
+import { StreamingMode } from './opts.g'
+import { NativeValue, Version } from './native'
+import { asBuf, doTxn, forEachConcurrently } from './util'
+
+export interface BlobOptions {
+  /** Bytes per chunk key. Must be at most 100000. Defaults to 64KB. */
+  chunkSize?: undefined | number,
+  /** Bytes of chunks written per transaction by put(). Defaults to 1MB. */
+  maxTxnBytes?: undefined | number,
+  /** Transactions put() and reads run at once. Defaults to 8. */
+  concurrency?: undefined | number,
+}
+
+export interface BlobReadOptions {
+  /** First byte to read. Defaults to 0. */
+  start?: undefined | number,
+  /** Read up to (but not including) this byte. Defaults to the end of the blob. */
+  end?: undefined | number,
+}
+
+export interface BlobInfo {
+  size: number,
+  chunkSize: number,
+  chunks: number,
+}
+
+type Manifest = BlobInfo & {gen: Buffer}
+type BlobTxn = Transaction<TupleItem[], TupleItem[], Buffer | string, Buffer>
+type RawTxn = Transaction<NativeValue, Buffer, NativeValue, Buffer>
+type DbOrTxn = Database<any, any, any, any> | Transaction<any, any, any, any>
+
+const DEFAULT_CHUNK_SIZE = 64 * 1024
+const DEFAULT_MAX_TXN_BYTES = 1024 * 1024
+const DEFAULT_CONCURRENCY = 8
+const MAX_VALUE_BYTES = 100000
+const ERR_TRANSACTION_TOO_OLD = 1007
+
+export class BlobStore {
+  subspace: Subspace<TupleItem[], TupleItem[], Buffer | string, Buffer>
+  chunkSize: number
+  maxTxnBytes: number
+  concurrency: number
+
+  /** Store blobs in the subspace of space (a database, subspace or directory). */
+  constructor(space: GetSubspace<any, any, any, any>, opts: BlobOptions = {}) {
+    this.subspace = space.getSubspace().withKeyEncoding(tuple).withValueEncoding(defaultTransformer)
+    this.chunkSize = opts.chunkSize || DEFAULT_CHUNK_SIZE
+    if (this.chunkSize > MAX_VALUE_BYTES) throw new RangeError(`Blob chunk size must be at most ${MAX_VALUE_BYTES} bytes`)
+    this.maxTxnBytes = Math.max(opts.maxTxnBytes || DEFAULT_MAX_TXN_BYTES, this.chunkSize)
+    this.concurrency = opts.concurrency || DEFAULT_CONCURRENCY
+  }
+
+  private _at(tn: Transaction<any, any, any, any>) {
+    return tn.at(this.subspace) as BlobTxn
+  }
+
+  private async _manifest(tn: Transaction<any, any, any, any>, name: TupleItem): Promise<Manifest | undefined> {
+    const val = await this._at(tn).get([name])
+    if (val == null) return undefined
+    const [gen, size, chunkSize] = tuple.unpack(val) as [Buffer, number, number]
+    return {gen, size, chunkSize, chunks: Math.ceil(size / chunkSize)}
+  }
+
+  // Clear every generation of the blob's chunks other than keep.
+  private _clearChunks(tn: Transaction<any, any, any, any>, name: TupleItem, keep: Buffer | null) {
+    const rawTn = tn.at(root) as RawTxn
+    const {begin, end} = this.subspace.packRange([name])
+    if (keep == null) return rawTn.clearRange(begin, end)
+    const {begin: keepBegin, end: keepEnd} = this.subspace.packRange([name, keep])
+    rawTn.clearRange(begin, keepBegin)
+    rawTn.clearRange(keepEnd, end)
+  }
+
+  private _writeChunks(tn: BlobTxn, name: TupleItem, gen: Buffer, data: Buffer, first: number, last: number) {
+    for (let i = first; i < last; i++) {
+      tn.set([name, gen, i], data.subarray(i * this.chunkSize, (i + 1) * this.chunkSize))
+    }
+  }
+
+  /**
+   * Store data under name, replacing any existing blob. Given a database, data
+   * is written in as many transactions as it needs, and becomes visible
+   * atomically once the last one commits. Given a transaction, everything is
+   * written in that transaction, so data must fit in it.
+   */
+  put(dbOrTxn: DbOrTxn, name: TupleItem, data: Buffer | string): Promise<BlobInfo> {
+    const buf = asBuf(data)
+    const gen = randomBytes(8)
+    const chunks = Math.ceil(buf.length / this.chunkSize)
+    const info: BlobInfo = {size: buf.length, chunkSize: this.chunkSize, chunks}
+
+    // Everything except the last group of chunks is written up front, in
+    // blind write transactions which are safe to retry.
+    const perTxn = Math.floor(this.maxTxnBytes / this.chunkSize)
+    const lastFirst = (dbOrTxn instanceof Database) ? Math.max(0, chunks - perTxn) : 0
+
+    const finish = async (tn: Transaction<any, any, any, any>) => {
+      const btn = this._at(tn)
+      if (lastFirst > 0) {
+        // A concurrent put or delete of the same name clears our chunks. This
+        // read also makes us conflict with it if it commits before we do.
+        if (await btn.get([name, gen, 0]) == null) throw Error('Blob was overwritten while it was being written')
+      }
+      this._clearChunks(tn, name, gen)
+      this._writeChunks(btn, name, gen, buf, lastFirst, chunks)
+      btn.set([name], tuple.pack([gen, buf.length, this.chunkSize]))
+      return info
+    }
+
+    if (!(dbOrTxn instanceof Database)) return finish(dbOrTxn)
+
+    const db = dbOrTxn
+    const tasks: (() => Promise<void>)[] = []
+    for (let first = 0; first < lastFirst; first += perTxn) {
+      const last = Math.min(first + perTxn, lastFirst)
+      tasks.push(() => db.doTn(async tn => this._writeChunks(this._at(tn), name, gen, buf, first, last)))
+    }
+    return forEachConcurrently(tasks, this.concurrency, task => task()).then(() => db.doTn(finish))
+  }
+
+  /** Remove the named blob. */
+  delete(dbOrTxn: DbOrTxn, name: TupleItem): Promise<void> {
+    return doTxn(dbOrTxn, async tn => {
+      this._at(tn).clear([name])
+      this._clearChunks(tn, name, null)
+    })
+  }
+
+  /** Look up the size of the named blob, without reading it. */
+  stat(dbOrTxn: DbOrTxn, name: TupleItem): Promise<BlobInfo | undefined> {
+    return doTxn(dbOrTxn, async tn => {
+      const m = await this._manifest(tn, name)
+      return m && {size: m.size, chunkSize: m.chunkSize, chunks: m.chunks}
+    })
+  }
+
+  // Read chunks [first, last) and copy the bytes in [start, end) of the blob
+  // into out, which starts at byte start.
+  private async _readGroup(tn: Transaction<any, any, any, any>, name: TupleItem, m: Manifest,
+      first: number, last: number, start: number, end: number, out: Buffer) {
+    const results = await this._at(tn).getRangeAll([name, m.gen, first], [name, m.gen, last], {streamingMode: StreamingMode.WantAll})
+    if (results.length !== last - first) throw Error('Blob is missing chunks')
+
+    for (let j = 0; j < results.length; j++) {
+      const i = first + j
+      const chunk = results[j][1]
+      const chunkStart = i * m.chunkSize
+      const expected = Math.min(m.chunkSize, m.size - chunkStart)
+      if (results[j][0][2] !== i || chunk.length !== expected) throw Error('Blob chunk is corrupt')
+
+      const from = Math.max(start, chunkStart), to = Math.min(end, chunkStart + chunk.length)
+      chunk.copy(out, from - start, from - chunkStart, to - chunkStart)
+    }
+  }
+
+  // Read chunks in a snapshot transaction at readVersion, retrying transient errors.
+  private async _atVersion(db: Database<any, any, any, any>, readVersion: Version, body: (tn: Transaction<any, any, any, any>) => Promise<void>) {
+    const tn = db.rawCreateTransaction().snapshot()
+    while (true) {
+      tn.setReadVersion(readVersion)
+      try {
+        return await body(tn)
+      } catch (e) {
+        if (!(e instanceof FDBError)) throw e
+        if (e.code === ERR_TRANSACTION_TOO_OLD) {
+          throw new FDBError('Blob read could not finish inside the 5 second version window. Read it in byte ranges, or raise concurrency.', e.code)
+        }
+        await tn.rawOnError(e.code)
+      }
+    }
+  }
+
+  // Split the chunks covering [start, end) into groups of roughly
+  // maxTxnBytes, to be read by one range read each.
+  private _groups(m: Manifest, start: number, end: number): [number, number][] {
+    const groups: [number, number][] = []
+    if (end <= start) return groups
+    const perRead = Math.max(1, Math.floor(this.maxTxnBytes / m.chunkSize))
+    const lastChunk = Math.ceil(end / m.chunkSize)
+    for (let first = Math.floor(start / m.chunkSize); first < lastChunk; first += perRead) {
+      groups.push([first, Math.min(first + perRead, lastChunk)])
+    }
+    return groups
+  }
+
+  private async _begin(dbOrTxn: DbOrTxn, name: TupleItem): Promise<{m: Manifest, readVersion: Version | null} | undefined> {
+    if (!(dbOrTxn instanceof Database)) {
+      const m = await this._manifest(dbOrTxn, name)
+      return m && {m, readVersion: null}
+    }
+    return dbOrTxn.doTn(async tn => {
+      const m = await this._manifest(tn, name)
+      return m && {m, readVersion: await tn.getReadVersion()}
+    })
+  }
+
+  /**
+   * Read the named blob, or the bytes in [start, end) of it. Returns
+   * undefined if there's no blob with that name. Given a database, the read
+   * is spread across concurrent transactions at the same read version.
+   */
+  async get(dbOrTxn: DbOrTxn, name: TupleItem, opts: BlobReadOptions = {}): Promise<Buffer | undefined> {
+    const r = await this._begin(dbOrTxn, name)
+    if (r == null) return undefined
+    const {m, readVersion} = r
+    const start = Math.min(opts.start || 0, m.size)
+    const end = Math.max(start, Math.min(opts.end == null ? m.size : opts.end, m.size))
+
+    const out = Buffer.allocUnsafe(end - start)
+    const tasks = this._groups(m, start, end).map(([first, last]) => () => (
+      readVersion == null
+        ? this._readGroup(dbOrTxn as Transaction<any, any, any, any>, name, m, first, last, start, end, out)
+        : this._atVersion(dbOrTxn as Database<any, any, any, any>, readVersion, tn => this._readGroup(tn, name, m, first, last, start, end, out))
+    ))
+    await forEachConcurrently(tasks, this.concurrency, task => task())
+    return out
+  }
+
+  /**
+   * Stream the named blob (or the bytes in [start, end) of it) from the
+   * database in order. Up to concurrency groups of chunks are read ahead of
+   * the consumer, all at the same read version. The stream is empty if
+   * there's no blob with that name.
+   */
+  createReadStream(db: Database<any, any, any, any>, name: TupleItem, opts: BlobReadOptions = {}): Readable {
+    const self = this
+    async function *chunks() {
+      const r = await self._begin(db, name)
+      if (r == null) return
+      const {m, readVersion} = r
+      const start = Math.min(opts.start || 0, m.size)
+      const end = Math.max(start, Math.min(opts.end == null ? m.size : opts.end, m.size))
+      const groups = self._groups(m, start, end)
+
+      const pending: Promise<Buffer>[] = []
+      const startGroup = (g: number) => {
+        const [first, last] = groups[g]
+        const from = Math.max(start, first * m.chunkSize), to = Math.min(end, last * m.chunkSize)
+        const out = Buffer.allocUnsafe(to - from)
+        const p = self._atVersion(db, readVersion!, tn => self._readGroup(tn, name, m, first, last, from, to, out)).then(() => out)
+        p.catch(() => {}) // Handled when awaited below.
+        pending[g] = p
+      }
+      for (let g = 0; g < Math.min(self.concurrency, groups.length); g++) startGroup(g)
+
+      for (let g = 0; g < groups.length; g++) {
+        const out = await pending[g]
+        delete pending[g]
+        if (g + self.concurrency < groups.length) startGroup(g + self.concurrency)
+        yield out
+      }
+    }
+    return Readable.from(chunks(), {objectMode: false})
+  }
+}
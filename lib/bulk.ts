@@ -0,0 +1,205 @@
+// Bulk loading support. This splits a (potentially huge) stream of key value
+// pairs into a series of transactions, each of which stays comfortably under
+// FDB's transaction size and duration limits. Several transactions are kept in
+// flight at once to hide commit latency.
+
+import Database from './database'
+import FDBError from './error'
+import { NativeValue } from './native'
+import { TransactionOptions } from './opts.g'
+import { TransactionProfile } from './opts'
+import { asBuf } from './util'
+
+export interface BulkLoadOptions {
+  /**
+   * Target number of bytes written per transaction. FDB rejects transactions
+   * over 10MB, and recommends keeping them under 1MB. Defaults to 1MB.
+   */
+  maxBytes?: undefined | number,
+
+  /** Maximum number of transactions committing concurrently. Defaults to 4. */
+  maxInFlight?: undefined | number,
+
+  /**
+   * If set, rows are grouped into transactions by shard, using the split
+   * points returned by getRangeSplitPoints over this (packed) key range. This
+   * means each transaction only touches a small number of storage servers.
+   */
+  shardRange?: undefined | {begin: NativeValue, end: NativeValue},
+
+  /** Chunk size passed to getRangeSplitPoints when shardRange is set. Defaults to 10MB. */
+  shardChunkBytes?: undefined | number,
+
+  /**
+   * Options applied to every transaction created by the loader. Plain options
+   * are compiled into a TransactionProfile once, up front.
+   */
+  transactionOptions?: undefined | TransactionOptions | TransactionProfile,
+
+  /** Called after each batch commits. */
+  onProgress?: undefined | ((stats: BulkLoadStats) => void),
+}
+
+export interface BulkLoadStats {
+  rows: number,
+  bytes: number, // Estimated bytes written (see estimateSize below).
+  transactions: number, // Successfully committed transactions.
+  retries: number, // Number of times a transaction body was retried.
+  splits: number, // Number of times a batch was halved after transaction_too_large.
+  elapsedMs: number,
+  rowsPerSec: number,
+  bytesPerSec: number,
+}
+
+const DEFAULT_MAX_BYTES = 1e6
+const DEFAULT_MAX_IN_FLIGHT = 4
+const DEFAULT_SHARD_CHUNK_BYTES = 10e6
+
+const ERR_TRANSACTION_TOO_LARGE = 2101
+
+// Each mutation also adds a write conflict range containing the key, plus
+// some bookkeeping. This mirrors what fdb_transaction_get_approximate_size
+// counts closely enough for batching purposes.
+const MUTATION_OVERHEAD = 24
+const estimateSize = (key: Buffer, val: Buffer) => key.length * 2 + val.length + MUTATION_OVERHEAD
+
+type Batch = {pairs: [Buffer, Buffer][], bytes: number}
+
+const emptyBatch = (): Batch => ({pairs: [], bytes: 0})
+
+// Find the index of the shard containing key. Boundaries are sorted.
+const shardIndex = (boundaries: Buffer[], key: Buffer) => {
+  let lo = 0, hi = boundaries.length
+  while (lo < hi) {
+    const mid = (lo + hi) >>> 1
+    if (Buffer.compare(boundaries[mid], key) <= 0) lo = mid + 1
+    else hi = mid
+  }
+  return lo
+}
+
+/**
+ * Write all the key value pairs from the passed (async) iterable into the
+ * database. Keys and values are encoded using the database's subspace.
+ *
+ * Rows are not written atomically as a whole - each batch is committed in its
+ * own transaction, and batches may commit out of order. If any batch fails
+ * with a non-retryable error, no more rows are read from the source and the
+ * error is rethrown once in-flight batches have settled.
+ */
+export default async function bulkLoad<KeyIn, ValIn>(
+    db: Database<KeyIn, any, ValIn, any>,
+    source: AsyncIterable<[KeyIn, ValIn]> | Iterable<[KeyIn, ValIn]>,
+    opts: BulkLoadOptions = {}): Promise<BulkLoadStats> {
+  const maxBytes = opts.maxBytes || DEFAULT_MAX_BYTES
+  const maxInFlight = opts.maxInFlight || DEFAULT_MAX_IN_FLIGHT
+  const subspace = db.subspace
+  // Keys and values are packed up front, so the transactions themselves write
+  // raw bytes at the root.
+  const rawDb = db.getRoot()
+  const tnOpts = opts.transactionOptions == null || opts.transactionOptions instanceof TransactionProfile
+    ? opts.transactionOptions
+    : rawDb.createTransactionProfile(opts.transactionOptions)
+
+  const startTime = Date.now()
+  const stats: BulkLoadStats = {
+    rows: 0, bytes: 0, transactions: 0, retries: 0, splits: 0,
+    elapsedMs: 0, rowsPerSec: 0, bytesPerSec: 0,
+  }
+  const updateRates = () => {
+    stats.elapsedMs = Date.now() - startTime
+    const secs = Math.max(stats.elapsedMs, 1) / 1000
+    stats.rowsPerSec = stats.rows / secs
+    stats.bytesPerSec = stats.bytes / secs
+  }
+
+  let boundaries: Buffer[] | null = null
+  if (opts.shardRange) {
+    const {begin, end} = opts.shardRange
+    const points = await rawDb.getRangeSplitPoints(begin, end, opts.shardChunkBytes || DEFAULT_SHARD_CHUNK_BYTES)
+    boundaries = points.map(asBuf)
+  }
+  // With no shard range everything lands in the same bucket.
+  const pending: Batch[] = [emptyBatch()]
+
+  const writeBatch = async (batch: Batch): Promise<void> => {
+    let attempt = 0
+    try {
+      await rawDb.doTn(async tn => {
+        if (attempt++ > 0) stats.retries++
+        for (let i = 0; i < batch.pairs.length; i++) tn.set(batch.pairs[i][0], batch.pairs[i][1])
+      }, tnOpts)
+    } catch (e) {
+      // Our size estimate was off (or a single batch was unlucky). Split the
+      // batch in half and try again.
+      if (e instanceof FDBError && e.code === ERR_TRANSACTION_TOO_LARGE && batch.pairs.length > 1) {
+        stats.splits++
+        const mid = batch.pairs.length >> 1
+        const a = batch.pairs.slice(0, mid), b = batch.pairs.slice(mid)
+        await Promise.all([
+          writeBatch({pairs: a, bytes: 0}),
+          writeBatch({pairs: b, bytes: 0}),
+        ])
+        return
+      }
+      throw e
+    }
+
+    stats.transactions++
+    stats.rows += batch.pairs.length
+    for (let i = 0; i < batch.pairs.length; i++) stats.bytes += estimateSize(batch.pairs[i][0], batch.pairs[i][1])
+    updateRates()
+    if (opts.onProgress) opts.onProgress(stats)
+  }
+
+  const inFlight = new Set<Promise<void>>()
+  let failure: any = null
+
+  const dispatch = async (batch: Batch) => {
+    // Wait for a slot. This is what applies backpressure to the source.
+    while (inFlight.size >= maxInFlight) {
+      await Promise.race(inFlight)
+    }
+    if (failure) return
+
+    const p: Promise<void> = writeBatch(batch).catch(e => {
+      if (failure == null) failure = e
+    }).then(() => { inFlight.delete(p) })
+    inFlight.add(p)
+  }
+
+  // Even if the source (or encoding a row) throws, batches which have
+  // already been dispatched are allowed to settle before we return.
+  try {
+    for await (const [key, value] of source as AsyncIterable<[KeyIn, ValIn]>) {
+      if (failure) break
+
+      const k = asBuf(subspace.packKey(key))
+      const v = asBuf(subspace.packValue(value))
+      const bucket = boundaries == null ? 0 : shardIndex(boundaries, k)
+      let batch = pending[bucket]
+      if (batch == null) batch = pending[bucket] = emptyBatch()
+
+      batch.pairs.push([k, v])
+      batch.bytes += estimateSize(k, v)
+
+      if (batch.bytes >= maxBytes) {
+        pending[bucket] = emptyBatch()
+        await dispatch(batch)
+      }
+    }
+
+    if (!failure) {
+      for (let i = 0; i < pending.length; i++) {
+        const batch = pending[i]
+        if (batch != null && batch.pairs.length) await dispatch(batch)
+      }
+    }
+  } finally {
+    await Promise.all(inFlight)
+  }
+  if (failure) throw failure
+
+  updateRates()
+  return stats
+}
@@ -0,0 +1,146 @@
+// Value compression. compressed(inner) wraps a value encoding so values are
+// compressed natively (see src/compress.cpp for the format) before they're
+// stored. Compressed values start with a header byte (0xfd-0xff) which can't
+// start a UTF-8 string, so JSON and string values written before compression
+// was turned on still read back through the same encoding. Values which don't
+// compress are stored as-is.
+//
+// Small values like JSON documents don't have much internal redundancy to
+// compress. A dictionary trained on a sample of a subspace's values holds the
+// content they share (field names, common strings), which matches can refer
+// to. Each value records the id of the dictionary it was compressed with, so
+// a subspace can move to a new dictionary while values written with older
+// ones stay readable. Dictionaries aren't stored by this module - keep them
+// somewhere stable (eg in a key next to the data) and pass them in.
+
+import nativeMod from './native'
+import Database from './database'
+import { Transformer } from './transformer'
+import { crc32 } from './backup'
+import { asBuf, prefixEnd } from './util'
+
+export interface CompressionDictionary {
+  /** Identifies the dictionary in values compressed with it. */
+  id: number,
+  data: Buffer,
+}
+
+export interface CompressionOptions {
+  /** Dictionary new values are compressed with. */
+  dictionary?: undefined | CompressionDictionary,
+  /** Older dictionaries which stored values may have been compressed with. */
+  dictionaries?: undefined | CompressionDictionary[],
+  /** Values smaller than this are stored uncompressed. Defaults to 64 bytes. */
+  minBytes?: undefined | number,
+  /**
+   * Batches with fewer bytes than this in total are decoded on the main
+   * thread, since handing them to the threadpool costs more than decoding
+   * them. Defaults to 64KB.
+   */
+  minBatchBytes?: undefined | number,
+}
+
+export interface CompressedTransformer<In, Out> extends Transformer<In, Out> {
+  /** Pack and compress a batch of values on the libuv threadpool. */
+  packBatch(vals: In[]): Promise<Buffer[]>,
+  /** Decompress and unpack a batch of values. Range reads use this automatically. */
+  unpackBatch(bufs: Buffer[]): Promise<Out[]>,
+}
+
+const HDR_DICT = 0xfe
+const DEFAULT_MIN_BYTES = 64
+const DEFAULT_MIN_BATCH_BYTES = 64 * 1024
+const DEFAULT_DICT_BYTES = 16 * 1024
+const DEFAULT_SAMPLES = 1000
+
+/**
+ * Wrap a value encoding with compression. Eg:
+ *
+ * ```
+ * const docs = db.at('docs/').withValueEncoding(fdb.compressed(fdb.encoders.json, {dictionary}))
+ * ```
+ */
+export const compressed = <In, Out>(inner: Transformer<In, Out>, opts: CompressionOptions = {}): CompressedTransformer<In, Out> => {
+  const dicts = new Map<number, Buffer>()
+  if (opts.dictionaries) for (const d of opts.dictionaries) dicts.set(d.id >>> 0, d.data)
+  const dict = opts.dictionary
+  if (dict) dicts.set(dict.id >>> 0, dict.data)
+
+  const dictData = dict ? dict.data : null
+  const dictId = dict ? dict.id >>> 0 : 0
+  const minBytes = opts.minBytes == null ? DEFAULT_MIN_BYTES : opts.minBytes
+  const minBatchBytes = opts.minBatchBytes == null ? DEFAULT_MIN_BATCH_BYTES : opts.minBatchBytes
+
+  // The dictionary a stored value was compressed with, or null if it wasn't.
+  const dictFor = (buf: Buffer): Buffer | null => {
+    if (buf.length < 5 || buf[0] !== HDR_DICT) return null
+    const id = buf.readUInt32LE(1)
+    const d = dicts.get(id)
+    if (d == null) throw Error(`Value was compressed with unknown dictionary ${id}`)
+    return d
+  }
+
+  const unpack = (buf: Buffer) => inner.unpack(nativeMod.decompress(buf, dictFor(buf)))
+
+  return {
+    name: inner.name ? 'compressed ' + inner.name : 'compressed',
+
+    pack(val) {
+      return nativeMod.compress(asBuf(inner.pack(val)), dictData, dictId, minBytes)
+    },
+    unpack,
+
+    async packBatch(vals) {
+      return nativeMod.compressBatch(vals.map(v => asBuf(inner.pack(v))), dictData, dictId, minBytes)
+    },
+
+    async unpackBatch(bufs) {
+      let bytes = 0
+      for (let i = 0; i < bufs.length; i++) bytes += bufs[i].length
+      if (bytes < minBatchBytes) return bufs.map(unpack)
+
+      // Each native batch uses one dictionary. Values are almost always in a
+      // single group, but they may be split while moving to a new dictionary.
+      const groups = new Map<Buffer | null, number[]>()
+      for (let i = 0; i < bufs.length; i++) {
+        const d = dictFor(bufs[i])
+        let group = groups.get(d)
+        if (group == null) groups.set(d, group = [])
+        group.push(i)
+      }
+
+      const results = new Array<Out>(bufs.length)
+      await Promise.all(Array.from(groups, async ([d, idxs]) => {
+        const raw = await nativeMod.decompressBatch(idxs.map(i => bufs[i]), d)
+        for (let j = 0; j < idxs.length; j++) results[idxs[j]] = inner.unpack(raw[j])
+      }))
+      return results
+    },
+  }
+}
+
+/**
+ * Train a compression dictionary from a sample of (uncompressed) values.
+ * Dictionaries are at most 64KB. The id is a checksum of the content.
+ */
+export const trainDictionary = (samples: (Buffer | string)[], size: number = DEFAULT_DICT_BYTES): CompressionDictionary => {
+  const data = nativeMod.trainDictionary(samples.map(asBuf), size)
+  return { id: crc32(data), data }
+}
+
+/**
+ * Train a dictionary from the values stored in db's subspace. Values are read
+ * raw with a snapshot read, and any which are already compressed are skipped.
+ */
+export async function trainDictionaryFromRange(db: Database<any, any, any, any>,
+    opts: {samples?: undefined | number, size?: undefined | number} = {}): Promise<CompressionDictionary> {
+  const prefix = db.getPrefix()
+  const end = prefixEnd(prefix)
+  const kvs = await db.getRoot().doTn(tn => (
+    tn.snapshot().getRangeAll(prefix, end, {limit: opts.samples || DEFAULT_SAMPLES})
+  ))
+
+  const samples: Buffer[] = []
+  for (const [, v] of kvs) if (v.length === 0 || v[0] < 0xfd) samples.push(v)
+  return trainDictionary(samples, opts.size)
+}
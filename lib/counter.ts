@@ -0,0 +1,168 @@
+// High contention counters. Incrementing a single key with an atomic add
+// doesn't conflict, but every increment still lands on the same storage
+// servers, and reading the counter inside a transaction adds a read conflict
+// on it which aborts the reader whenever anyone else increments it.
+//
+// A sharded counter spreads increments across a fixed number of shard keys,
+// stored at <prefix> + tuple.pack([name, shard]) as little endian int64s.
+// Increments pick a shard at random. Reads sum the shards with a snapshot
+// range read, so they don't conflict with concurrent increments. Compaction
+// folds the shards of a counter back into shard 0.
+
+import * as tuple from 'fdb-tuple'
+import { TupleItem } from 'fdb-tuple'
+import Database from './database'
+import Transaction from './transaction'
+import Subspace, { GetSubspace } from './subspace'
+import { Transformer } from './transformer'
+import { WorkloadClassName } from './workload'
+import { doTxn, prefixEnd, strNext } from './util'
+
+export interface ShardedCounterOptions {
+  /** Number of keys increments are spread across. Defaults to 16. */
+  shards?: undefined | number,
+}
+
+export interface CompactionOptions {
+  /** Keys scanned per transaction when looking for counters to compact. Defaults to 1000. */
+  batchRows?: undefined | number,
+  /** Workload class compaction transactions run in. Defaults to batch. */
+  workloadClass?: undefined | WorkloadClassName,
+}
+
+export interface CompactionHandle {
+  /** Stop compacting. Resolves once any running compaction pass finishes. */
+  stop(): Promise<void>,
+}
+
+const DEFAULT_SHARDS = 16
+const DEFAULT_BATCH_ROWS = 1000
+
+// Signed version of the directory layer's counter encoding. Values must be in
+// the JS safe integer range.
+export const int64LE: Transformer<number, number> = {
+  pack(val) {
+    if (!Number.isSafeInteger(val)) throw new RangeError('Invalid counter value (number outside JS safe range)')
+    const b = Buffer.alloc(8)
+    const high = Math.floor(val / 0x100000000)
+    b.writeUInt32LE(val - high * 0x100000000, 0)
+    b.writeInt32LE(high, 4)
+    return b
+  },
+  unpack(buf) {
+    return buf.readInt32LE(4) * 0x100000000 + buf.readUInt32LE(0)
+  },
+}
+
+type CounterTxn = Transaction<TupleItem[], TupleItem[], number, number>
+
+export class ShardedCounter {
+  subspace: Subspace<TupleItem[], TupleItem[], number, number>
+  shards: number
+
+  /** Create a set of counters stored in the subspace of space (a database, subspace or directory). */
+  constructor(space: GetSubspace<any, any, any, any>, opts: ShardedCounterOptions = {}) {
+    this.subspace = space.getSubspace().withKeyEncoding(tuple).withValueEncoding(int64LE)
+    this.shards = opts.shards || DEFAULT_SHARDS
+  }
+
+  /**
+   * Add delta to the named counter. This is a blind write - it never reads,
+   * so concurrent increments never conflict.
+   */
+  add(tn: Transaction<any, any, any, any>, name: TupleItem, delta: number = 1) {
+    const shard = Math.floor(Math.random() * this.shards)
+    ;(tn.at(this.subspace) as CounterTxn).add([name, shard], delta)
+  }
+
+  /**
+   * Read the current value of the named counter. The shards are read with a
+   * snapshot read, so this doesn't conflict with concurrent increments.
+   */
+  get(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, name: TupleItem): Promise<number> {
+    return doTxn(dbOrTxn, async tn => {
+      const shards = await (tn.at(this.subspace) as CounterTxn).snapshot().getRangeAllStartsWith([name])
+      let sum = 0
+      for (let i = 0; i < shards.length; i++) sum += shards[i][1]
+      return sum
+    })
+  }
+
+  /**
+   * Fold the shards of the named counter into a single key. Unlike reads, this
+   * conflicts with concurrent increments, so it's best run in the background.
+   */
+  compact(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, name: TupleItem): Promise<void> {
+    return doTxn(dbOrTxn, async tn => {
+      const ctn = tn.at(this.subspace) as CounterTxn
+      const shards = await ctn.getRangeAllStartsWith([name])
+      if (shards.length === 0 || (shards.length === 1 && shards[0][0][1] === 0)) return
+
+      let sum = 0
+      for (let i = 0; i < shards.length; i++) sum += shards[i][1]
+      ctn.clearRangeStartsWith([name])
+      if (sum !== 0) ctn.set([name, 0], sum)
+    })
+  }
+
+  /**
+   * Compact every counter in the subspace which has increments outside shard
+   * 0. Each counter is compacted in its own transaction.
+   */
+  async compactAll(db: Database<any, any, any, any>, opts: CompactionOptions = {}): Promise<number> {
+    const batchRows = opts.batchRows || DEFAULT_BATCH_ROWS
+    const rawDb = db.getRoot().withWorkloadClass(opts.workloadClass || 'batch')
+    const prefix = this.subspace.prefix
+    const end = prefixEnd(prefix)
+
+    let compacted = 0
+    let cursor: Buffer | null = prefix
+    while (cursor != null) {
+      const from: Buffer = cursor
+      const {names, next} = await rawDb.doTn(async tn => {
+        const batch = await tn.snapshot().getRangeAll(from, end, {limit: batchRows})
+        // Shards of the same counter are adjacent, so we only need to
+        // compare against the last name we added.
+        const names: TupleItem[] = []
+        let last: Buffer | null = null
+        for (const [k] of batch) {
+          const [name, shard] = this.subspace.unpackKey(k)
+          if (shard === 0) continue
+          const packed = tuple.pack([name])
+          if (last == null || !last.equals(packed)) names.push(name)
+          last = packed
+        }
+        return {names, next: batch.length < batchRows ? null : strNext(batch[batch.length - 1][0])}
+      })
+
+      for (const name of names) await this.compact(rawDb, name)
+      compacted += names.length
+      cursor = next
+    }
+    return compacted
+  }
+
+  /**
+   * Run compactAll every intervalMs in the background. The timer doesn't keep
+   * the process alive. Errors are passed to onError, if given, and otherwise
+   * ignored until the next pass.
+   */
+  startCompaction(db: Database<any, any, any, any>, intervalMs: number, opts: CompactionOptions & {onError?: undefined | ((err: any) => void)} = {}): CompactionHandle {
+    // If a pass takes longer than the interval, the next one is skipped.
+    let running: Promise<void> | null = null
+    const timer = setInterval(() => {
+      if (running != null) return
+      running = this.compactAll(db, opts).then(() => {}, err => {
+        if (opts.onError) opts.onError(err)
+      }).then(() => { running = null })
+    }, intervalMs)
+    if (timer.unref) timer.unref()
+
+    return {
+      stop() {
+        clearInterval(timer)
+        return running || Promise.resolve()
+      }
+    }
+  }
+}
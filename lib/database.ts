@@ -4,37 +4,84 @@ import { Transformer, defaultTransformer } from './transformer'
 import { NativeValue } from './native'
 import { KeySelector } from './keySelector'
 import Subspace, { root, GetSubspace, isGetSubspace } from './subspace'
-import { eachOption } from './opts'
+import { eachOption, TransactionProfile } from './opts'
 import {
   DatabaseOptions,
   TransactionOptions,
   databaseOptionData,
+  transactionOptionData,
   MutationType,
 } from './opts.g'
 import { Operations } from './customised/operations'
+import bulkLoad, { BulkLoadOptions, BulkLoadStats } from './bulk'
+import { Readable } from 'stream'
+import { getPool, setPoolSize, TransactionPoolStats } from './pool'
+import { getLimiter, setLimits, ConcurrencyLimits, ConcurrencyStats } from './limiter'
+import { getScheduler, WorkloadClassName, WorkloadConfig, WorkloadStats } from './workload'
+import { getTagThrottle, TagStats } from './tags'
+import { createDbReadStream, createDbWriteStream, ReadStreamOptions, WriteStream } from './stream'
+import { abortReason } from './util'
 
 export type WatchWithValue<Value> = Watch & { value: Value | undefined }
 
+// One warmup per native database, shared by every reference to it.
+const warmups = new WeakMap<fdb.NativeDatabase, Promise<void>>()
+
 export default class Database<KeyIn = NativeValue, KeyOut = Buffer, ValIn = NativeValue, ValOut = Buffer> {
   _db: fdb.NativeDatabase
   subspace: Subspace<KeyIn, KeyOut, ValIn, ValOut>
-  constructor(db: fdb.NativeDatabase, subspace: Subspace<KeyIn, KeyOut, ValIn, ValOut>) {
+  /** Transactions run through doTn are scheduled as part of this workload class. */
+  workloadClass: WorkloadClassName | null
+  /** Transactions run through this reference are cancelled when this signal aborts. */
+  signal: AbortSignal | null
+  constructor(db: fdb.NativeDatabase, subspace: Subspace<KeyIn, KeyOut, ValIn, ValOut>, workloadClass: WorkloadClassName | null = null, signal: AbortSignal | null = null) {
     this._db = db
     this.subspace = subspace//new Subspace<KeyIn, KeyOut, ValIn, ValOut>(prefix, keyXf, valueXf)
+    this.workloadClass = workloadClass
+    this.signal = signal
   }
 
   setNativeOptions(opts: DatabaseOptions) {
-    eachOption(databaseOptionData, opts, (code, val) => this._db.setOption(code, val))
-  }
+    eachOption(databaseOptionData(), opts, (code, val) => this._db.setOption(code, val))
+  }
+
+  /**
+   * Connect to the cluster ahead of the first real request. The returned
+   * promise resolves once a read version has been fetched, which means the
+   * client has found the cluster and a GRV proxy is answering. Retryable errors
+   * (eg the cluster still recovering) are retried until that happens.
+   *
+   * Calling this again returns the same promise, unless the previous attempt
+   * failed.
+   */
+  prewarm(): Promise<void> {
+    let p = warmups.get(this._db)
+    if (p == null) {
+      const db = this._db
+      p = new Database(db, root).doTn(tn => tn.getReadVersion()).then(() => {}, e => {
+        warmups.delete(db)
+        throw e
+      })
+      warmups.set(db, p)
+    }
+    return p
+  }
+
+  /**
+   * Resolves once the database is ready to serve requests. Same as prewarm(),
+   * which is started by open() with the prewarm option.
+   */
+  get ready(): Promise<void> { return this.prewarm() }
 
   close() {
+    setPoolSize(this._db, 0)
     this._db.close()
   }
 
   // **** Scoping functions
 
   getRoot(): Database {
-    return new Database(this._db, root)
+    return new Database(this._db, root, this.workloadClass, this.signal)
   }
 
   getSubspace() { return this.subspace }
@@ -53,30 +100,121 @@ export default class Database<KeyIn = NativeValue, KeyOut = Buffer, ValIn = Nati
   at<CKI, CKO, CVI, CVO>(prefix: KeyIn | null, keyXf: Transformer<CKI, CKO>, valueXf: Transformer<CVI, CVO>): Database<CKI, CKO, CVI, CVO>;
 
   at<CKI, CKO, CVI, CVO>(prefixOrSubspace: GetSubspace<CKI, CKO, CVI, CVO> | KeyIn | null, keyXf?: Transformer<CKI, CKO>, valueXf?: Transformer<CVI, CVO>): Database<CKI, CKO, CVI, CVO> {
-    if (isGetSubspace(prefixOrSubspace)) return new Database(this._db, prefixOrSubspace.getSubspace())
-    else return new Database(this._db, this.subspace.at(prefixOrSubspace, keyXf, valueXf))
+    if (isGetSubspace(prefixOrSubspace)) return new Database(this._db, prefixOrSubspace.getSubspace(), this.workloadClass, this.signal)
+    else return new Database(this._db, this.subspace.at(prefixOrSubspace, keyXf, valueXf), this.workloadClass, this.signal)
   }
 
   withKeyEncoding<ChildKeyIn, ChildKeyOut>(keyXf: Transformer<ChildKeyIn, ChildKeyOut>): Database<ChildKeyIn, ChildKeyOut, ValIn, ValOut>
   withKeyEncoding<NativeValue, Buffer>(): Database<NativeValue, Buffer, ValIn, ValOut>
   withKeyEncoding<ChildKeyIn, ChildKeyOut>(keyXf: Transformer<any, any> = defaultTransformer): Database<ChildKeyIn, ChildKeyOut, ValIn, ValOut> {
-    return new Database(this._db, this.subspace.at(null, keyXf))
+    return new Database(this._db, this.subspace.at(null, keyXf), this.workloadClass, this.signal)
   }
 
   withValueEncoding<ChildValIn, ChildValOut>(valXf: Transformer<ChildValIn, ChildValOut>): Database<KeyIn, KeyOut, ChildValIn, ChildValOut> {
-    return new Database(this._db, this.subspace.at(null, undefined /* inherit */, valXf))
+    return new Database(this._db, this.subspace.at(null, undefined /* inherit */, valXf), this.workloadClass, this.signal)
+  }
+
+  /**
+   * Get a reference to this database whose transactions are run as part of
+   * the named workload class (interactive, batch or system). Transactions are
+   * given the matching FDB priority and are limited by the class's concurrency
+   * budget. See configureWorkloads.
+   */
+  withWorkloadClass(name: WorkloadClassName): Database<KeyIn, KeyOut, ValIn, ValOut> {
+    return new Database(this._db, this.subspace, name, this.signal)
+  }
+
+  /**
+   * Get a reference to this database whose operations are abandoned when
+   * signal aborts. Eg, pass an HTTP request's signal so reads and commits
+   * stop when the client goes away:
+   *
+   * ```
+   * const user = await db.withSignal(req.signal).get(userKey)
+   * ```
+   *
+   * When the signal aborts, running transactions are cancelled with
+   * fdb_transaction_cancel, which cancels all their outstanding reads and
+   * commits natively. doTn rejects straight away with the signal's reason, and
+   * the transaction isn't retried.
+   */
+  withSignal(signal: AbortSignal): Database<KeyIn, KeyOut, ValIn, ValOut> {
+    return new Database(this._db, this.subspace, this.workloadClass, signal)
+  }
+
+  /** Set the concurrency budgets of each workload class. */
+  configureWorkloads(config: WorkloadConfig) {
+    getScheduler(this._db).configure(config)
+  }
+
+  getWorkloadStats(): WorkloadStats {
+    return getScheduler(this._db).getStats()
+  }
+
+  /**
+   * Get per-tag counters for transactions started with the tag / tags options,
+   * including how often the cluster throttled them and the current client side
+   * rate limit for each tag.
+   */
+  getTagStats(): {[tag: string]: TagStats} {
+    return getTagThrottle(this._db).getStats()
+  }
+
+  /**
+   * Get the client's view of its connection to the cluster, as reported by
+   * fdb_database_get_client_status. This includes whether the client is
+   * healthy, the coordinators and proxies it is connected to and per-connection
+   * status. See the FDB documentation for the format.
+   */
+  async getClientStatus(): Promise<{[k: string]: any}> {
+    const json = await this._db.getClientStatus()
+    return JSON.parse(json.toString('utf8'))
   }
 
   // This is the API you want to use for non-trivial transactions.
-  async doTn<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions): Promise<T> {
-    return this.rawCreateTransaction(opts)._exec(body)
+  async doTn<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions | TransactionProfile): Promise<T> {
+    if (this.signal && this.signal.aborted) throw abortReason(this.signal)
+    if (this.workloadClass == null) return this._doTn(body, opts)
+    return getScheduler(this._db).run(this.workloadClass, prepare => (
+      this._doTn(tn => {
+        prepare(tn._tn)
+        return body(tn)
+      }, opts)
+    ), this.signal)
+  }
+
+  private async _doTn<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions | TransactionProfile): Promise<T> {
+    const pool = getPool(this._db)
+    if (pool == null) {
+      // Free the native transaction straight away instead of waiting for GC,
+      // unless it handed out a watch or versionstamp which may outlive it.
+      const tn = this.rawCreateTransaction(opts)
+      try {
+        return await tn._exec(body, undefined, this.signal)
+      } finally {
+        if (tn._isReusable()) tn.dispose()
+      }
+    }
+
+    const native = pool.acquire()
+    const tn = new Transaction<KeyIn, KeyOut, ValIn, ValOut>(native, false, this.subspace, opts, undefined, getLimiter(this._db), getTagThrottle(this._db))
+    try {
+      return await tn._exec(body, undefined, this.signal)
+    } finally {
+      // An aborted body may still be running, so its transaction must never
+      // be handed to another caller. It is destroyed instead, which makes
+      // anything the body does with it from here on throw.
+      const aborted = this.signal != null && this.signal.aborted
+      pool.release(native, tn._isReusable() && !aborted)
+      if (aborted && tn._isReusable()) tn.dispose()
+    }
   }
   // Alias for db.doTn.
-  async doTransaction<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions): Promise<T> {
+  async doTransaction<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions | TransactionProfile): Promise<T> {
     return this.doTn(body, opts)
   }
 
-  doOneshot(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => void, opts?: TransactionOptions): Promise<void> {
+  doOneshot(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => void, opts?: TransactionOptions | TransactionProfile): Promise<void> {
     // TODO: Could this be written better? It doesn't need a retry loop.
     return this.doTransaction(tn => {
       body(tn)
@@ -86,9 +224,52 @@ export default class Database<KeyIn = NativeValue, KeyOut = Buffer, ValIn = Nati
 
   // TODO: setOption.
 
+  /**
+   * Validate and encode a set of transaction options once, up front. The
+   * returned profile can be passed to doTn / doTransaction / rawCreateTransaction
+   * in place of an options object, and all of its options are applied to each
+   * new transaction in a single native call.
+   *
+   * Throws a TypeError if any option is unknown or has the wrong type.
+   */
+  createTransactionProfile(opts: TransactionOptions): TransactionProfile {
+    return new TransactionProfile(transactionOptionData(), opts)
+  }
+
+  /**
+   * Keep up to maxSize idle native transactions around, and reuse them (via
+   * fdb_transaction_reset) for subsequent calls to doTn. The pool is shared by
+   * every database reference derived from this one. Pass 0 to disable pooling.
+   *
+   * When pooling is enabled, transaction objects must not be used after the
+   * doTn call which created them returns. Watches and versionstamps are still
+   * safe to use - transactions which create them are not reused.
+   */
+  setTransactionPoolSize(maxSize: number) {
+    setPoolSize(this._db, maxSize)
+  }
+
+  getTransactionPoolStats(): TransactionPoolStats | undefined {
+    return getPool(this._db)?.getStats()
+  }
+
+  /**
+   * Limit the number of reads and commits this process has in flight against
+   * the database at once. Operations over the limit wait their turn in a FIFO
+   * queue. Limits are shared by every database reference derived from this
+   * one, and apply to transactions created after they are set.
+   */
+  setConcurrencyLimits(limits: ConcurrencyLimits) {
+    setLimits(this._db, limits)
+  }
+
+  getConcurrencyStats(): ConcurrencyStats | undefined {
+    return getLimiter(this._db)?.getStats()
+  }
+
   // Infrequently used. You probably want to use doTransaction instead.
-  rawCreateTransaction(opts?: TransactionOptions) {
-    return new Transaction<KeyIn, KeyOut, ValIn, ValOut>(this._db.createTransaction(), false, this.subspace, opts)
+  rawCreateTransaction(opts?: TransactionOptions | TransactionProfile) {
+    return new Transaction<KeyIn, KeyOut, ValIn, ValOut>(this._db.createTransaction(), false, this.subspace, opts, undefined, getLimiter(this._db), getTagThrottle(this._db))
   }
 
   get(key: KeyIn): Promise<ValOut | undefined> {
@@ -155,6 +336,33 @@ export default class Database<KeyIn = NativeValue, KeyOut = Buffer, ValIn = Nati
     return this.getRangeAll(prefix, undefined, opts)
   }
 
+  /**
+   * Load a large stream of key value pairs into the database, automatically
+   * splitting the writes into appropriately sized transactions and keeping
+   * several of them committing concurrently. See BulkLoadOptions.
+   */
+  bulkLoad(source: AsyncIterable<[KeyIn, ValIn]> | Iterable<[KeyIn, ValIn]>, opts?: BulkLoadOptions): Promise<BulkLoadStats> {
+    return bulkLoad(this, source, opts)
+  }
+
+  /**
+   * Create a node readable stream over the specified range. See
+   * Transaction.createReadStream. The range is read using a series of
+   * snapshot transactions, so the stream can be consumed slowly - but it will
+   * not see a consistent snapshot if the range is concurrently modified.
+   */
+  createReadStream(start: KeyIn | KeySelector<KeyIn>, end?: KeyIn | KeySelector<KeyIn>, opts?: ReadStreamOptions): Readable {
+    return createDbReadStream(this, start, end, opts)
+  }
+
+  /**
+   * Create an object mode writable stream which loads [key, value] pairs into
+   * the database via bulkLoad. Use this with stream.pipeline.
+   */
+  createWriteStream(opts?: BulkLoadOptions & {highWaterMark?: undefined | number}): WriteStream {
+    return createDbWriteStream(this, opts)
+  }
+
   getEstimatedRangeSizeBytes(start: KeyIn, end: KeyIn): Promise<number> {
     return this.doTransaction(tn => tn.getEstimatedRangeSizeBytes(start, end))
   }
@@ -2,10 +2,11 @@ import Transaction from "./transaction";
 import { Database, tuple, TupleItem, util } from ".";
 import { Transformer, defaultTransformer } from "./transformer";
 import { TransactionOptionCode } from "./opts.g";
-import { concat2, startsWith, strInc, asBuf } from "./util";
+import { concat2, startsWith, strInc, asBuf, doTxn, forEachConcurrently } from "./util";
 import Subspace, { root } from "./subspace";
 import { inspect } from "util";
 import { NativeValue, NativeTransaction } from "./native";
+import keySelector from "./keySelector";
 // import FDBError from './error'
 
 export class DirectoryError extends Error {
@@ -37,6 +38,9 @@ type DbOrTxn<KeyIn, KeyOut, ValIn, ValOut> = Database<KeyIn, KeyOut, ValIn, ValO
 type TupleIn = undefined | TupleItem | TupleItem[]
 /** Node subspaces have tuple keys like [SUBDIRS, (bytes)] and [b'layer']. */
 type NodeSubspace = Subspace<TupleIn, TupleItem[], NativeValue, Buffer>
+type RawTxn = Transaction<NativeValue, Buffer, NativeValue, Buffer>
+// A node in a subtree being removed, and the parent subdirectory entry linking it in.
+type SubtreeNode = {parent: NodeSubspace, name: Buffer, node: NodeSubspace}
 
 const BUF_EMPTY = Buffer.alloc(0)
 
@@ -55,14 +59,6 @@ const arrEq = <T>(x: T[], y: T[]): boolean => {
   return true
 }
 
-// Wrapper for functions which take a database or a transaction.
-const doTxn = <KeyIn, KeyOut, ValIn, ValOut, T>(
-  dbOrTxn: Database<KeyIn, KeyOut, ValIn, ValOut> | Transaction<KeyIn, KeyOut, ValIn, ValOut>,
-  body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>): Promise<T> => {
-  
-  return (dbOrTxn instanceof Database) ? dbOrTxn.doTn(body) : body(dbOrTxn)
-}
-
 // Technically the counter encoding supports 64 bit numbers. We'll only support
 // numbers in the JS safe range (up to 2^53) but thats honestly gonna be fine.
 // Consider exporting this via transformer.
@@ -257,6 +253,15 @@ const VERSION_KEY = Buffer.from('version', 'ascii')
 const LAYER_KEY = Buffer.from('layer', 'ascii')
 const PARTITION_BUF = Buffer.from('partition', 'ascii') // I hate this.
 const SUBDIRS_KEY = 0 // Why is this 0 when version / layers are byte strings? I have no idea. History, I assume.
+// Keyed by node prefix in the root node while a removal's subtree is cleared.
+const PENDING_REMOVAL_KEY = Buffer.from('removing', 'ascii')
+
+// Subdirectories read per transaction by listPages() and removal.
+const LIST_PAGE_SIZE = 1000
+// Nodes cleared per transaction when removing a directory from a database.
+const REMOVE_BATCH_NODES = 1000
+// Transactions removal runs at once.
+const REMOVE_CONCURRENCY = 8
 
 const EXPECTED_VERSION: Version = [1, 0, 0]
 
@@ -437,6 +442,14 @@ export class Directory<KeyIn = NativeValue, KeyOut = Buffer, ValIn = NativeValue
     return this._directoryLayer.listAll(txnOrDb, this._partitionSubpath(path))
   }
 
+  listPage(txnOrDb: TxnAny | DbAny, path: PathIn = [], opts: ListPageOptions = {}): Promise<ListPage> {
+    return this._directoryLayer.listPage(txnOrDb, this._partitionSubpath(path), opts)
+  }
+
+  async *listPages(db: DbAny, path: PathIn = [], opts: {pageSize?: undefined | number} = {}) {
+    yield *this._directoryLayer.listPages(db, this._partitionSubpath(path), opts)
+  }
+
   move(txnOrDb: TxnAny | DbAny, oldPath: PathIn, newPath: PathIn) {
     return this._directoryLayer.move(txnOrDb, this._partitionSubpath(oldPath), this._partitionSubpath(newPath))
   }
@@ -498,6 +511,19 @@ export class Directory<KeyIn = NativeValue, KeyOut = Buffer, ValIn = NativeValue
   }
 }
 
+export interface ListPageOptions {
+  /** Only list subdirectories which sort after this name. */
+  after?: undefined | null | string | Buffer,
+  /** Maximum number of names to return. Defaults to 1000. */
+  limit?: undefined | number,
+}
+
+export interface ListPage {
+  names: Buffer[],
+  /** Pass this as `after` to read the next page. null on the last page. */
+  next: Buffer | null,
+}
+
 interface DirectoryLayerOpts {
   /** The prefix for directory metadata nodes. Defaults to '\xfe' */
   nodePrefix?: undefined | string | Buffer
@@ -726,6 +752,14 @@ export class DirectoryLayer {
    * Removes the directory, its contents, and all subdirectories. Throws an
    * exception if the directory does not exist.
    *
+   * Given a transaction, everything is removed in that transaction. Given a
+   * database, the directory is unlinked from its parent in one transaction,
+   * and then its subtree is cleared concurrently in batched transactions, so
+   * very large trees can be removed. The removal is recorded when the
+   * directory is unlinked, and the record is cleared along with the last of
+   * the subtree. If the process dies part way through clearing, the next
+   * remove(db) or resumeRemovals(db) on this directory layer finishes the job.
+   *
    * Warning: Clients that have already opened the directory might still insert
    * data into its contents after it is removed.
    */
@@ -744,10 +778,11 @@ export class DirectoryLayer {
     return this._removeInternal(txnOrDb, path, false)
   }
 
-  private _removeInternal(txnOrDb: TxnAny | DbAny, _path: PathIn, failOnNonexistent: boolean): Promise<boolean> {
+  private async _removeInternal(txnOrDb: TxnAny | DbAny, _path: PathIn, failOnNonexistent: boolean): Promise<boolean> {
     const path = normalize_path(_path)
+    const inTxn = !(txnOrDb instanceof Database)
 
-    return doTxn(txnOrDb, async txn => {
+    const found = await doTxn(txnOrDb, async txn => {
       await this._checkVersion(txn, true)
       
       if (path.length === 0) throw new DirectoryError('The root directory cannot be removed.')
@@ -756,19 +791,45 @@ export class DirectoryLayer {
       
       if (!node.exists()) {
         if (failOnNonexistent) throw new DirectoryError('The directory does not exist.')
-        else return false
+        else return null
       }
       
       if (node.isInPartition()) {
-        return await node.getContentsSync(this)!
-          ._directoryLayer
-          ._removeInternal(txn, node.getPartitionSubpath(), failOnNonexistent)
+        return {partition: node.getContentsSync(this)!._directoryLayer, subpath: node.getPartitionSubpath()}
       }
       
-      await this._removeRecursive(txn, node.subspace!)
+      if (inTxn) await this._removeRecursive(txn, node.subspace!)
+      else txn.at(this._rootNode).set([PENDING_REMOVAL_KEY, this.getPrefixForNode(node.subspace!)], BUF_EMPTY)
       await this._removeFromParent(txn, path)
-      return true
+      return {node: node.subspace!}
     })
+
+    if (found == null) return false
+    if ('partition' in found) return found.partition._removeInternal(txnOrDb, found.subpath, failOnNonexistent)
+    // The subtree is unreachable now that it's been unlinked from its parent.
+    // This also picks up any removals which were interrupted earlier.
+    if (!inTxn) await this.resumeRemovals(txnOrDb as DbAny)
+    return true
+  }
+
+  /**
+   * Finishes clearing the subtrees of directories whose remove(db) was
+   * interrupted. Removals inside a partition are recorded by the partition's
+   * own directory layer.
+   */
+  async resumeRemovals(db: DbAny): Promise<void> {
+    const {begin, end} = this._rootNode.packRange([PENDING_REMOVAL_KEY])
+    let start = keySelector.firstGreaterOrEqual(begin)
+    while (true) {
+      const keys = await db.doTn(async txn => (
+        (await (txn.at(root) as RawTxn).getRangeAll(start, keySelector.firstGreaterOrEqual(end), {limit: LIST_PAGE_SIZE})).map(([key]) => key)
+      ))
+      for (let i = 0; i < keys.length; i++) {
+        await this._removeSubtree(db, this._nodeWithPrefix(this._rootNode.unpackKey(keys[i])[1] as Buffer))
+      }
+      if (keys.length < LIST_PAGE_SIZE) return
+      start = keySelector.firstGreaterThan(keys[keys.length - 1])
+    }
   }
 
   /**
@@ -804,6 +865,50 @@ export class DirectoryLayer {
     })
   }
 
+  /**
+   * Reads one page of the names of the specified directory's subdirectories,
+   * in order. Pass the returned `next` back in as `after` to read the
+   * following page.
+   */
+  listPage(txnOrDb: TxnAny | DbAny, _path: PathIn = [], opts: ListPageOptions = {}): Promise<ListPage> {
+    return doTxn(txnOrDb, async txn => {
+      await this._checkVersion(txn, false)
+
+      const path = normalize_path(_path)
+      const node = await this.findWithMeta(txn, path)
+      if (!node.exists()) throw new DirectoryError('The directory does not exist.')
+
+      if (node.isInPartition(true)) {
+        return node.getContentsSync(this)!.listPage(txn, node.getPartitionSubpath(), opts)
+      }
+
+      // Read one extra name to find out if there's another page.
+      const limit = opts.limit || LIST_PAGE_SIZE
+      // Names are tuple items (normally strings), so after is compared as-is.
+      const after = opts.after == null ? null : opts.after as Buffer
+      const names: Buffer[] = []
+      for await (const [name] of this._subdirNamesAndNodes(txn, node.subspace!, after, limit + 1)) names.push(name)
+
+      if (names.length <= limit) return {names, next: null}
+      names.pop()
+      return {names, next: names[names.length - 1]}
+    })
+  }
+
+  /**
+   * Streams the names of the specified directory's subdirectories a page at a
+   * time, reading each page in its own transaction. Unlike list(), this works
+   * for directories too large to read within a single transaction.
+   */
+  async *listPages(db: DbAny, path: PathIn = [], opts: {pageSize?: undefined | number} = {}): AsyncGenerator<Buffer[], void, void> {
+    let after: Buffer | null = null
+    do {
+      const page: ListPage = await this.listPage(db, path, {after, limit: opts.pageSize})
+      if (page.names.length) yield page.names
+      after = page.next
+    } while (after != null)
+  }
+
   /**
    * Returns whether or not the specified directory exists.
    */
@@ -915,29 +1020,57 @@ export class DirectoryLayer {
     }
   }
 
-  private async* _subdirNamesAndNodes(txn: TxnAny, node: NodeSubspace) {
-    // TODO: This could work using async iterators to improve performance of searches on very large directories.
-    for await (const [key, prefix] of txn.at(node).getRange(SUBDIRS_KEY)) {
-      yield [key[1], this._nodeWithPrefix(prefix)] as [Buffer, NodeSubspace]
+  // Streams the names and nodes of node's subdirectories in order, starting
+  // after the name after if it's given.
+  private async* _subdirNamesAndNodes(txn: TxnAny, node: NodeSubspace, after: Buffer | null = null, limit?: number) {
+    const {begin, end} = node.packRange(SUBDIRS_KEY)
+    const start = after == null
+      ? keySelector.firstGreaterOrEqual(begin)
+      : keySelector.firstGreaterThan(node.packKey([SUBDIRS_KEY, after]))
+
+    const opts = limit == null ? {} : {limit}
+    for await (const batch of (txn.at(root) as RawTxn).getRangeBatch(start, keySelector.firstGreaterOrEqual(end), opts)) {
+      for (const [key, prefix] of batch) {
+        yield [node.unpackKey(key)[1], this._nodeWithPrefix(prefix)] as [Buffer, NodeSubspace]
+      }
     }
   }
 
-  private async _subdirNamesAndNodesAll(txn: TxnAny, node: NodeSubspace) {
-    const items = []
-    for await(const pair of this._subdirNamesAndNodes(txn, node)) items.push(pair)
-    return items
-  }
-
   private async _removeFromParent(txn: TxnAny, path: Path) {
     const parent = await this.find(txn, path.slice(0, -1))
     txn.at(parent.subspace!).clear([SUBDIRS_KEY, path[path.length - 1]])
   }
 
-  private async _removeRecursive(txn: TxnAny, node: NodeSubspace) {
-    for await (const [name, subnode] of this._subdirNamesAndNodes(txn, node)) {
-      await this._removeRecursive(txn, subnode)
+  // Finds the descendants of node, one array per level of the tree, with the
+  // parent and name which link each of them in. Each level is read
+  // concurrently, a page of subdirectories at a time. run decides which
+  // transaction each page is read in.
+  private async _collectSubtree(run: <T>(body: (txn: TxnAny) => Promise<T>) => Promise<T>, node: NodeSubspace): Promise<SubtreeNode[][]> {
+    const levels: SubtreeNode[][] = []
+    let level = [node]
+    while (level.length) {
+      const children: SubtreeNode[] = []
+      await forEachConcurrently(level, REMOVE_CONCURRENCY, async parent => {
+        let after: Buffer | null = null
+        do {
+          const from: Buffer | null = after
+          const page = await run(async txn => {
+            const page: [Buffer, NodeSubspace][] = []
+            for await (const item of this._subdirNamesAndNodes(txn, parent, from, LIST_PAGE_SIZE)) page.push(item)
+            return page
+          })
+          for (let i = 0; i < page.length; i++) children.push({parent, name: page[i][0], node: page[i][1]})
+          after = page.length === LIST_PAGE_SIZE ? page[page.length - 1][0] : null
+        } while (after != null)
+      })
+
+      if (children.length) levels.push(children)
+      level = children.map(c => c.node)
     }
+    return levels
+  }
 
+  private _clearNode(txn: TxnAny, node: NodeSubspace) {
     // Clear content
     txn.at(this.contentSubspaceForNode(node)).clearRangeStartsWith(BUF_EMPTY)
 
@@ -945,6 +1078,48 @@ export class DirectoryLayer {
     txn.at(node).clearRangeStartsWith(undefined)
   }
 
+  private async _removeRecursive(txn: TxnAny, node: NodeSubspace) {
+    const levels = await this._collectSubtree(body => body(txn), node)
+    for (let l = 0; l < levels.length; l++) {
+      for (let i = 0; i < levels[l].length; i++) this._clearNode(txn, levels[l][i].node)
+    }
+    this._clearNode(txn, node)
+  }
+
+  // Clear an unlinked subtree whose removal is recorded, in batches of nodes
+  // in concurrent transactions. Levels are cleared deepest first, and each
+  // node is unlinked from its parent as it's cleared, so an interrupted
+  // removal never leaves a link to a prefix which could be allocated again.
+  // The top node goes last, along with the record.
+  private async _removeSubtree(db: DbAny, node: NodeSubspace) {
+    const pendingKey = [PENDING_REMOVAL_KEY, this.getPrefixForNode(node)]
+    const levels = await this._collectSubtree(body => db.doTn(body), node)
+
+    for (let l = levels.length - 1; l >= 0; l--) {
+      const batches: SubtreeNode[][] = []
+      for (let i = 0; i < levels[l].length; i += REMOVE_BATCH_NODES) batches.push(levels[l].slice(i, i + REMOVE_BATCH_NODES))
+
+      await forEachConcurrently(batches, REMOVE_CONCURRENCY, batch => db.doTn(async txn => {
+        // Another client might be finishing the same removal. Only clear nodes
+        // which are still linked in, while the removal is still recorded.
+        if (await txn.at(this._rootNode).get(pendingKey) == null) return
+        const links = await Promise.all(batch.map(({parent, name}) => txn.at(parent).get([SUBDIRS_KEY, name])))
+        for (let i = 0; i < batch.length; i++) {
+          const {parent, name, node} = batch[i]
+          if (links[i] == null || !links[i]!.equals(this.getPrefixForNode(node))) continue
+          this._clearNode(txn, node)
+          txn.at(parent).clear([SUBDIRS_KEY, name])
+        }
+      }))
+    }
+
+    await db.doTn(async txn => {
+      if (await txn.at(this._rootNode).get(pendingKey) == null) return
+      this._clearNode(txn, node)
+      txn.at(this._rootNode).clear(pendingKey)
+    })
+  }
+
   // private _isPrefixFree(txn: TxnAny, subspace: Subspace<TupleIn, TupleItem, any, any>) {
   private async _isPrefixFree(txn: TxnAny, prefix: Buffer) {
     // Returns true if the given prefix does not "intersect" any currently
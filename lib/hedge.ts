@@ -0,0 +1,192 @@
+// Hedged snapshot reads. A point read normally goes to one storage server,
+// so a single slow server shows up directly in tail latency. A hedged read
+// waits a short time (by default the 95th percentile of recent read
+// latencies), then sends the same read again in a second snapshot
+// transaction pinned to the same read version, and takes whichever answer
+// arrives first. Both transactions see the same snapshot of the database, so
+// it doesn't matter which one wins. Whichever is still running is cancelled.
+//
+// Only the slowest ~5% of reads are duplicated, so the extra load on the
+// cluster is small.
+
+import { performance } from 'perf_hooks'
+import Database from './database'
+import Transaction from './transaction'
+import FDBError from './error'
+import { abortReason } from './util'
+
+export interface HedgeOptions {
+  /** Always hedge after this long. If unset, the delay adapts to observed latencies. */
+  delayMs?: undefined | number,
+  /** Latency percentile (0-1) of recent reads to use as the delay. Defaults to 0.95. */
+  percentile?: undefined | number,
+  /** Lower bound on the adaptive delay. Defaults to 1ms. */
+  minDelayMs?: undefined | number,
+  /** Delay used until enough reads have been seen to pick one. Defaults to 10ms. */
+  initialDelayMs?: undefined | number,
+}
+
+export interface HedgeStats {
+  /** Keys read. */
+  reads: number,
+  /** Keys whose read was hedged. */
+  hedged: number,
+  /** Keys where the hedged read answered first. */
+  hedgeWins: number,
+  /** The current hedge delay. */
+  delayMs: number,
+}
+
+// Recent primary read latencies are kept in a ring buffer. The percentile is
+// recomputed every RECOMPUTE_EVERY samples.
+const SAMPLES = 1024
+const MIN_SAMPLES = 64
+const RECOMPUTE_EVERY = 64
+
+/**
+ * Reads keys with hedged snapshot reads. Eg:
+ *
+ * ```
+ * const reader = new fdb.HedgedReader(db.at('users/'))
+ * const user = await reader.get(userId)
+ * ```
+ *
+ * Reads are snapshot reads in their own transactions, so they don't conflict
+ * with anything. Like db.get(), reads are retried on retryable errors.
+ */
+export class HedgedReader<KeyIn, KeyOut, ValIn, ValOut> {
+  db: Database<KeyIn, KeyOut, ValIn, ValOut>
+
+  private _fixedDelay: number | null
+  private _percentile: number
+  private _minDelay: number
+  private _delay: number
+
+  private _samples = new Float64Array(SAMPLES)
+  private _numSamples = 0
+  private _stats = {reads: 0, hedged: 0, hedgeWins: 0}
+
+  constructor(db: Database<KeyIn, KeyOut, ValIn, ValOut>, opts: HedgeOptions = {}) {
+    this.db = db
+    this._fixedDelay = opts.delayMs == null ? null : opts.delayMs
+    this._percentile = opts.percentile == null ? 0.95 : opts.percentile
+    this._minDelay = opts.minDelayMs == null ? 1 : opts.minDelayMs
+    this._delay = this._fixedDelay != null ? this._fixedDelay
+      : opts.initialDelayMs == null ? 10 : opts.initialDelayMs
+  }
+
+  async get(key: KeyIn): Promise<ValOut | undefined> {
+    return (await this.getMany([key]))[0]
+  }
+
+  /**
+   * Read a list of keys at a single read version. Each key is hedged on its
+   * own, but all the hedged reads share one transaction.
+   */
+  async getMany(keys: KeyIn[]): Promise<(ValOut | undefined)[]> {
+    const signal = this.db.signal
+    if (signal && signal.aborted) throw abortReason(signal)
+
+    const primary = this.db.rawCreateTransaction().snapshot()
+    try {
+      while (true) {
+        try {
+          return await this._attempt(primary, keys)
+        } catch (e) {
+          if (!(e instanceof FDBError)) throw e
+          await primary.rawOnError(e.code) // Throws if the error isn't retryable.
+        }
+      }
+    } finally {
+      // Cancel any reads which lost to a hedge.
+      primary.rawCancel()
+      primary.dispose()
+    }
+  }
+
+  getStats(): HedgeStats {
+    return {...this._stats, delayMs: this._delay}
+  }
+
+  private _attempt(primary: Transaction<KeyIn, KeyOut, ValIn, ValOut>, keys: KeyIn[]): Promise<(ValOut | undefined)[]> {
+    const n = keys.length
+    const results = new Array<ValOut | undefined>(n)
+    const signal = this.db.signal
+    if (signal && signal.aborted) return Promise.reject(abortReason(signal))
+    if (n === 0) return Promise.resolve(results)
+    this._stats.reads += n
+
+    const settled = new Array<boolean>(n).fill(false)
+    let remaining = n
+    let hedge: Transaction<KeyIn, KeyOut, ValIn, ValOut> | null = null
+    let done = false
+    let timer: ReturnType<typeof setTimeout> | null = null
+    const start = performance.now()
+
+    return new Promise((resolve, reject) => {
+      const finish = (err?: any) => {
+        if (done) return
+        done = true
+        if (timer) clearTimeout(timer)
+        if (signal) signal.removeEventListener('abort', onAbort)
+        if (hedge) {
+          hedge.rawCancel()
+          hedge.dispose()
+        }
+        if (err !== undefined) reject(err)
+        else resolve(results)
+      }
+
+      const onValue = (i: number, val: ValOut | undefined, fromHedge: boolean) => {
+        if (done || settled[i]) return
+        settled[i] = true
+        results[i] = val
+        if (fromHedge) this._stats.hedgeWins++
+        // When the hedge wins this undercounts the primary's latency, which
+        // only errs towards hedging a little more.
+        this._record(performance.now() - start)
+        if (--remaining === 0) finish()
+      }
+
+      const startHedge = async () => {
+        try {
+          // The primary has its read version by now. This doesn't wait for
+          // anything unless the GRV itself is what's slow.
+          const version = await primary.getReadVersion()
+          if (done) return
+
+          hedge = this.db.rawCreateTransaction().snapshot()
+          hedge.setReadVersion(version)
+          for (let i = 0; i < n; i++) if (!settled[i]) {
+            this._stats.hedged++
+            // Hedge errors are ignored. The primary read is still running.
+            hedge.get(keys[i]).then(val => onValue(i, val, true), () => {})
+          }
+        } catch (e) {
+          // If the primary can't get a read version its reads will fail too.
+        }
+      }
+
+      const onAbort = () => {
+        primary.rawCancel()
+        finish(abortReason(signal!))
+      }
+      if (signal) signal.addEventListener('abort', onAbort, {once: true})
+
+      timer = setTimeout(startHedge, this._delay)
+      // An error from the primary fails the attempt, and it's retried by getMany.
+      for (let i = 0; i < n; i++) primary.get(keys[i]).then(val => onValue(i, val, false), finish)
+    })
+  }
+
+  private _record(latencyMs: number) {
+    if (this._fixedDelay != null) return
+    this._samples[this._numSamples % SAMPLES] = latencyMs
+    this._numSamples++
+    if (this._numSamples >= MIN_SAMPLES && this._numSamples % RECOMPUTE_EVERY === 0) {
+      const sorted = this._samples.slice(0, Math.min(this._numSamples, SAMPLES)).sort()
+      const p = sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * this._percentile))]
+      this._delay = Math.max(this._minDelay, p)
+    }
+  }
+}
@@ -1,7 +1,6 @@
 // Stuff that hasn't been ported over:
 
 // const Transactional = require('./retryDecorator')
-// const locality = require('./locality')
 // const directory = require('./directory')
 
 import nativeMod, * as fdb from './native'
@@ -11,9 +10,11 @@ import { NetworkOptions, networkOptionData, DatabaseOptions } from './opts.g'
 import { Transformer } from './transformer'
 import { root } from './subspace'
 import { DirectoryLayer } from './directory'
+import { struct } from './struct'
 import * as apiVersion from './apiVersion'
 
 import { deprecate } from 'util'
+import { isMainThread } from 'worker_threads'
 
 // Must be called before fdb is initialized. Eg setAPIVersion(510).
 export { set as setAPIVersion } from './apiVersion'
@@ -34,7 +35,9 @@ const init = () => {
 
   nativeMod.startNetwork()
 
-  process.on('exit', () => nativeMod.stopNetwork())
+  // The network thread is shared by all worker threads in the process, and
+  // can't be restarted once stopped. So only the main thread stops it.
+  if (isMainThread) process.on('exit', () => nativeMod.stopNetwork())
 }
 
 // Destroy the network thread. This is not needed under normal circumstances;
@@ -50,6 +53,23 @@ export { default as Database } from './database'
 export { default as Transaction, Watch } from './transaction'
 export { default as Subspace, root } from './subspace'
 export { Directory, DirectoryLayer, DirectoryError } from './directory'
+export { BulkLoadOptions, BulkLoadStats } from './bulk'
+export { TransactionProfile } from './opts'
+export { TransactionPoolStats } from './pool'
+export { ConcurrencyLimits, ConcurrencyStats, QueueStats } from './limiter'
+export { TagStats } from './tags'
+export { WorkloadClassName, WorkloadClassConfig, WorkloadConfig, WorkloadStats, WorkloadClassStats } from './workload'
+export { ReadStreamOptions, WriteStream, frameBatch } from './stream'
+export { Shard, ShardMap, ShardMapOptions } from './locality'
+export { Queue, QueueOptions, ClaimOptions, QueueItem, WorkQueueStats } from './queue'
+export { ShardedCounter, ShardedCounterOptions, CompactionOptions, CompactionHandle } from './counter'
+export { SecondaryIndex, IndexKeyFn, BackfillOptions, BackfillStats, VerifyOptions, VerifyResult } from './secondaryIndex'
+export { dumpRange, restoreRange, inspectDump, DumpOptions, DumpStats, DumpInfo, RestoreOptions } from './backup'
+export { BlobStore, BlobOptions, BlobReadOptions, BlobInfo } from './blob'
+export { Schema as StructSchema, FieldType as StructFieldType, StructValue, StructEncoder } from './struct'
+export { HedgedReader, HedgeOptions, HedgeStats } from './hedge'
+export { getNetworkStats, NetworkStats, NetworkSampler, NetworkSample, getTransactionStats, NativeTransactionStats, prometheusMetrics } from './metrics'
+export { compressed, trainDictionary, trainDictionaryFromRange, CompressionDictionary, CompressionOptions, CompressedTransformer } from './compress'
 
 export {
   NetworkOptions,
@@ -67,6 +87,9 @@ export {
 import { strInc } from './util'
 export const util = { strInc }
 
+import * as locality from './locality'
+export { locality }
+
 import * as tuple from 'fdb-tuple'
 import { TupleItem } from 'fdb-tuple'
 
@@ -103,24 +126,48 @@ export const encoders = {
 
   // TODO: Move this into a separate library
   tuple: tuple as Transformer<TupleItem[], TupleItem[]>,
+
+  struct,
 }
 
 // Can only be called before open() or openSync().
 export function configNetwork(netOpts: NetworkOptions) {
   if (initCalled) throw Error('configNetwork must be called before FDB connections are opened')
-  eachOption(networkOptionData, netOpts, (code, val) => nativeMod.setNetworkOption(code, val))
+  eachOption(networkOptionData(), netOpts, (code, val) => nativeMod.setNetworkOption(code, val))
+}
+
+export type OpenOptions = DatabaseOptions & {
+  /**
+   * Start connecting to the cluster straight away. Await db.ready to wait
+   * until the first read version has been fetched.
+   */
+  prewarm?: undefined | boolean,
 }
 
 /**
  * Opens a database and returns it.
  *
  * Note any network configuration must happen before the database is opened.
+ *
+ * Opening is synchronous, and the connection to the cluster is set up by the
+ * first request. Pass {prewarm: true} to start that straight away, so a new
+ * process can report itself healthy once it is actually connected:
+ *
+ * ```
+ * const db = fdb.open(clusterFile, {prewarm: true})
+ * await db.ready
+ * ```
  */
-export function open(clusterFile?: string, dbOpts?: DatabaseOptions) {
+export function open(clusterFile?: string, dbOpts?: OpenOptions) {
   init()
 
   const db = new Database(nativeMod.createDatabase(clusterFile), root)
-  if (dbOpts) db.setNativeOptions(dbOpts)
+  if (dbOpts) {
+    const {prewarm, ...nativeOpts} = dbOpts
+    db.setNativeOptions(nativeOpts)
+    // Errors are reported to whoever awaits db.ready.
+    if (prewarm) db.prewarm().catch(() => {})
+  }
   return db
 }
 
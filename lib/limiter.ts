@@ -0,0 +1,179 @@
+// Admission control for the futures a process has outstanding against a
+// database. Each native database can have a limit on the number of reads and
+// the number of commits in flight at once. Operations over the limit wait in
+// a FIFO queue, so a traffic spike turns into bounded queueing in JS rather
+// than hundreds of thousands of requests piling up on the network thread.
+//
+// Like the transaction pool, limits are shared by every Database reference
+// which wraps the same native database.
+
+import { NativeDatabase } from './native'
+import { abortReason } from './util'
+
+export interface ConcurrencyLimits {
+  /** Maximum number of reads (get, getKey, getRange, etc) in flight. 0 / undefined for no limit. */
+  maxReads?: undefined | number,
+  /** Maximum number of commits in flight. 0 / undefined for no limit. */
+  maxCommits?: undefined | number,
+  /**
+   * Maximum number of operations of each kind waiting for a slot. Operations
+   * beyond this are rejected immediately. Defaults to no limit.
+   */
+  maxQueued?: undefined | number,
+}
+
+export interface QueueStats {
+  limit: number,
+  inFlight: number,
+  queued: number,
+  /** The longest the queue has been. */
+  maxQueued: number,
+  /** Total number of operations which have been started. */
+  admitted: number,
+  /** Number of operations which had to wait for a slot. */
+  waited: number,
+  /** Number of operations rejected because the queue was full. */
+  rejected: number,
+  totalWaitMs: number,
+  maxWaitMs: number,
+}
+
+export interface ConcurrencyStats {
+  reads: QueueStats,
+  commits: QueueStats,
+}
+
+type Waiter = { start: number, resolve: () => void }
+
+export class Semaphore {
+  limit: number
+  maxQueued: number
+  private _inFlight = 0
+  // FIFO queue. Entries before _head have already been woken.
+  private _waiters: Waiter[] = []
+  private _head = 0
+  private _stats = { maxQueued: 0, admitted: 0, waited: 0, rejected: 0, totalWaitMs: 0, maxWaitMs: 0 }
+
+  constructor(limit: number, maxQueued: number) {
+    this.limit = limit
+    this.maxQueued = maxQueued
+  }
+
+  get queued() { return this._waiters.length - this._head }
+
+  // Returns null if a slot was taken immediately. Otherwise the returned
+  // promise resolves once the caller holds a slot. If signal aborts first,
+  // the caller is removed from the queue and the promise rejects.
+  acquire(signal: AbortSignal | null = null): Promise<void> | null {
+    if (this.limit <= 0 || (this._inFlight < this.limit && this.queued === 0)) {
+      this._inFlight++
+      this._stats.admitted++
+      return null
+    }
+
+    if (this.queued >= this.maxQueued) {
+      this._stats.rejected++
+      return Promise.reject(new Error(`Concurrency limit reached (${this.queued} operations queued)`))
+    }
+
+    if (signal && signal.aborted) return Promise.reject(abortReason(signal))
+
+    return new Promise((resolve, reject) => {
+      const w: Waiter = { start: Date.now(), resolve }
+      if (signal) {
+        const onAbort = () => {
+          // Aborts are rare, so a linear search is fine.
+          const i = this._waiters.indexOf(w, this._head)
+          if (i < 0) return // Already admitted.
+          this._waiters.splice(i, 1)
+          reject(abortReason(signal))
+        }
+        signal.addEventListener('abort', onAbort, {once: true})
+        w.resolve = () => {
+          signal.removeEventListener('abort', onAbort)
+          resolve()
+        }
+      }
+      this._waiters.push(w)
+      this._stats.maxQueued = Math.max(this._stats.maxQueued, this.queued)
+    })
+  }
+
+  release() {
+    this._inFlight--
+    this._wake()
+  }
+
+  // Called when the limit is raised, as well as on release.
+  _wake() {
+    while (this.queued > 0 && (this.limit <= 0 || this._inFlight < this.limit)) {
+      const w = this._waiters[this._head++]
+      if (this._head > 1024 && this._head * 2 > this._waiters.length) {
+        this._waiters = this._waiters.slice(this._head)
+        this._head = 0
+      }
+
+      const waitMs = Date.now() - w.start
+      this._stats.waited++
+      this._stats.totalWaitMs += waitMs
+      this._stats.maxWaitMs = Math.max(this._stats.maxWaitMs, waitMs)
+      this._stats.admitted++
+      this._inFlight++
+      w.resolve()
+    }
+  }
+
+  run<T>(fn: () => Promise<T>, signal: AbortSignal | null = null): Promise<T> {
+    const wait = this.acquire(signal)
+    const go = () => {
+      let p: Promise<T>
+      try { p = fn() }
+      catch (e) { this.release(); throw e }
+      return p.finally(() => this.release())
+    }
+    return wait == null ? go() : wait.then(go)
+  }
+
+  getStats(): QueueStats {
+    return {
+      ...this._stats,
+      limit: this.limit,
+      inFlight: this._inFlight,
+      queued: this.queued,
+    }
+  }
+}
+
+export class Limiter {
+  reads: Semaphore
+  commits: Semaphore
+
+  constructor(limits: ConcurrencyLimits) {
+    const maxQueued = limits.maxQueued == null ? Infinity : limits.maxQueued
+    this.reads = new Semaphore(limits.maxReads || 0, maxQueued)
+    this.commits = new Semaphore(limits.maxCommits || 0, maxQueued)
+  }
+
+  setLimits(limits: ConcurrencyLimits) {
+    const maxQueued = limits.maxQueued == null ? Infinity : limits.maxQueued
+    for (const [sem, limit] of [[this.reads, limits.maxReads], [this.commits, limits.maxCommits]] as [Semaphore, number | undefined][]) {
+      sem.limit = limit || 0
+      sem.maxQueued = maxQueued
+      sem._wake()
+    }
+  }
+
+  getStats(): ConcurrencyStats {
+    return { reads: this.reads.getStats(), commits: this.commits.getStats() }
+  }
+}
+
+const limiters = new WeakMap<NativeDatabase, Limiter>()
+
+export const getLimiter = (db: NativeDatabase): Limiter | undefined => limiters.get(db)
+
+export const setLimits = (db: NativeDatabase, limits: ConcurrencyLimits) => {
+  const limiter = limiters.get(db)
+  if (limiter) limiter.setLimits(limits)
+  else limiters.set(db, new Limiter(limits))
+}
@@ -1,11 +1,213 @@
+// Locality information. FDB stores the mapping from key ranges (shards) to the
+// storage servers responsible for them in the system keyspace, under
+// \xff/keyServers/<shard begin key>. This module reads that mapping so work
+// like parallel scans and bulk loads can be split along shard boundaries.
+//
+// All keys here are raw keys from the root of the database - the subspace of
+// the database reference passed in is ignored.
+
 import Database from './database'
-import Transaction from './transaction'
+import FDBError from './error'
+import { StreamingMode } from './opts.g'
+import { forEachConcurrently, strNext } from './util'
+
+const KEY_SERVERS_PREFIX = Buffer.from('\xff/keyServers/', 'latin1')
+
+const ERR_TRANSACTION_TOO_OLD = 1007
+
+// Shard address lookups made per transaction, and transactions run at once.
+const LOOKUPS_PER_TXN = 256
+const LOOKUP_CONCURRENCY = 4
+
+/**
+ * Stream the keys at which shards begin, for every shard which starts in
+ * [begin, end). Note the shard containing begin may start before begin.
+ *
+ * Boundaries are read with a series of snapshot transactions, so a long
+ * stream does not need to fit inside FDB's 5 second transaction limit. The
+ * returned boundaries may not be a consistent snapshot of the shard map.
+ */
+export async function* getBoundaryKeys(db: Database<any, any, any, any>, begin: Buffer, end: Buffer): AsyncGenerator<Buffer, void, undefined> {
+  const rawDb = db.getRoot()
+  const rangeEnd = Buffer.concat([KEY_SERVERS_PREFIX, end])
+  let start = Buffer.concat([KEY_SERVERS_PREFIX, begin])
+
+  let tn = rawDb.rawCreateTransaction({read_system_keys: true, lock_aware: true})
+  while (Buffer.compare(start, rangeEnd) < 0) {
+    const lastStart = start
+    try {
+      for await (const batch of tn.snapshot().getRangeBatch(start, rangeEnd, {streamingMode: StreamingMode.WantAll})) {
+        for (let i = 0; i < batch.length; i++) {
+          yield batch[i][0].slice(KEY_SERVERS_PREFIX.length)
+          start = strNext(batch[i][0])
+        }
+      }
+      return
+    } catch (e) {
+      // Long reads will run into the transaction time limit. If we've made
+      // progress, just keep going in a new transaction.
+      if (e instanceof FDBError && e.code === ERR_TRANSACTION_TOO_OLD && start !== lastStart) {
+        tn = rawDb.rawCreateTransaction({read_system_keys: true, lock_aware: true})
+      } else if (e instanceof FDBError) {
+        await tn.rawOnError(e.code)
+      } else throw e
+    }
+  }
+}
+
+/** Get the addresses of the storage servers responsible for a key. */
+export const getAddressesForKey = (db: Database<any, any, any, any>, key: Buffer): Promise<string[]> => (
+  db.getRoot().doTn(tn => tn.getAddressesForKey(key), {read_system_keys: true, lock_aware: true})
+)
+
+export interface Shard {
+  /** First key in the shard. */
+  begin: Buffer,
+  /** End of the shard (exclusive). */
+  end: Buffer,
+  /** Addresses of the storage servers holding the shard. */
+  addresses: string[],
+}
+
+export interface ShardMapOptions {
+  /** Start of the range to map. Defaults to the start of the keyspace. */
+  begin?: undefined | Buffer,
+  /** End of the range to map. Defaults to the end of the normal keyspace (\xff). */
+  end?: undefined | Buffer,
+  /** Refresh the map if it is older than this. Defaults to 60 seconds. */
+  maxAgeMs?: undefined | number,
+}
+
+// Errors which mean our idea of where data lives is out of date.
+const STALE_LOCATION_ERRORS = new Set([
+  1001, // wrong_shard_server
+  1006, // all_alternatives_failed
+])
+
+const DEFAULT_MAX_AGE_MS = 60 * 1000
+
+/**
+ * A cached map from keys to the shards (and storage servers) which hold them.
+ * The map is loaded lazily and refreshed once it is older than maxAgeMs, when
+ * invalidate() is called, or when an error passed to noteError() says our
+ * location information is stale.
+ */
+export class ShardMap {
+  db: Database<any, any, any, any>
+  begin: Buffer
+  end: Buffer
+  maxAgeMs: number
+
+  private _shards: Shard[] | null = null
+  private _loadedAt = 0
+  private _loading: Promise<Shard[]> | null = null
+
+  constructor(db: Database<any, any, any, any>, opts: ShardMapOptions = {}) {
+    this.db = db
+    this.begin = opts.begin || Buffer.alloc(0)
+    this.end = opts.end || Buffer.from([0xff])
+    this.maxAgeMs = opts.maxAgeMs == null ? DEFAULT_MAX_AGE_MS : opts.maxAgeMs
+  }
+
+  /** Force the map to be reloaded next time it is used. */
+  invalidate() {
+    this._shards = null
+  }
+
+  /**
+   * Call this with errors from operations which were routed using the map.
+   * Returns true (and invalidates the map) if the error means the map is stale.
+   */
+  noteError(err: any): boolean {
+    if (err instanceof FDBError && STALE_LOCATION_ERRORS.has(err.code)) {
+      this.invalidate()
+      return true
+    }
+    return false
+  }
+
+  /** Reload the map now. */
+  refresh(): Promise<Shard[]> {
+    if (this._loading == null) {
+      this._loading = this._load().then(shards => {
+        this._shards = shards
+        this._loadedAt = Date.now()
+        this._loading = null
+        return shards
+      }, err => {
+        this._loading = null
+        throw err
+      })
+    }
+    return this._loading
+  }
+
+  /** Get all shards in the mapped range, refreshing the map if needed. */
+  getShards(): Promise<Shard[]> {
+    if (this._shards != null && Date.now() - this._loadedAt < this.maxAgeMs) return Promise.resolve(this._shards)
+    return this.refresh()
+  }
+
+  /** Find the shard containing key. */
+  async locate(key: Buffer): Promise<Shard> {
+    const shards = await this.getShards()
+    if (Buffer.compare(key, this.begin) < 0 || Buffer.compare(key, this.end) >= 0) {
+      throw new RangeError('Key is outside the range covered by the shard map')
+    }
+
+    // Binary search for the last shard starting at or before key.
+    let lo = 0, hi = shards.length - 1
+    while (lo < hi) {
+      const mid = (lo + hi + 1) >> 1
+      if (Buffer.compare(shards[mid].begin, key) <= 0) lo = mid
+      else hi = mid - 1
+    }
+    return shards[lo]
+  }
+
+  /**
+   * Split [begin, end) along shard boundaries. The first and last ranges are
+   * clipped to begin and end.
+   */
+  async split(begin: Buffer, end: Buffer): Promise<Shard[]> {
+    const shards = await this.getShards()
+    const result: Shard[] = []
+    for (const s of shards) {
+      if (Buffer.compare(s.end, begin) <= 0) continue
+      if (Buffer.compare(s.begin, end) >= 0) break
+      result.push({
+        begin: Buffer.compare(s.begin, begin) < 0 ? begin : s.begin,
+        end: Buffer.compare(s.end, end) > 0 ? end : s.end,
+        addresses: s.addresses,
+      })
+    }
+    return result
+  }
+
+  private async _load(): Promise<Shard[]> {
+    const boundaries: Buffer[] = []
+    for await (const key of getBoundaryKeys(this.db, this.begin, this.end)) boundaries.push(key)
+
+    // The shard containing begin usually starts before it.
+    if (boundaries.length === 0 || Buffer.compare(boundaries[0], this.begin) > 0) boundaries.unshift(this.begin)
 
-export const getBoundaryKeys = (db: Database, begin: Buffer, end: Buffer) => {
-  const tn = db.rawCreateTransaction({
-    read_system_keys: true,
-    lock_aware: true,
-  })
+    const shards: Shard[] = boundaries.map((begin, i) => ({
+      begin: Buffer.compare(begin, this.begin) < 0 ? this.begin : begin,
+      end: i + 1 < boundaries.length ? boundaries[i + 1] : this.end,
+      addresses: [],
+    }))
 
-  
-}
\ No newline at end of file
+    // Address lookups are mostly served from the client's location cache,
+    // but a large cluster has too many shards to look up inside one
+    // transaction's 5 second limit. Each chunk gets its own transaction.
+    const rawDb = this.db.getRoot()
+    const chunks: Shard[][] = []
+    for (let i = 0; i < shards.length; i += LOOKUPS_PER_TXN) chunks.push(shards.slice(i, i + LOOKUPS_PER_TXN))
+    await forEachConcurrently(chunks, LOOKUP_CONCURRENCY, chunk => (
+      rawDb.doTn(tn => Promise.all(chunk.map(async s => {
+        s.addresses = await tn.getAddressesForKey(s.begin)
+      })), {read_system_keys: true, lock_aware: true}).then(() => {})
+    ))
+    return shards
+  }
+}
@@ -0,0 +1,184 @@
+// Client side metrics. Every FDB client process has a single network thread
+// (started by startNetwork) which does all the client's work: serializing
+// requests, talking to the cluster and resolving futures. Once it is
+// saturated, adding concurrency in JS just makes everything slower, and the
+// fix is to spread the work over more processes.
+//
+// There are two signals for that. The network thread's CPU time tells you how
+// busy it is - a thread using close to a full core is saturated. And every
+// future it resolves is queued back to the JS thread, so the time callbacks
+// spend waiting there shows when the JS thread is the one falling behind.
+
+import nativeMod from './native'
+
+export interface NetworkStats {
+  /** Whether the network thread has been started. */
+  running: boolean,
+  /** CPU time used by the network thread, in seconds. -1 if the platform doesn't report it. */
+  threadCpuSeconds: number,
+  /** Wall clock time since the network thread was started, in seconds. */
+  uptimeSeconds: number,
+
+  /** Futures resolved on the network thread and queued for this JS thread. */
+  callbacksQueued: number,
+  /** Futures which were already resolved, and were handled without queueing. */
+  callbacksInline: number,
+  /** Total time queued callbacks waited for the JS thread, in seconds. */
+  callbackDelaySeconds: number,
+  /** Cumulative histogram of the callback delay. The last bucket has le: Infinity. */
+  callbackDelayBuckets: {le: number, count: number}[],
+}
+
+/**
+ * Read the network thread's stats. Callback stats are counted separately for
+ * each JS thread (main thread or worker) using the module. All values are
+ * cumulative. Use NetworkSampler for rates.
+ */
+export function getNetworkStats(): NetworkStats {
+  const raw = nativeMod.getNetworkStats()
+
+  let count = 0
+  const callbackDelayBuckets = raw.callbackDelayBuckets.map((n, i) => {
+    count += n
+    const bound = raw.callbackDelayBoundsUs[i]
+    return {le: bound == null ? Infinity : bound / 1e6, count}
+  })
+
+  return {
+    running: raw.running,
+    threadCpuSeconds: raw.threadCpuNs < 0 ? -1 : raw.threadCpuNs / 1e9,
+    uptimeSeconds: raw.uptimeNs / 1e9,
+    callbacksQueued: raw.callbacksQueued,
+    callbacksInline: raw.callbacksInline,
+    callbackDelaySeconds: raw.callbackDelayNs / 1e9,
+    callbackDelayBuckets,
+  }
+}
+
+export interface NativeTransactionStats {
+  /** Native transactions which haven't been disposed or garbage collected. */
+  live: number,
+  /** Native memory held by live transactions' buffered writes, as reported to V8. */
+  externalBytes: number,
+}
+
+/** Count the native transactions alive in this process, across all threads. */
+export const getTransactionStats = (): NativeTransactionStats => nativeMod.getTransactionStats()
+
+export interface NetworkSample {
+  /** Time covered by this sample, in milliseconds. */
+  intervalMs: number,
+  /**
+   * Fraction of the interval the network thread spent running (0-1). Values
+   * near 1 mean it is saturated. -1 if CPU time isn't available.
+   */
+  busy: number,
+  callbacksPerSecond: number,
+  meanCallbackDelayMs: number,
+  /** Upper bound of the histogram bucket containing the 99th percentile. */
+  p99CallbackDelayMs: number,
+}
+
+/**
+ * Turns the cumulative network stats into rates. Each call to sample()
+ * reports on the time since the previous call (or since the sampler was
+ * created). Eg:
+ *
+ * ```
+ * const sampler = new fdb.NetworkSampler()
+ * setInterval(() => {
+ *   const {busy} = sampler.sample()
+ *   if (busy > 0.8) console.warn('fdb network thread is saturated')
+ * }, 10000)
+ * ```
+ */
+export class NetworkSampler {
+  private _prev: NetworkStats
+  private _prevAt: number
+
+  constructor() {
+    this._prev = getNetworkStats()
+    this._prevAt = Date.now()
+  }
+
+  sample(): NetworkSample {
+    const now = Date.now()
+    const stats = getNetworkStats()
+    const prev = this._prev
+    const intervalMs = Math.max(now - this._prevAt, 1)
+    this._prev = stats
+    this._prevAt = now
+
+    const callbacks = stats.callbacksQueued - prev.callbacksQueued
+    const delay = stats.callbackDelaySeconds - prev.callbackDelaySeconds
+
+    let p99CallbackDelayMs = 0
+    if (callbacks > 0) {
+      const target = callbacks * 0.99
+      for (let i = 0; i < stats.callbackDelayBuckets.length; i++) {
+        const b = stats.callbackDelayBuckets[i]
+        if (b.count - prev.callbackDelayBuckets[i].count >= target) {
+          p99CallbackDelayMs = b.le * 1000
+          break
+        }
+      }
+    }
+
+    // The network thread may have been started since the last sample.
+    const cpu = stats.threadCpuSeconds - (prev.running ? prev.threadCpuSeconds : 0)
+    return {
+      intervalMs,
+      busy: stats.threadCpuSeconds < 0 ? -1 : Math.min(cpu * 1000 / intervalMs, 1),
+      callbacksPerSecond: callbacks * 1000 / intervalMs,
+      meanCallbackDelayMs: callbacks > 0 ? delay * 1000 / callbacks : 0,
+      p99CallbackDelayMs,
+    }
+  }
+}
+
+/**
+ * Render the network and transaction stats in the Prometheus text exposition
+ * format, for serving from a /metrics endpoint or appending to an existing
+ * exporter's output. Metric names start with prefix (default 'fdb_').
+ */
+export function prometheusMetrics(opts: {prefix?: undefined | string, labels?: undefined | {[k: string]: string}} = {}): string {
+  const prefix = opts.prefix == null ? 'fdb_' : opts.prefix
+  const labels = opts.labels ? Object.entries(opts.labels) : []
+  const fmtLabels = (extra: [string, string][] = []) => {
+    const all = labels.concat(extra)
+    return all.length === 0 ? '' : '{' + all.map(([k, v]) => `${k}="${escapeLabel(v)}"`).join(',') + '}'
+  }
+
+  const stats = getNetworkStats()
+  const txns = getTransactionStats()
+  const lines: string[] = []
+  const metric = (name: string, type: string, help: string, samples: [string, [string, string][], number][]) => {
+    lines.push(`# HELP ${prefix}${name} ${help}`, `# TYPE ${prefix}${name} ${type}`)
+    for (const [suffix, extra, val] of samples) lines.push(`${prefix}${name}${suffix}${fmtLabels(extra)} ${fmtNum(val)}`)
+  }
+
+  metric('network_running', 'gauge', 'Whether the FDB network thread is running.',
+    [['', [], stats.running ? 1 : 0]])
+  if (stats.threadCpuSeconds >= 0) metric('network_thread_cpu_seconds_total', 'counter', 'CPU time used by the FDB network thread.',
+    [['', [], stats.threadCpuSeconds]])
+  metric('network_uptime_seconds', 'gauge', 'Time since the FDB network thread was started.',
+    [['', [], stats.uptimeSeconds]])
+  metric('callbacks_total', 'counter', 'Futures resolved back to the JS thread.', [
+    ['', [['path', 'queued']], stats.callbacksQueued],
+    ['', [['path', 'inline']], stats.callbacksInline],
+  ])
+  metric('callback_delay_seconds', 'histogram', 'Time resolved futures waited for the JS thread.', [
+    ...stats.callbackDelayBuckets.map(b => ['_bucket', [['le', b.le === Infinity ? '+Inf' : String(b.le)]], b.count] as [string, [string, string][], number]),
+    ['_sum', [], stats.callbackDelaySeconds],
+    ['_count', [], stats.callbacksQueued],
+  ])
+  metric('live_transactions', 'gauge', 'Native FDB transactions which have not been destroyed.',
+    [['', [], txns.live]])
+  metric('transaction_external_bytes', 'gauge', 'Native memory held by live FDB transactions.',
+    [['', [], txns.externalBytes]])
+
+  return lines.join('\n') + '\n'
+}
+
+const escapeLabel = (v: string) => v.replace(/\\/g, '\\\\').replace(/\n/g, '\\n').replace(/"/g, '\\"')
+const fmtNum = (n: number) => n === Infinity ? '+Inf' : String(n)
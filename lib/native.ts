@@ -24,11 +24,17 @@ export type Version = Buffer
 
 export interface NativeTransaction {
   setOption(code: number, param: string | number | Buffer | null): void
+  setOptionsPacked(packed: Buffer): void
 
   commit(): Promise<void>
   commit(cb: Callback<void>): void
+  // Commit and resolve with the committed version, plus the versionstamp if
+  // requested (and the transaction wrote something).
+  commitAndFinalize(wantVersionstamp: boolean): Promise<{committedVersion: Version, versionstamp?: Buffer}>
   reset(): void
   cancel(): void
+  // Destroy the native transaction immediately. Later calls throw.
+  destroy(): void
   onError(code: number, cb: Callback<void>): void
   onError(code: number): Promise<void>
 
@@ -52,6 +58,16 @@ export interface NativeTransaction {
     mode: StreamingMode, iter: number, isSnapshot: boolean, reverse: boolean
   ): Promise<KVList>
 
+  // Every returned key must start with stripPrefix. The prefix is removed
+  // from keys natively as they're copied out.
+  getRange(
+    start: NativeValue, beginOrEq: boolean, beginOffset: number,
+    end: NativeValue, endOrEq: boolean, endOffset: number,
+    limit: number, target_bytes: number,
+    mode: StreamingMode, iter: number, isSnapshot: boolean, reverse: boolean,
+    cb: undefined, stripPrefix: Buffer | null
+  ): Promise<KVList>
+
   getRange(
     start: NativeValue, beginOrEq: boolean, beginOffset: number,
     end: NativeValue, endOrEq: boolean, endOffset: number,
@@ -77,11 +93,13 @@ export interface NativeTransaction {
   getVersionstamp(): Promise<Buffer>
   getVersionstamp(cb: Callback<Buffer>): void
 
-  getAddressesForKey(key: NativeValue): string[]
+  getAddressesForKey(key: NativeValue): Promise<string[]>
 }
 
 export interface NativeDatabase {
   createTransaction(): NativeTransaction // invalid after the database has closed
+  // Resolves to the client status JSON document.
+  getClientStatus(): Promise<Buffer>
   setOption(code: number, param: string | number | Buffer | null): void
   close(): void
 }
@@ -92,6 +110,17 @@ export enum ErrorPredicate {
   RetryableNotCommitted = 50002,
 }
 
+export type NativeNetworkStats = {
+  running: boolean,
+  threadCpuNs: number, // -1 if unavailable.
+  uptimeNs: number,
+  callbacksQueued: number,
+  callbacksInline: number,
+  callbackDelayNs: number,
+  callbackDelayBoundsUs: number[],
+  callbackDelayBuckets: number[], // One more than the bounds.
+}
+
 export interface NativeModule {
   setAPIVersion(v: number): void
   setAPIVersionImpl(v: number, h: number): void
@@ -104,6 +133,17 @@ export interface NativeModule {
   setNetworkOption(code: number, param: string | number | Buffer | null): void
 
   errorPredicate(test: ErrorPredicate, code: number): boolean
+
+  getNetworkStats(): NativeNetworkStats
+  getTransactionStats(): {live: number, externalBytes: number}
+
+  // Value compression. These return the input buffer itself when it's stored
+  // unchanged. The batch versions run on the libuv threadpool.
+  compress(data: Buffer, dict: Buffer | null, dictId: number, minBytes: number): Buffer
+  decompress(data: Buffer, dict: Buffer | null): Buffer
+  compressBatch(data: Buffer[], dict: Buffer | null, dictId: number, minBytes: number): Promise<Buffer[]>
+  decompressBatch(data: Buffer[], dict: Buffer | null): Promise<Buffer[]>
+  trainDictionary(samples: Buffer[], size: number): Buffer
 }
 
 // Will load a compiled build if present or a prebuild.
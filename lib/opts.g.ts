@@ -499,7 +499,9 @@ export type TransactionOptions = {
   special_key_space_relaxed?: undefined | true
   special_key_space_enable_writes?: undefined | true
   tag?: undefined | string  // String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.
+  tags?: undefined | string[]  // Sets tag once for each entry
   auto_throttle_tag?: undefined | string  // String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.
+  auto_throttle_tags?: undefined | string[]  // Sets auto_throttle_tag once for each entry
   span_parent?: undefined | Buffer  // A byte string of length 16 used to associate the span of this transaction with a parent
   expensive_clear_cost_estimation_enable?: undefined | true
   bypass_unreadable?: undefined | true
@@ -1114,7 +1116,14 @@ export enum ErrorPredicate {
 
 }
 
-export const networkOptionData: OptionData = {
+// The option tables are only built the first time they're used, so loading
+// the module doesn't pay for them.
+const lazy = (build: () => OptionData) => {
+  let data: OptionData | null = null
+  return () => data || (data = build())
+}
+
+export const networkOptionData = lazy(() => ({
   local_address: {
     code: 10,
     description: "Deprecated",
@@ -1421,9 +1430,9 @@ export const networkOptionData: OptionData = {
     paramDescription: "Transport ID for the child connection",
   },
 
-}
+}))
 
-export const databaseOptionData: OptionData = {
+export const databaseOptionData = lazy(() => ({
   location_cache_size: {
     code: 10,
     description: "Set the size of the client location cache. Raising this value can boost performance in very large databases where clients access data in a near-random pattern. Defaults to 100000.",
@@ -1535,9 +1544,9 @@ export const databaseOptionData: OptionData = {
     type: 'none',
   },
 
-}
+}))
 
-export const transactionOptionData: OptionData = {
+export const transactionOptionData = lazy(() => ({
   causal_write_risky: {
     code: 10,
     description: "The transaction, if not self-conflicting, may be committed a second time after commit succeeds, in the event of a fault",
@@ -1803,6 +1812,14 @@ export const transactionOptionData: OptionData = {
     paramDescription: "String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.",
   },
 
+  tags: {
+    code: 800,
+    description: "Adds a tag to the transaction that can be used to apply manual targeted throttling. At most 5 tags can be set on a transaction.",
+    repeated: true,
+    type: 'string',
+    paramDescription: "String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.",
+  },
+
   auto_throttle_tag: {
     code: 801,
     description: "Adds a tag to the transaction that can be used to apply manual or automatic targeted throttling. At most 5 tags can be set on a transaction.",
@@ -1810,6 +1827,14 @@ export const transactionOptionData: OptionData = {
     paramDescription: "String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.",
   },
 
+  auto_throttle_tags: {
+    code: 801,
+    description: "Adds a tag to the transaction that can be used to apply manual or automatic targeted throttling. At most 5 tags can be set on a transaction.",
+    repeated: true,
+    type: 'string',
+    paramDescription: "String identifier used to associated this transaction with a throttling group. Must not exceed 16 characters.",
+  },
+
   span_parent: {
     code: 900,
     description: "Adds a parent to the Span of this transaction. Used for transaction tracing. A span can be identified with any 16 bytes",
@@ -1848,5 +1873,5 @@ export const transactionOptionData: OptionData = {
     paramDescription: "A JSON Web Token authorized to access data belonging to one or more tenants, indicated by 'tenants' claim of the token's payload.",
   },
 
-}
+}))
 
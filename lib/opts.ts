@@ -1,10 +1,12 @@
 import {DatabaseOptions, NetworkOptions, TransactionOptions} from './opts.g'
+import {tagsOf} from './tags'
 
 export type OptionData = {
   [name: string]: {
     code: number,
     description: string,
     deprecated?: true,
+    repeated?: true, // The value is a list, and the option is set once per item.
     type: 'string' | 'int' | 'bytes' | 'none',
     paramDescription?: string, // only if not 'none'.
   }
@@ -12,7 +14,7 @@ export type OptionData = {
 
 export type OptVal = string | number | Buffer | null
 
-type GenericOptions = {[k: string]: OptVal}
+type GenericOptions = {[k: string]: OptVal | OptVal[]}
 
 export type OptionIter = (code: number, val: OptVal) => void
 export const eachOption = (data: OptionData, _opts: DatabaseOptions | NetworkOptions | TransactionOptions, iterfn: OptionIter) => {
@@ -24,10 +26,14 @@ export const eachOption = (data: OptionData, _opts: DatabaseOptions | NetworkOpt
       continue
     }
 
-    const {code, type} = details
-    const userVal = opts[k]
+    const {type} = details
+    const vals = details.repeated ? opts[k] as OptVal[] : [opts[k] as OptVal]
+    if (!Array.isArray(vals)) {
+      console.warn('unexpected value for key', k, 'expected a list')
+      continue
+    }
 
-    switch (type) {
+    for (const userVal of vals) switch (type) {
       case 'none':
         if ((userVal as any) !== true && userVal !== 1) console.warn(`Warning: Ignoring value ${userVal} for option ${k}`)
         iterfn(details.code, null)
@@ -42,3 +48,69 @@ export const eachOption = (data: OptionData, _opts: DatabaseOptions | NetworkOpt
     }
   }
 }
+
+const packOption = (k: string, code: number, type: OptionData[string]['type'], userVal: OptVal): Buffer => {
+  let val: Buffer | null
+  switch (type) {
+    case 'none':
+      if ((userVal as any) !== true && userVal !== 1) throw new TypeError(`Option ${k} does not take a value`)
+      val = null
+      break
+    case 'string': case 'bytes':
+      if (typeof userVal !== 'string' && !Buffer.isBuffer(userVal)) throw new TypeError(`Option ${k} expects a string or Buffer`)
+      val = Buffer.from(userVal as any)
+      break
+    case 'int':
+      if (typeof userVal !== 'number') throw new TypeError(`Option ${k} expects an integer`)
+      val = Buffer.alloc(8)
+      val.writeBigInt64LE(BigInt(userVal|0))
+      break
+  }
+
+  const result = Buffer.alloc(8 + (val == null ? 0 : val.length))
+  result.writeUInt32LE(code, 0)
+  result.writeInt32LE(val == null ? -1 : val.length, 4)
+  if (val != null) val.copy(result, 8)
+  return result
+}
+
+// Validate and encode a set of options into a single buffer, which the native
+// code can apply in one call with setOptionsPacked. Each option is encoded as
+// [code: u32 LE][length: i32 LE][value]. Options which take no value have a
+// length of -1. Integers are encoded as 8 byte little endian int64s, which is
+// what fdb_*_set_option expects.
+//
+// Unlike eachOption, this throws on unknown options and values of the wrong
+// type - it only runs once per profile, so its worth being strict.
+export const packOptions = (data: OptionData, _opts: DatabaseOptions | NetworkOptions | TransactionOptions): Buffer => {
+  const opts = _opts as GenericOptions
+  const parts: Buffer[] = []
+  for (const k in opts) {
+    const details = data[k]
+    if (details == null) throw new TypeError(`Unknown option ${k}`)
+
+    const vals = details.repeated ? opts[k] as OptVal[] : [opts[k] as OptVal]
+    if (!Array.isArray(vals)) throw new TypeError(`Option ${k} expects a list`)
+    for (const userVal of vals) parts.push(packOption(k, details.code, details.type, userVal))
+  }
+  return Buffer.concat(parts)
+}
+
+/**
+ * A set of transaction options which has been validated and encoded ahead of
+ * time. Create one with `db.createTransactionProfile(opts)` and pass it to
+ * `db.doTn()` in place of an options object. All the options are applied to
+ * the transaction in a single native call.
+ */
+export class TransactionProfile {
+  readonly options: Readonly<TransactionOptions>
+  /** @internal */ readonly _packed: Buffer
+  /** @internal */ readonly _tags: string[] | null
+
+  /** @internal */
+  constructor(data: OptionData, opts: TransactionOptions) {
+    this.options = Object.freeze({...opts})
+    this._packed = packOptions(data, opts)
+    this._tags = tagsOf(opts)
+  }
+}
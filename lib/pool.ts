@@ -0,0 +1,91 @@
+// A bounded pool of native transaction objects, shared by every Database
+// reference which wraps the same native database.
+//
+// Creating a transaction allocates an FDBTransaction and wraps it in a new JS
+// object, which db.doTn() destroys again once it finishes. Services running
+// lots of short transactions pay for that on every call. Instead, once doTn()
+// finishes we fdb_transaction_reset() the transaction (which puts it back into
+// the same state as a freshly created one) and hand it to the next caller.
+// Transactions which don't fit in the pool are destroyed.
+//
+// Pooling is opt in (db.setTransactionPoolSize(n)). Either way, a transaction
+// object must not be used after the doTn call which created it has returned.
+// Transactions which hand out something that outlives them (watches and
+// versionstamp promises) are never returned to the pool or destroyed early.
+
+import { NativeDatabase, NativeTransaction } from './native'
+
+export interface TransactionPoolStats {
+  /** Maximum number of idle transactions kept in the pool. */
+  maxSize: number,
+  /** Number of idle transactions currently in the pool. */
+  idle: number,
+  /** Native transactions created because the pool was empty. */
+  created: number,
+  /** Transactions handed out from the pool instead of being created. */
+  reused: number,
+  /** Transactions which were not returned to the pool. */
+  discarded: number,
+}
+
+export class TransactionPool {
+  private _db: NativeDatabase
+  private _idle: NativeTransaction[] = []
+  private _stats: TransactionPoolStats
+
+  constructor(db: NativeDatabase, maxSize: number) {
+    this._db = db
+    this._stats = {maxSize, idle: 0, created: 0, reused: 0, discarded: 0}
+  }
+
+  setMaxSize(maxSize: number) {
+    this._stats.maxSize = maxSize
+    while (this._idle.length > maxSize) this._idle.pop()!.destroy()
+  }
+
+  acquire(): NativeTransaction {
+    const tn = this._idle.pop()
+    if (tn) {
+      this._stats.reused++
+      return tn
+    }
+    this._stats.created++
+    return this._db.createTransaction()
+  }
+
+  // reusable should be false if anything may still be holding futures from
+  // the transaction.
+  release(tn: NativeTransaction, reusable: boolean) {
+    if (!reusable || this._idle.length >= this._stats.maxSize) {
+      this._stats.discarded++
+      if (reusable) tn.destroy()
+      return
+    }
+    tn.reset()
+    this._idle.push(tn)
+  }
+
+  clear() {
+    for (const tn of this._idle) tn.destroy()
+    this._idle.length = 0
+  }
+
+  getStats(): TransactionPoolStats {
+    return {...this._stats, idle: this._idle.length}
+  }
+}
+
+const pools = new WeakMap<NativeDatabase, TransactionPool>()
+
+export const getPool = (db: NativeDatabase): TransactionPool | undefined => pools.get(db)
+
+export const setPoolSize = (db: NativeDatabase, maxSize: number) => {
+  const pool = pools.get(db)
+  if (maxSize <= 0) {
+    if (pool) {
+      pool.clear()
+      pools.delete(db)
+    }
+  } else if (pool) pool.setMaxSize(maxSize)
+  else pools.set(db, new TransactionPool(db, maxSize))
+}
@@ -0,0 +1,331 @@
+// A durable work queue. Items are written to versionstamped keys, so producers
+// never conflict with each other or with consumers, and items come out in
+// commit order.
+//
+// The queue's subspace is laid out as:
+//
+//   <prefix> 01 <versionstamp> <code>  => <enqueued at> <value>        Items
+//   <prefix> 02 <versionstamp> <code>  => <deadline> <token> <enqueued at> <value>  Leases
+//   <prefix> 03 ...                                                    Depth counter shards
+//   <prefix> 04                        => int64 LE                     Wakeup key
+//
+// Consumers claim items by moving them from the item range into the lease
+// range. If every consumer took items from the head of the queue they would
+// all conflict with each other, so each consumer snapshot reads a window of
+// items from the head and claims a run starting at a random offset within it.
+// Only the claimed keys are added as read conflicts. Claimed items must be
+// acknowledged before their lease runs out, or they are returned to the queue.
+//
+// Every enqueue also does an atomic add on the wakeup key, so consumers
+// waiting on an empty queue can watch it instead of polling.
+
+import Database from './database'
+import Transaction from './transaction'
+import Subspace, { GetSubspace, root } from './subspace'
+import { Watch } from './native'
+import { MutationType } from './opts.g'
+import { ShardedCounter } from './counter'
+import { doTxn, strInc, strNext } from './util'
+import { randomBytes } from 'crypto'
+
+export interface QueueOptions {
+  /** How long a consumer may hold an item before it is returned to the queue. Defaults to 30 seconds. */
+  leaseMs?: undefined | number,
+  /**
+   * Number of items at the head of the queue consumers pick from. This should
+   * be comfortably larger than the number of consumers times the number of
+   * items each one claims at a time. Defaults to 64.
+   */
+  window?: undefined | number,
+}
+
+export interface ClaimOptions {
+  /** Maximum number of items to claim. Defaults to 1. */
+  max?: undefined | number,
+  /**
+   * If the queue is empty, wait up to this long for an item to arrive.
+   * Defaults to 0 (don't wait).
+   */
+  waitMs?: undefined | number,
+}
+
+export interface QueueItem<T> {
+  /** Unique, ordered id of the item (its versionstamp and code). */
+  id: Buffer,
+  value: T,
+  /** When the item was enqueued (ms since the epoch, producer clock). */
+  enqueuedAt: number,
+  /** When the lease on the item expires (ms since the epoch). */
+  deadline: number,
+  /** @internal */
+  _token: Buffer,
+}
+
+export interface WorkQueueStats {
+  enqueued: number,
+  claimed: number,
+  acked: number,
+  /** Items returned to the queue with release(). */
+  released: number,
+  /** Items returned to the queue after their lease expired. */
+  requeued: number,
+  /** Smoothed time items spent in the queue before being claimed. */
+  latencyMs: number,
+  maxLatencyMs: number,
+}
+
+const DEFAULT_LEASE_MS = 30 * 1000
+const DEFAULT_WINDOW = 64
+const EWMA_ALPHA = 0.2
+
+const ITEMS = 1
+const LEASES = 2
+const DEPTH = 3
+const WAKEUP = 4
+
+const TOKEN_BYTES = 8
+const ONE = Buffer.from([1, 0, 0, 0, 0, 0, 0, 0])
+
+type RawTxn = Transaction<Buffer, Buffer, Buffer, Buffer>
+
+// Run body with a transaction scoped to the root of the database.
+const doRawTxn = <T>(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>,
+    body: (tn: RawTxn) => Promise<T>): Promise<T> => (
+  doTxn(dbOrTxn, tn => body(tn.at(root) as RawTxn))
+)
+
+const writeTime = (buf: Buffer, time: number, offset: number) => buf.writeDoubleBE(time, offset)
+
+export class Queue<ValIn = Buffer, ValOut = Buffer> {
+  subspace: Subspace<any, any, ValIn, ValOut>
+  leaseMs: number
+  window: number
+
+  private _items: Buffer
+  private _itemsEnd: Buffer
+  private _leases: Buffer
+  private _leasesEnd: Buffer
+  private _wakeup: Buffer
+  private _depth: ShardedCounter
+  private _stats: WorkQueueStats = {enqueued: 0, claimed: 0, acked: 0, released: 0, requeued: 0, latencyMs: 0, maxLatencyMs: 0}
+
+  /** Create a queue stored in the subspace of space. Values use the subspace's value encoding. */
+  constructor(space: GetSubspace<any, any, ValIn, ValOut>, opts: QueueOptions = {}) {
+    this.subspace = space.getSubspace()
+    this.leaseMs = opts.leaseMs || DEFAULT_LEASE_MS
+    this.window = opts.window || DEFAULT_WINDOW
+
+    const prefix = this.subspace.prefix
+    this._items = Buffer.concat([prefix, Buffer.from([ITEMS])])
+    this._itemsEnd = strInc(this._items)
+    this._leases = Buffer.concat([prefix, Buffer.from([LEASES])])
+    this._leasesEnd = strInc(this._leases)
+    this._wakeup = Buffer.concat([prefix, Buffer.from([WAKEUP])])
+    this._depth = new ShardedCounter(this.subspace.atRaw(Buffer.from([DEPTH])))
+  }
+
+  /**
+   * Add an item to the queue as part of a transaction. Items enqueued in the
+   * same transaction keep their relative order.
+   */
+  enqueue(tn: Transaction<any, any, any, any>, value: ValIn) {
+    const raw = tn.at(root) as RawTxn
+    const code = Buffer.alloc(2)
+    code.writeUInt16BE(raw.getNextTransactionID(), 0)
+
+    const packed = this.subspace.packValue(value)
+    const val = Buffer.alloc(8 + Buffer.byteLength(packed))
+    writeTime(val, Date.now(), 0)
+    if (typeof packed === 'string') val.write(packed, 8)
+    else packed.copy(val, 8)
+
+    raw.setVersionstampSuffixedKey(this._items, val, code)
+    raw.atomicOpNative(MutationType.Add, this._wakeup, ONE)
+    this._depth.add(raw, 'depth')
+    raw._afterCommit(() => this._stats.enqueued++)
+  }
+
+  /** Add a batch of items to the queue in a single transaction. */
+  push(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, values: ValIn[]): Promise<void> {
+    return doRawTxn(dbOrTxn, async tn => {
+      for (let i = 0; i < values.length; i++) this.enqueue(tn, values[i])
+    })
+  }
+
+  /**
+   * Claim up to opts.max items. Claimed items are leased to the caller until
+   * item.deadline, and must be passed to ack() once processed. Returns an
+   * empty list if no items arrived within opts.waitMs.
+   */
+  async claim(db: Database<any, any, any, any>, opts: ClaimOptions = {}): Promise<QueueItem<ValOut>[]> {
+    const max = opts.max || 1
+    const waitUntil = Date.now() + (opts.waitMs || 0)
+    const rawDb = db.getRoot()
+
+    while (true) {
+      let watch: Watch | null = null
+      const items = await rawDb.doTn(async tn => {
+        watch = null
+        const head = await tn.snapshot().getRangeAll(this._items, this._itemsEnd, {limit: Math.max(this.window, max)})
+        if (head.length === 0) {
+          if (Date.now() < waitUntil) watch = tn.watch(this._wakeup)
+          return []
+        }
+
+        const now = Date.now()
+        const start = Math.floor(Math.random() * Math.max(1, head.length - max + 1))
+        const claimed: QueueItem<ValOut>[] = []
+        for (let i = start; i < head.length && claimed.length < max; i++) {
+          const [key, val] = head[i]
+          // If another consumer claims this item first, we conflict and retry.
+          tn.addReadConflictKey(key)
+          tn.clear(key)
+
+          const id = key.slice(this._items.length)
+          const token = randomBytes(TOKEN_BYTES)
+          const deadline = now + this.leaseMs
+          tn.set(this._leaseKey(id), this._packLease(deadline, token, val))
+          claimed.push({
+            id, deadline, _token: token,
+            enqueuedAt: val.readDoubleBE(0),
+            value: this.subspace.unpackValue(val.slice(8)),
+          })
+        }
+        return claimed
+      })
+
+      if (items.length) {
+        const now = Date.now()
+        for (const item of items) {
+          const latency = Math.max(0, now - item.enqueuedAt)
+          this._stats.latencyMs = this._stats.latencyMs === 0 ? latency : this._stats.latencyMs + EWMA_ALPHA * (latency - this._stats.latencyMs)
+          this._stats.maxLatencyMs = Math.max(this._stats.maxLatencyMs, latency)
+        }
+        this._stats.claimed += items.length
+        return items
+      }
+
+      // The queue might only look empty because items are stuck in expired
+      // leases.
+      if (await this.requeueExpired(db) > 0) continue
+
+      const w = watch as Watch | null
+      const remaining = waitUntil - Date.now()
+      if (w == null || remaining <= 0) {
+        if (w != null) w.cancel()
+        return []
+      }
+
+      // Wake up when an item is enqueued, or when it's time to check for
+      // expired leases again.
+      let timer: NodeJS.Timeout | null = null
+      await Promise.race([
+        w.promise,
+        new Promise<void>(resolve => { timer = setTimeout(resolve, Math.min(remaining, this.leaseMs)) }),
+      ])
+      if (timer != null) clearTimeout(timer)
+      w.cancel()
+    }
+  }
+
+  /**
+   * Mark a claimed item as done, removing it from the queue. Returns false if
+   * the lease had already expired and the item was given to another consumer.
+   */
+  ack(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, item: QueueItem<ValOut>): Promise<boolean> {
+    return doRawTxn(dbOrTxn, async tn => {
+      const key = this._leaseKey(item.id)
+      if (!this._holdsLease(await tn.get(key), item)) return false
+      tn.clear(key)
+      this._depth.add(tn, 'depth', -1)
+      tn._afterCommit(() => this._stats.acked++)
+      return true
+    })
+  }
+
+  /** Return a claimed item to the queue without processing it. */
+  release(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, item: QueueItem<ValOut>): Promise<boolean> {
+    return doRawTxn(dbOrTxn, async tn => {
+      const key = this._leaseKey(item.id)
+      const lease = await tn.get(key)
+      if (!this._holdsLease(lease, item)) return false
+      tn.clear(key)
+      tn.set(Buffer.concat([this._items, item.id]), lease!.slice(8 + TOKEN_BYTES))
+      tn._afterCommit(() => this._stats.released++)
+      return true
+    })
+  }
+
+  /** Extend the lease on a claimed item. Returns false if the lease was lost. */
+  extend(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>, item: QueueItem<ValOut>, leaseMs: number = this.leaseMs): Promise<boolean> {
+    return doRawTxn(dbOrTxn, async tn => {
+      const key = this._leaseKey(item.id)
+      const lease = await tn.get(key)
+      if (!this._holdsLease(lease, item)) return false
+      const deadline = Date.now() + leaseMs
+      tn.set(key, this._packLease(deadline, item._token, lease!.slice(8 + TOKEN_BYTES)))
+      item.deadline = deadline
+      return true
+    })
+  }
+
+  /**
+   * Return items whose lease has expired to the queue. Returns the number of
+   * items requeued. Leases are in claim order rather than deadline order, so
+   * this pages through all of them, window leases per transaction.
+   */
+  async requeueExpired(db: Database<any, any, any, any>): Promise<number> {
+    const rawDb = db.getRoot()
+    let total = 0
+    let cursor: Buffer | null = this._leases
+    while (cursor != null) {
+      const from: Buffer = cursor
+      const {n, next} = await rawDb.doTn(async tn => {
+        const now = Date.now()
+        const leases = await tn.snapshot().getRangeAll(from, this._leasesEnd, {limit: this.window})
+        let n = 0
+        for (const [key, lease] of leases) {
+          if (lease.readDoubleBE(0) > now) continue
+          // Conflict with a concurrent ack or extend.
+          tn.addReadConflictKey(key)
+          tn.clear(key)
+          tn.set(Buffer.concat([this._items, key.slice(this._leases.length)]), lease.slice(8 + TOKEN_BYTES))
+          n++
+        }
+        const next = leases.length < this.window ? null : strNext(leases[leases.length - 1][0])
+        return {n, next}
+      })
+      this._stats.requeued += n
+      total += n
+      cursor = next
+    }
+    return total
+  }
+
+  /** Number of items enqueued and not yet acknowledged, including leased items. */
+  getDepth(dbOrTxn: Database<any, any, any, any> | Transaction<any, any, any, any>): Promise<number> {
+    return this._depth.get(dbOrTxn, 'depth')
+  }
+
+  /** Counters for operations made through this queue object. */
+  getStats(): WorkQueueStats {
+    return {...this._stats}
+  }
+
+  private _leaseKey(id: Buffer) {
+    return Buffer.concat([this._leases, id])
+  }
+
+  // Lease values are the item value with the deadline and token in front.
+  private _packLease(deadline: number, token: Buffer, itemVal: Buffer) {
+    const buf = Buffer.alloc(8 + TOKEN_BYTES + itemVal.length)
+    writeTime(buf, deadline, 0)
+    token.copy(buf, 8)
+    itemVal.copy(buf, 8 + TOKEN_BYTES)
+    return buf
+  }
+
+  private _holdsLease(lease: Buffer | undefined, item: QueueItem<ValOut>) {
+    return lease != null && lease.slice(8, 8 + TOKEN_BYTES).equals(item._token)
+  }
+}
@@ -0,0 +1,310 @@
+// Secondary indexes. An index is declared over the rows of a database
+// reference (the primary subspace) with a key function which maps each row to
+// a tuple of index values. Writes made through index.set() and index.clear()
+// update the primary row and its index entry in the same transaction, so the
+// index never disagrees with the data it covers.
+//
+// Each index entry is stored at
+//   <index prefix> + tuple.pack([...values, <primary key bytes>])
+// with an empty value, where the primary key bytes are the row's raw key with
+// the primary prefix removed. Backfill checkpoints are kept at
+// <index prefix> + \xff, which can't collide with tuple encoded entries.
+//
+// Indexes added to existing data are built with backfill(), which splits the
+// primary range with getRangeSplitPoints and indexes the chunks concurrently
+// at batch priority. Progress is checkpointed as it goes, so an interrupted
+// backfill resumes where it left off. Backfills run online - rows written
+// through the index while a backfill is running are indexed correctly.
+
+import * as tuple from 'fdb-tuple'
+import { TupleItem } from 'fdb-tuple'
+import Database from './database'
+import Transaction from './transaction'
+import { GetSubspace, root } from './subspace'
+import { WorkloadClassName } from './workload'
+import { asBuf, forEachConcurrently, prefixEnd, strInc, strNext } from './util'
+
+/**
+ * Map a row to its index values. Return null or undefined to leave the row
+ * out of the index.
+ */
+export type IndexKeyFn<KeyOut, ValOut> = (value: ValOut, key: KeyOut) => TupleItem[] | null | undefined
+
+export interface BackfillOptions {
+  /** Approximate chunk size passed to getRangeSplitPoints. Defaults to 10MB. */
+  chunkBytes?: undefined | number,
+  /** Number of chunks indexed at once. Defaults to 4. */
+  concurrency?: undefined | number,
+  /** Rows read and indexed per transaction. Defaults to 500. */
+  batchRows?: undefined | number,
+  /** Workload class backfill transactions run in. Defaults to batch. */
+  workloadClass?: undefined | WorkloadClassName,
+  /** Called after each batch commits. */
+  onProgress?: undefined | ((stats: BackfillStats) => void),
+}
+
+export interface BackfillStats {
+  /** Rows read from the primary subspace. */
+  rows: number,
+  /** Index entries written. */
+  entries: number,
+  /** Chunks the primary range was split into (or resumed from checkpoints). */
+  chunks: number,
+  /** True if this backfill continued from an earlier interrupted one. */
+  resumed: boolean,
+  elapsedMs: number,
+}
+
+export interface VerifyOptions {
+  /** Rows (or index entries) checked per transaction. Defaults to 500. */
+  batchRows?: undefined | number,
+  /** Workload class verification transactions run in. Defaults to batch. */
+  workloadClass?: undefined | WorkloadClassName,
+  /** Maximum number of keys to report in missingKeys and danglingKeys. Defaults to 100. */
+  maxReported?: undefined | number,
+}
+
+export interface VerifyResult<KeyOut> {
+  /** Primary rows checked. */
+  rows: number,
+  /** Index entries checked. */
+  entries: number,
+  /** Rows whose index entry is missing. */
+  missing: number,
+  /** Index entries which don't match the current value of their row. */
+  dangling: number,
+  missingKeys: KeyOut[],
+  danglingKeys: KeyOut[],
+}
+
+const DEFAULT_CHUNK_BYTES = 10e6
+const DEFAULT_CONCURRENCY = 4
+const DEFAULT_BATCH_ROWS = 500
+const DEFAULT_MAX_REPORTED = 100
+
+const BUF_EMPTY = Buffer.alloc(0)
+const CHECKPOINT_PREFIX = Buffer.from('\xffbackfill/', 'latin1')
+
+type RawTxn = Transaction<Buffer, Buffer, Buffer, Buffer>
+
+export class SecondaryIndex<KeyIn, KeyOut, ValIn, ValOut> {
+  primary: Database<KeyIn, KeyOut, ValIn, ValOut>
+  prefix: Buffer
+  keyFn: IndexKeyFn<KeyOut, ValOut>
+
+  private _primaryPrefix: Buffer
+  private _primaryEnd: Buffer
+  private _checkpoints: Buffer
+
+  /**
+   * Create an index over the rows of primary. Index entries are stored in the
+   * subspace of index (a database, subspace or directory).
+   */
+  constructor(primary: Database<KeyIn, KeyOut, ValIn, ValOut>, index: GetSubspace<any, any, any, any>, keyFn: IndexKeyFn<KeyOut, ValOut>) {
+    this.primary = primary
+    this.prefix = index.getSubspace().prefix
+    this.keyFn = keyFn
+
+    this._primaryPrefix = primary.getPrefix()
+    this._primaryEnd = prefixEnd(this._primaryPrefix)
+    this._checkpoints = Buffer.concat([this.prefix, CHECKPOINT_PREFIX])
+
+    // Otherwise backfill() and verify() would treat index entries and
+    // checkpoints as rows.
+    if (Buffer.compare(this.prefix, this._primaryPrefix) >= 0 && Buffer.compare(this.prefix, this._primaryEnd) < 0) {
+      throw new Error('The index subspace cannot be inside the primary subspace')
+    }
+  }
+
+  // The raw index entry for a row, or null if the row isn't indexed.
+  private _entryFor(rawKey: Buffer, rawVal: Buffer): Buffer | null {
+    const subspace = this.primary.subspace
+    const values = this.keyFn(subspace.unpackValue(rawVal), subspace.unpackKey(rawKey))
+    if (values == null) return null
+    const pk = rawKey.slice(this._primaryPrefix.length)
+    return Buffer.concat([this.prefix, tuple.pack([...values, pk])])
+  }
+
+  // The raw primary key an index entry points to.
+  private _primaryKeyOf(entry: Buffer): Buffer {
+    const items = tuple.unpack(entry.slice(this.prefix.length))
+    return Buffer.concat([this._primaryPrefix, items[items.length - 1] as Buffer])
+  }
+
+  /**
+   * Set a row in the primary subspace and update its index entry. This reads
+   * the current value of the row, so tn must not be a snapshot transaction.
+   */
+  async set(tn: Transaction<any, any, any, any>, key: KeyIn, value: ValIn): Promise<void> {
+    const subspace = this.primary.subspace
+    const rawKey = asBuf(subspace.packKey(key))
+    const rawVal = asBuf(subspace.packValue(value))
+    const raw = tn.at(root) as RawTxn
+
+    const oldVal = await raw.get(rawKey)
+    const oldEntry = oldVal == null ? null : this._entryFor(rawKey, oldVal)
+    const newEntry = this._entryFor(rawKey, rawVal)
+
+    if (oldEntry != null && (newEntry == null || !oldEntry.equals(newEntry))) raw.clear(oldEntry)
+    if (newEntry != null) raw.set(newEntry, BUF_EMPTY)
+    raw.set(rawKey, rawVal)
+  }
+
+  /** Clear a row in the primary subspace along with its index entry. */
+  async clear(tn: Transaction<any, any, any, any>, key: KeyIn): Promise<void> {
+    const rawKey = asBuf(this.primary.subspace.packKey(key))
+    const raw = tn.at(root) as RawTxn
+
+    const oldVal = await raw.get(rawKey)
+    if (oldVal == null) return
+    const oldEntry = this._entryFor(rawKey, oldVal)
+    if (oldEntry != null) raw.clear(oldEntry)
+    raw.clear(rawKey)
+  }
+
+  /**
+   * Find the keys of all rows whose index values start with values. Keys are
+   * returned in index order.
+   */
+  async lookup(tn: Transaction<any, any, any, any>, values: TupleItem[], limit?: number): Promise<KeyOut[]> {
+    const {begin, end} = tuple.range(values)
+    const raw = tn.at(root) as RawTxn
+    const entries = await raw.getRangeAll(
+      Buffer.concat([this.prefix, asBuf(begin)]),
+      Buffer.concat([this.prefix, asBuf(end)]),
+      limit == null ? undefined : {limit}
+    )
+    return entries.map(([entry]) => this.primary.subspace.unpackKey(this._primaryKeyOf(entry)))
+  }
+
+  /**
+   * Index all existing rows in the primary subspace. Call this after
+   * declaring an index over a subspace which already has data in it.
+   *
+   * The primary range is split into chunks which are indexed concurrently.
+   * Each batch writes a checkpoint in the same transaction as its entries, so
+   * calling backfill again after a failure resumes from the checkpoints
+   * rather than starting over.
+   */
+  async backfill(opts: BackfillOptions = {}): Promise<BackfillStats> {
+    const startTime = Date.now()
+    const concurrency = opts.concurrency || DEFAULT_CONCURRENCY
+    const batchRows = opts.batchRows || DEFAULT_BATCH_ROWS
+    const rawDb = this.primary.getRoot().withWorkloadClass(opts.workloadClass || 'batch')
+    const cpEnd = strInc(this._checkpoints)
+
+    // Each checkpoint is <chunk number> => [cursor, end].
+    let chunks: {cp: Buffer, cursor: Buffer, end: Buffer}[] = (await rawDb.getRangeAll(this._checkpoints, cpEnd))
+      .map(([cp, val]) => {
+        const [cursor, end] = tuple.unpack(val) as Buffer[]
+        return {cp, cursor, end}
+      })
+    const resumed = chunks.length > 0
+
+    if (!resumed) {
+      const points = (await rawDb.getRangeSplitPoints(this._primaryPrefix, this._primaryEnd,
+        opts.chunkBytes || DEFAULT_CHUNK_BYTES)).map(asBuf)
+      if (points.length === 0 || !points[0].equals(this._primaryPrefix)) points.unshift(this._primaryPrefix)
+      if (!points[points.length - 1].equals(this._primaryEnd)) points.push(this._primaryEnd)
+
+      chunks = []
+      for (let i = 0; i < points.length - 1; i++) {
+        chunks.push({cp: Buffer.concat([this._checkpoints, tuple.pack([i])]), cursor: points[i], end: points[i + 1]})
+      }
+      await rawDb.doTn(async tn => {
+        for (const c of chunks) tn.set(c.cp, tuple.pack([c.cursor, c.end]))
+      })
+    }
+
+    const stats: BackfillStats = {rows: 0, entries: 0, chunks: chunks.length, resumed, elapsedMs: 0}
+
+    const runChunk = async (chunk: {cp: Buffer, cursor: Buffer, end: Buffer}) => {
+      let cursor: Buffer | null = chunk.cursor
+      while (cursor != null) {
+        const from: Buffer = cursor
+        const result = await rawDb.doTn(async tn => {
+          const rows = await tn.getRangeAll(from, chunk.end, {limit: batchRows})
+          let entries = 0
+          for (const [k, v] of rows) {
+            const entry = this._entryFor(k, v)
+            if (entry != null) { tn.set(entry, BUF_EMPTY); entries++ }
+          }
+
+          const next = rows.length < batchRows ? null : strNext(rows[rows.length - 1][0])
+          if (next == null) tn.clear(chunk.cp)
+          else tn.set(chunk.cp, tuple.pack([next, chunk.end]))
+          return {rows: rows.length, entries, next}
+        })
+
+        cursor = result.next
+        stats.rows += result.rows
+        stats.entries += result.entries
+        stats.elapsedMs = Date.now() - startTime
+        if (opts.onProgress) opts.onProgress(stats)
+      }
+    }
+
+    await forEachConcurrently(chunks, concurrency, runChunk)
+
+    stats.elapsedMs = Date.now() - startTime
+    return stats
+  }
+
+  /**
+   * Check the index against the primary subspace while both are in use. Every
+   * row is checked for a matching index entry, and every index entry is
+   * checked against the current value of its row. Each batch is checked
+   * inside a single transaction, so concurrent writes through set() and
+   * clear() aren't reported as inconsistencies.
+   */
+  async verify(opts: VerifyOptions = {}): Promise<VerifyResult<KeyOut>> {
+    const batchRows = opts.batchRows || DEFAULT_BATCH_ROWS
+    const maxReported = opts.maxReported == null ? DEFAULT_MAX_REPORTED : opts.maxReported
+    const rawDb = this.primary.getRoot().withWorkloadClass(opts.workloadClass || 'batch')
+    const subspace = this.primary.subspace
+
+    const result: VerifyResult<KeyOut> = {rows: 0, entries: 0, missing: 0, dangling: 0, missingKeys: [], danglingKeys: []}
+
+    const eachBatch = async (begin: Buffer, end: Buffer, check: (tn: RawTxn, batch: [Buffer, Buffer][]) => Promise<void>) => {
+      let cursor: Buffer | null = begin
+      while (cursor != null) {
+        const from: Buffer = cursor
+        cursor = await rawDb.doTn(async tn => {
+          const batch = await tn.getRangeAll(from, end, {limit: batchRows})
+          await check(tn, batch)
+          return batch.length < batchRows ? null : strNext(batch[batch.length - 1][0])
+        })
+      }
+    }
+
+    // Rows => entries.
+    await eachBatch(this._primaryPrefix, this._primaryEnd, async (tn, batch) => {
+      const found = await Promise.all(batch.map(([k, v]) => {
+        const entry = this._entryFor(k, v)
+        return entry == null ? true : tn.exists(entry)
+      }))
+      result.rows += batch.length
+      for (let i = 0; i < batch.length; i++) if (!found[i]) {
+        result.missing++
+        if (result.missingKeys.length < maxReported) result.missingKeys.push(subspace.unpackKey(batch[i][0]))
+      }
+    })
+
+    // Entries => rows.
+    await eachBatch(this.prefix, this._checkpoints, async (tn, batch) => {
+      const ok = await Promise.all(batch.map(async ([entry]) => {
+        const pk = this._primaryKeyOf(entry)
+        const val = await tn.get(pk)
+        const expected = val == null ? null : this._entryFor(pk, val)
+        return expected != null && expected.equals(entry)
+      }))
+      result.entries += batch.length
+      for (let i = 0; i < batch.length; i++) if (!ok[i]) {
+        result.dangling++
+        if (result.danglingKeys.length < maxReported) result.danglingKeys.push(subspace.unpackKey(this._primaryKeyOf(batch[i][0])))
+      }
+    })
+
+    return result
+  }
+}
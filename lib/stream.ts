@@ -0,0 +1,241 @@
+// Adapters between range reads / bulk writes and node streams. The readable
+// streams here only fetch the next batch from the database when the consumer
+// has drained the stream's buffer, so piping a large range into a slow
+// destination (a file, an http response, a compression stream) doesn't
+// buffer the whole range in memory.
+
+import { Readable, ReadableOptions, Writable, WritableOptions } from 'stream'
+import Database from './database'
+import Transaction, { RangeOptions } from './transaction'
+import FDBError from './error'
+import keySelector, { KeySelector } from './keySelector'
+import { NativeValue } from './native'
+import bulkLoad, { BulkLoadOptions, BulkLoadStats } from './bulk'
+import { abortReason } from './util'
+
+export interface ReadStreamOptions extends RangeOptions {
+  /**
+   * In object mode (the default) each chunk is a batch of decoded [key, value]
+   * pairs. In binary mode each chunk is a buffer containing a sequence of
+   * frames of the raw (undecoded) keys and values. Each frame is:
+   *
+   * [key length: uint32 BE][key bytes][value length: uint32 BE][value bytes]
+   */
+  binary?: undefined | boolean,
+
+  /**
+   * Passed through to the stream. In object mode this is the number of
+   * batches buffered, and in binary mode it is a number of bytes.
+   */
+  highWaterMark?: undefined | number,
+}
+
+type Batch = [any, any][]
+
+class BatchReadable extends Readable {
+  private _iter: AsyncIterator<Batch>
+  private _toChunk: (batch: Batch) => any
+  private _reading = false
+
+  constructor(iter: AsyncIterator<Batch>, toChunk: (batch: Batch) => any, opts: ReadStreamOptions) {
+    const streamOpts: ReadableOptions = {objectMode: !opts.binary}
+    if (opts.highWaterMark != null) streamOpts.highWaterMark = opts.highWaterMark
+    super(streamOpts)
+    this._iter = iter
+    this._toChunk = toChunk
+  }
+
+  _read() {
+    // _read can be called again before the previous fetch has returned.
+    if (this._reading) return
+    this._reading = true
+    this._pull()
+  }
+
+  private _pull() {
+    this._iter.next().then(({done, value}) => {
+      if (done) {
+        this._reading = false
+        this.push(null)
+      } else if (value.length === 0) {
+        this._pull()
+      } else {
+        this._reading = false
+        this.push(this._toChunk(value))
+      }
+    }, err => this.destroy(err))
+  }
+
+  _destroy(err: Error | null, callback: (err?: Error | null) => void) {
+    // Stop the underlying generator so no further reads are issued.
+    if (this._iter.return) this._iter.return().catch(() => {})
+    callback(err)
+  }
+}
+
+/** Pack a batch of raw key value pairs into length-prefixed frames. */
+export const frameBatch = (batch: [Buffer, Buffer][]): Buffer => {
+  let size = 0
+  for (let i = 0; i < batch.length; i++) size += 8 + batch[i][0].length + batch[i][1].length
+
+  const buf = Buffer.allocUnsafe(size)
+  let pos = 0
+  for (let i = 0; i < batch.length; i++) {
+    const [k, v] = batch[i]
+    buf.writeUInt32BE(k.length, pos); pos += 4
+    pos += k.copy(buf, pos)
+    buf.writeUInt32BE(v.length, pos); pos += 4
+    pos += v.copy(buf, pos)
+  }
+  return buf
+}
+
+const readableFor = (tn: Transaction<any, any, any, any>, batches: AsyncGenerator<[Buffer, Buffer][]>, opts: ReadStreamOptions) => (
+  new BatchReadable(batches,
+    opts.binary ? frameBatch : (batch => tn._encodeRangeResult(batch)),
+    opts)
+)
+
+/**
+ * Create a readable stream over a range inside a single transaction. The
+ * stream must be consumed before the transaction expires (5 seconds).
+ */
+export function createTxnReadStream<KeyIn>(
+    tn: Transaction<KeyIn, any, any, any>,
+    start: KeyIn | KeySelector<KeyIn>, end: KeyIn | KeySelector<KeyIn> | undefined,
+    opts: ReadStreamOptions = {}): Readable {
+  const [s, e] = tn._packRangeSelectors(start, end)
+  return readableFor(tn, tn._getRangeBatchNative(s, e, opts), opts)
+}
+
+// Scan a range using as many snapshot transactions as needed. When a
+// transaction gets too old (or hits any other retryable error), we continue
+// from the last key we returned in a fresh transaction.
+async function *scanBatches(tn: Transaction<any, any, any, any>,
+    start: KeySelector<NativeValue>, end: KeySelector<NativeValue>,
+    opts: RangeOptions): AsyncGenerator<[Buffer, Buffer][]> {
+  let remaining = opts.limit || 0
+
+  while (true) {
+    try {
+      for await (const batch of tn._getRangeBatchNative(start, end, {...opts, limit: remaining})) {
+        if (batch.length) {
+          const lastKey = batch[batch.length - 1][0]
+          if (!opts.reverse) start = keySelector.firstGreaterThan(lastKey)
+          else end = keySelector.firstGreaterOrEqual(lastKey)
+        }
+        yield batch
+
+        if (opts.limit) {
+          remaining -= batch.length
+          if (remaining <= 0) return
+        }
+      }
+      return
+    } catch (e) {
+      if (!(e instanceof FDBError)) throw e
+      // This throws if the error isn't retryable.
+      await tn.rawOnError(e.code)
+    }
+  }
+}
+
+/**
+ * Create a readable stream over a range in the database. Unlike a transaction
+ * stream, this stream can be consumed slowly - the range is read using a
+ * series of snapshot transactions. Note this means the stream does not
+ * present a consistent snapshot of the range if it's modified concurrently.
+ */
+export function createDbReadStream<KeyIn>(
+    db: Database<KeyIn, any, any, any>,
+    start: KeyIn | KeySelector<KeyIn>, end: KeyIn | KeySelector<KeyIn> | undefined,
+    opts: ReadStreamOptions = {}): Readable {
+  const tn = db.rawCreateTransaction().snapshot()
+  const [s, e] = tn._packRangeSelectors(start, end)
+  const stream = readableFor(tn, scanBatches(tn, s, e, opts), opts)
+
+  const signal = db.signal
+  if (signal) {
+    const onAbort = () => {
+      tn.rawCancel()
+      stream.destroy(abortReason(signal))
+    }
+    if (signal.aborted) onAbort()
+    else {
+      signal.addEventListener('abort', onAbort, {once: true})
+      stream.once('close', () => signal.removeEventListener('abort', onAbort))
+    }
+  }
+  return stream
+}
+
+export type WriteStream = Writable & {
+  /** Populated when the stream finishes. */
+  stats: BulkLoadStats | null
+}
+
+/**
+ * Create an object mode writable stream of [key, value] pairs. Written pairs
+ * are loaded using db.bulkLoad, and the stream applies backpressure while the
+ * loader has maxInFlight transactions committing.
+ */
+export function createDbWriteStream<KeyIn, ValIn>(
+    db: Database<KeyIn, any, ValIn, any>,
+    opts: BulkLoadOptions & {highWaterMark?: undefined | number} = {}): WriteStream {
+  type Item = {pair: [KeyIn, ValIn], callback: (err?: Error | null) => void}
+  const queue: Item[] = []
+  let ended = false
+  let wake: (() => void) | null = null
+  const notify = () => {
+    if (wake) { const w = wake; wake = null; w() }
+  }
+
+  async function *source(): AsyncGenerator<[KeyIn, ValIn]> {
+    while (true) {
+      const item = queue.shift()
+      if (item != null) {
+        yield item.pair
+        // The pair has been consumed by the loader. Let the writer continue.
+        item.callback()
+      } else if (ended) return
+      else await new Promise<void>(resolve => { wake = resolve })
+    }
+  }
+
+  let loadErr: Error | null = null
+  let onLoaded: ((err?: Error | null) => void) | null = null
+  let loaded = false
+
+  const streamOpts: WritableOptions = {
+    objectMode: true,
+    write(pair: [KeyIn, ValIn], _enc, callback) {
+      if (loadErr) return callback(loadErr)
+      queue.push({pair, callback})
+      notify()
+    },
+    final(callback) {
+      ended = true
+      notify()
+      if (loaded) callback(loadErr)
+      else onLoaded = callback
+    },
+  }
+  if (opts.highWaterMark != null) streamOpts.highWaterMark = opts.highWaterMark
+
+  const stream = new Writable(streamOpts) as WriteStream
+  stream.stats = null
+
+  bulkLoad(db, source(), opts).then(stats => {
+    stream.stats = stats
+  }, err => {
+    loadErr = err
+    // Fail any writes which are still waiting for the loader.
+    queue.splice(0).forEach(item => item.callback(err))
+    if (!onLoaded) stream.destroy(err)
+  }).then(() => {
+    loaded = true
+    if (onLoaded) onLoaded(loadErr)
+  })
+
+  return stream
+}
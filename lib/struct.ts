@@ -0,0 +1,405 @@
+// Schema compiled binary records. encoders.struct(schema) turns a fixed set of
+// typed fields into a value encoding with generated pack and unpack
+// functions, which is much cheaper to decode than JSON.
+//
+// A packed struct is laid out as
+//
+//   [presence bitmap][fixed width fields][u32 LE end offset per variable field][variable field data]
+//
+// The bitmap has a bit per optional field. Fixed width fields (numbers and
+// bools) sit at constant offsets, and absent optional ones are zeroed. End
+// offsets are relative to the start of the struct. So any single field can be
+// read without decoding the others.
+//
+// Arrays are stored as [u32 LE count][elements], where variable width
+// elements are each prefixed with their u32 LE length. Nested structs use the
+// same layout as top level ones.
+
+import * as tuple from 'fdb-tuple'
+import { TupleItem } from 'fdb-tuple'
+import { Transformer } from './transformer'
+
+type PrimitiveTypes = {
+  int8: number, uint8: number, int16: number, uint16: number,
+  int32: number, uint32: number, int64: number,
+  float32: number, float64: number,
+  bool: boolean, string: string, buffer: Buffer,
+}
+
+export type FieldType = keyof PrimitiveTypes
+  | {array: FieldType}
+  | {optional: FieldType}
+  | {struct: Schema}
+
+/** Fields in the order they're stored in. */
+export type Schema = {[field: string]: FieldType}
+
+export type FieldValue<T> =
+  T extends keyof PrimitiveTypes ? PrimitiveTypes[T]
+  : T extends {array: infer E} ? FieldValue<E>[]
+  : T extends {optional: infer E} ? FieldValue<E> | undefined
+  : T extends {struct: infer S} ? StructValue<S>
+  : never
+
+type OptionalFields<S> = {[K in keyof S]: S[K] extends {optional: any} ? K : never}[keyof S]
+export type StructValue<S> =
+  {[K in Exclude<keyof S, OptionalFields<S>>]: FieldValue<S[K]>}
+  & {[K in OptionalFields<S>]?: FieldValue<S[K]>}
+
+export interface StructEncoder<T> extends Transformer<T, T> {
+  schema: Schema,
+  /** Read one field of a packed value without decoding the rest. */
+  readField<K extends keyof T>(buf: Buffer, field: K): T[K],
+  /** Compile a function which reads one field of packed values. */
+  fieldReader<K extends keyof T>(field: K): (buf: Buffer) => T[K],
+  /** The named fields of value as a tuple, eg for a SecondaryIndex key function. */
+  toTuple(value: T, fields: (keyof T)[]): TupleItem[],
+  /**
+   * A key encoding which stores structs as tuples of their fields in schema
+   * order, so keys sort by field. Nested structs aren't supported.
+   */
+  tupleKey(): Transformer<T, T>,
+}
+
+// Generated code works on a codec for each field. Fixed width codecs also
+// provide code templates, so the generated struct functions read and write
+// them inline.
+interface Codec {
+  fixed: number | null,
+  size(v: any): number,
+  write(b: Buffer, p: number, v: any): number, // Returns the position after v.
+  read(b: Buffer, start: number, end: number): any,
+  writeCode?: undefined | ((b: string, p: string, x: string) => string),
+  readCode?: undefined | ((b: string, p: string) => string),
+}
+
+const writeInt64 = (b: Buffer, v: number, p: number) => {
+  if (!Number.isSafeInteger(v)) throw new RangeError('Invalid int64 field (number outside JS safe range)')
+  const high = Math.floor(v / 0x100000000)
+  b.writeUInt32LE(v - high * 0x100000000, p)
+  b.writeInt32LE(high, p + 4)
+}
+const readInt64 = (b: Buffer, p: number) => b.readInt32LE(p + 4) * 0x100000000 + b.readUInt32LE(p)
+
+// Buffer.toString has a fixed cost which dominates for short strings, so
+// short ASCII strings are decoded in JS.
+const readString = (b: Buffer, start: number, end: number) => {
+  if (end - start > 24) return b.toString('utf8', start, end)
+  let str = ''
+  for (let i = start; i < end; i++) {
+    const c = b[i]
+    if (c >= 0x80) return b.toString('utf8', start, end)
+    str += String.fromCharCode(c)
+  }
+  return str
+}
+
+const isShortAscii = (v: string) => {
+  if (v.length > 24) return false
+  for (let i = 0; i < v.length; i++) if (v.charCodeAt(i) >= 0x80) return false
+  return true
+}
+
+const helpers = { writeInt64, readInt64 }
+
+const fixedCodec = (size: number, writeCode: (b: string, p: string, x: string) => string, readCode: (b: string, p: string) => string): Codec => {
+  const write = new Function('h', `return (b, p, x) => { ${writeCode('b', 'p', 'x')}; return p + ${size} }`)(helpers)
+  const read = new Function('h', `return (b, p) => ${readCode('b', 'p')}`)(helpers)
+  return { fixed: size, size: () => size, write, read, writeCode, readCode }
+}
+
+const method = (size: number, name: string): Codec => fixedCodec(size,
+  (b, p, x) => `${b}.write${name}(${x}, ${p})`,
+  (b, p) => `${b}.read${name}(${p})`)
+
+const PRIMITIVES: {[K in keyof PrimitiveTypes]: Codec} = {
+  int8: method(1, 'Int8'),
+  uint8: method(1, 'UInt8'),
+  int16: method(2, 'Int16LE'),
+  uint16: method(2, 'UInt16LE'),
+  int32: method(4, 'Int32LE'),
+  uint32: method(4, 'UInt32LE'),
+  int64: fixedCodec(8, (b, p, x) => `h.writeInt64(${b}, ${x}, ${p})`, (b, p) => `h.readInt64(${b}, ${p})`),
+  float32: method(4, 'FloatLE'),
+  float64: method(8, 'DoubleLE'),
+  bool: fixedCodec(1, (b, p, x) => `${b}[${p}] = ${x} ? 1 : 0`, (b, p) => `${b}[${p}] === 1`),
+  string: {
+    fixed: null,
+    size: (v: string) => isShortAscii(v) ? v.length : Buffer.byteLength(v, 'utf8'),
+    write(b, p, v: string) {
+      if (!isShortAscii(v)) return p + b.write(v, p, 'utf8')
+      for (let i = 0; i < v.length; i++) b[p + i] = v.charCodeAt(i)
+      return p + v.length
+    },
+    read: readString,
+  },
+  buffer: {
+    fixed: null,
+    size: (v: Buffer) => v.length,
+    write: (b, p, v: Buffer) => p + v.copy(b, p),
+    read: (b, start, end) => b.subarray(start, end),
+  },
+}
+
+const arrayCodec = (el: Codec): Codec => {
+  const fixed = el.fixed
+  return fixed != null ? {
+    fixed: null,
+    size: (v: any[]) => 4 + v.length * fixed,
+    write(b, p, v: any[]) {
+      b.writeUInt32LE(v.length, p)
+      p += 4
+      for (let i = 0; i < v.length; i++) p = el.write(b, p, v[i])
+      return p
+    },
+    read(b, p, end) {
+      const n = b.readUInt32LE(p)
+      if (p + 4 + n * fixed > end) throw Error('Struct value is truncated')
+      const out = new Array(n)
+      for (let i = 0; i < n; i++) out[i] = el.read(b, p + 4 + i * fixed, 0)
+      return out
+    },
+  } : {
+    fixed: null,
+    size(v: any[]) {
+      let s = 4
+      for (let i = 0; i < v.length; i++) s += 4 + el.size(v[i])
+      return s
+    },
+    write(b, p, v: any[]) {
+      b.writeUInt32LE(v.length, p)
+      p += 4
+      for (let i = 0; i < v.length; i++) {
+        const start = p
+        p = el.write(b, p + 4, v[i])
+        b.writeUInt32LE(p - start - 4, start)
+      }
+      return p
+    },
+    read(b, p, end) {
+      const n = b.readUInt32LE(p)
+      p += 4
+      const out = new Array(n)
+      for (let i = 0; i < n; i++) {
+        const len = b.readUInt32LE(p)
+        p += 4
+        if (p + len > end) throw Error('Struct value is truncated')
+        out[i] = el.read(b, p, p + len)
+        p += len
+      }
+      return out
+    },
+  }
+}
+
+// Optional array elements, prefixed with a presence byte.
+const optionalCodec = (inner: Codec): Codec => ({
+  fixed: null,
+  size: v => v == null ? 1 : 1 + inner.size(v),
+  write(b, p, v) {
+    if (v == null) {
+      b[p] = 0
+      return p + 1
+    }
+    b[p] = 1
+    return inner.write(b, p + 1, v)
+  },
+  read: (b, start, end) => b[start] === 0 ? undefined : inner.read(b, start + 1, end),
+})
+
+const codecFor = (type: FieldType): Codec => (
+  typeof type === 'string' ? (PRIMITIVES[type] || badType(type))
+  : 'array' in type ? arrayCodec(codecFor(type.array))
+  : 'optional' in type ? optionalCodec(codecFor(type.optional))
+  : 'struct' in type ? compile(type.struct).codec
+  : badType(type)
+)
+
+const badType = (type: any): never => {
+  throw TypeError(`Invalid struct field type ${JSON.stringify(type)}`)
+}
+
+interface Field {
+  name: string,
+  prop: string, // Property access code, eg ["name"].
+  codec: Codec,
+  optionalBit: number, // -1 if the field is required.
+  offset: number, // Offset of fixed width fields.
+  slot: number, // Index in the end offset table of variable width fields.
+}
+
+interface Compiled {
+  fields: Field[],
+  codec: Codec,
+  fieldReader(name: string): (b: Buffer) => any,
+}
+
+// Generated code which reads field f of the struct starting at s and ending at e.
+const readFieldCode = (f: Field, fieldIdx: number, tableOffset: number, headerBytes: number) => {
+  const present = f.optionalBit < 0 ? '' : `(b[s + ${f.optionalBit >> 3}] & ${1 << (f.optionalBit & 7)}) === 0 ? undefined : `
+  if (f.codec.readCode) return present + f.codec.readCode('b', `s + ${f.offset}`)
+
+  const begin = f.slot === 0 ? `s + ${headerBytes}` : `s + b.readUInt32LE(s + ${tableOffset + 4 * (f.slot - 1)})`
+  const end = `s + b.readUInt32LE(s + ${tableOffset + 4 * f.slot})`
+  return present + `c[${fieldIdx}].read(b, ${begin}, ${end})`
+}
+
+function compile(schema: Schema): Compiled {
+  if (schema == null || typeof schema !== 'object') throw TypeError('Struct schema must be an object')
+
+  const fields: Field[] = []
+  let optionalBits = 0, fixedBytes = 0, slots = 0
+  for (const name in schema) {
+    let type = schema[name]
+    const optional = typeof type === 'object' && 'optional' in type
+    if (optional) type = (type as {optional: FieldType}).optional
+    fields.push({
+      name,
+      prop: `[${JSON.stringify(name)}]`,
+      codec: codecFor(type),
+      optionalBit: optional ? optionalBits++ : -1,
+      offset: 0,
+      slot: -1,
+    })
+  }
+
+  const bitmapBytes = Math.ceil(optionalBits / 8)
+  for (const f of fields) {
+    if (f.codec.fixed != null) {
+      f.offset = bitmapBytes + fixedBytes
+      fixedBytes += f.codec.fixed
+    } else f.slot = slots++
+  }
+  const tableOffset = bitmapBytes + fixedBytes
+  const headerBytes = tableOffset + 4 * slots
+  const codecs = fields.map(f => f.codec)
+
+  const isSet = (f: Field) => `(x = v${f.prop}) != null`
+  const setBit = (f: Field) => `b[s + ${f.optionalBit >> 3}] |= ${1 << (f.optionalBit & 7)}`
+
+  const sizeCode = [`let n = ${headerBytes}, x`]
+  const writeCode = [`const s = p`, `b.fill(0, s, s + ${tableOffset})`, 'let x']
+  for (const f of fields) {
+    if (f.codec.writeCode) {
+      const write = f.codec.writeCode('b', `s + ${f.offset}`, 'x')
+      writeCode.push(f.optionalBit < 0 ? `x = v${f.prop}; ${write}` : `if (${isSet(f)}) { ${setBit(f)}; ${write} }`)
+    }
+  }
+  writeCode.push(`p = s + ${headerBytes}`)
+  for (const f of fields) {
+    if (f.codec.writeCode) continue
+    const c = codecs.indexOf(f.codec)
+    const endCode = `b.writeUInt32LE(p - s, s + ${tableOffset + 4 * f.slot})`
+    if (f.optionalBit < 0) {
+      sizeCode.push(`n += c[${c}].size(v${f.prop})`)
+      writeCode.push(`p = c[${c}].write(b, p, v${f.prop}); ${endCode}`)
+    } else {
+      sizeCode.push(`if (${isSet(f)}) n += c[${c}].size(x)`)
+      writeCode.push(`if (${isSet(f)}) { ${setBit(f)}; p = c[${c}].write(b, p, x) } ${endCode}`)
+    }
+  }
+  sizeCode.push('return n')
+  writeCode.push('return p')
+
+  const readCode = `
+    if (e - s < ${headerBytes} || e > b.length) throw Error('Struct value is truncated')
+    return {${fields.map((f, i) => `${JSON.stringify(f.name)}: ${readFieldCode(f, i, tableOffset, headerBytes)}`).join(',\n')}}`
+
+  const make = (args: string, body: string) => new Function('c', 'h', `return (${args}) => {\n${body}\n}`)(codecs, helpers)
+  const codec: Codec = {
+    fixed: null,
+    size: make('v', sizeCode.join('\n')),
+    write: make('b, p, v', writeCode.join('\n')),
+    read: make('b, s, e', readCode),
+  }
+
+  return {
+    fields,
+    codec,
+    fieldReader(name) {
+      const i = fields.findIndex(f => f.name === name)
+      if (i < 0) throw Error(`Struct has no field ${name}`)
+      return make('b', `const s = 0, e = b.length
+        if (e < ${headerBytes}) throw Error('Struct value is truncated')
+        return ${readFieldCode(fields[i], i, tableOffset, headerBytes)}`)
+    },
+  }
+}
+
+// Struct values as tuple items. Optional fields are stored as null. Floats
+// are stored as tuple floats and doubles, since plain numbers are packed as
+// ints when they're integral, and ints sort before doubles.
+const unwrapFloat = (t: any) => typeof t === 'number' ? t : t.value
+const tupleCodec = (type: FieldType): {to(v: any): TupleItem, from(t: any): any} => {
+  if (type === 'float32') return {to: v => ({type: 'float', value: v}), from: unwrapFloat}
+  if (type === 'float64') return {to: v => ({type: 'double', value: v}), from: unwrapFloat}
+  if (typeof type === 'string') return {to: v => v, from: t => t}
+  if ('array' in type) {
+    const el = tupleCodec(type.array)
+    return {to: v => v.map(el.to), from: t => t.map(el.from)}
+  }
+  if ('optional' in type) {
+    const inner = tupleCodec(type.optional)
+    return {to: v => v == null ? null : inner.to(v), from: t => t == null ? undefined : inner.from(t)}
+  }
+  throw TypeError('Nested structs can\'t be stored in tuple keys')
+}
+
+/**
+ * Compile a schema into a value encoding. Eg:
+ *
+ * ```
+ * const users = db.withValueEncoding(fdb.encoders.struct({
+ *   id: 'uint32', name: 'string', email: {optional: 'string'}, scores: {array: 'float64'},
+ * }))
+ * ```
+ */
+export function struct<S extends Schema>(schema: S): StructEncoder<StructValue<S>> {
+  const compiled = compile(schema)
+  const {codec, fields} = compiled
+  const readers = new Map<string, (b: Buffer) => any>()
+
+  return {
+    name: 'struct',
+    schema,
+
+    pack(val) {
+      const buf = Buffer.allocUnsafe(codec.size(val))
+      codec.write(buf, 0, val)
+      return buf
+    },
+    unpack(buf) {
+      return codec.read(buf, 0, buf.length)
+    },
+
+    readField(buf, field) {
+      let reader = readers.get(field as string)
+      if (reader == null) readers.set(field as string, reader = compiled.fieldReader(field as string))
+      return reader(buf)
+    },
+    fieldReader(field) {
+      return compiled.fieldReader(field as string)
+    },
+
+    toTuple(value, names) {
+      return names.map(name => {
+        const v = value[name] as any
+        return v === undefined ? null : v
+      })
+    },
+
+    tupleKey() {
+      const codecs = fields.map(f => tupleCodec(schema[f.name]))
+      return {
+        name: 'struct tuple',
+        pack: val => tuple.pack(fields.map((f, i) => codecs[i].to((val as any)[f.name]))),
+        unpack(buf) {
+          const items = tuple.unpack(buf)
+          const val: any = {}
+          for (let i = 0; i < fields.length; i++) val[fields[i].name] = codecs[i].from(items[i])
+          return val
+        },
+      }
+    },
+  }
+}
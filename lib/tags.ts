@@ -0,0 +1,155 @@
+// Client side awareness of FDB's tag throttling.
+//
+// When the cluster throttles a transaction tag, transactions with that tag
+// fail with tag_throttled (1213). _exec retries them like any other retryable
+// error, so without some help a busy client just hammers the cluster with
+// retries which will be throttled again. Instead we keep a token bucket per
+// tag. Buckets start out unlimited. Each tag_throttled error halves the rate
+// at which transactions with that tag may start, and each successful commit
+// adds some of it back. Once the rate has recovered to where it was when
+// throttling began, the bucket goes back to being unlimited.
+//
+// Like the transaction pool, throttle state is shared by every Database
+// reference which wraps the same native database.
+
+import { NativeDatabase } from './native'
+import { TransactionOptions } from './opts.g'
+
+export const ERR_TAG_THROTTLED = 1213
+
+// Never throttle a tag below this many transactions per second.
+const MIN_RATE = 1
+// Rate measurement window for working out how fast a tag was going before it
+// was first throttled.
+const WINDOW_MS = 1000
+
+export interface TagStats {
+  /** Transaction attempts started with this tag. */
+  started: number,
+  /** Attempts which failed with tag_throttled. */
+  throttled: number,
+  /** Attempts which waited for the tag's token bucket. */
+  delayed: number,
+  /** Current client side rate limit, in transactions per second. Infinity if unthrottled. */
+  rate: number,
+}
+
+class TagState {
+  started = 0
+  throttled = 0
+  delayed = 0
+
+  rate = Infinity
+  // The rate when throttling began. When we recover to here, we stop limiting.
+  ceiling = Infinity
+  tokens = 0
+  lastRefill = 0
+
+  windowStart = 0
+  windowCount = 0
+  lastWindowRate = 0
+
+  // Returns the number of ms to wait before starting.
+  take(now: number): number {
+    this.started++
+
+    if (now - this.windowStart >= WINDOW_MS) {
+      this.lastWindowRate = this.windowCount * 1000 / Math.max(now - this.windowStart, WINDOW_MS)
+      this.windowStart = now
+      this.windowCount = 0
+    }
+    this.windowCount++
+
+    if (this.rate === Infinity) return 0
+
+    // Refill, allowing at most one second of burst.
+    this.tokens = Math.min(this.rate, this.tokens + (now - this.lastRefill) * this.rate / 1000)
+    this.lastRefill = now
+    this.tokens--
+    if (this.tokens >= 0) return 0
+
+    this.delayed++
+    return -this.tokens * 1000 / this.rate
+  }
+
+  onThrottled(now: number) {
+    this.throttled++
+    if (this.rate === Infinity) {
+      this.ceiling = Math.max(MIN_RATE, this.lastWindowRate, this.windowCount)
+      this.rate = this.ceiling
+      this.tokens = 0
+      this.lastRefill = now
+    }
+    this.rate = Math.max(MIN_RATE, this.rate / 2)
+  }
+
+  onSuccess() {
+    if (this.rate === Infinity) return
+    // Additive increase. Recovering by 1 tps per commit means the rate
+    // roughly doubles every second while the tag isn't being throttled.
+    this.rate += 1
+    if (this.rate >= this.ceiling) this.rate = Infinity
+  }
+
+  getStats(): TagStats {
+    return { started: this.started, throttled: this.throttled, delayed: this.delayed, rate: this.rate }
+  }
+}
+
+export class TagThrottle {
+  private _tags = new Map<string, TagState>()
+
+  private _get(tag: string) {
+    let state = this._tags.get(tag)
+    if (state == null) {
+      state = new TagState()
+      this._tags.set(tag, state)
+    }
+    return state
+  }
+
+  // Returns a promise if the caller needs to wait before starting a
+  // transaction with these tags, or null if it can go ahead immediately.
+  acquire(tags: string[]): Promise<void> | null {
+    const now = Date.now()
+    let wait = 0
+    for (let i = 0; i < tags.length; i++) wait = Math.max(wait, this._get(tags[i]).take(now))
+    return wait > 0 ? new Promise(resolve => setTimeout(resolve, wait)) : null
+  }
+
+  onThrottled(tags: string[]) {
+    const now = Date.now()
+    for (let i = 0; i < tags.length; i++) this._get(tags[i]).onThrottled(now)
+  }
+
+  onSuccess(tags: string[]) {
+    for (let i = 0; i < tags.length; i++) this._get(tags[i]).onSuccess()
+  }
+
+  getStats(): {[tag: string]: TagStats} {
+    const result: {[tag: string]: TagStats} = {}
+    for (const [tag, state] of this._tags) result[tag] = state.getStats()
+    return result
+  }
+}
+
+// All the tags set by a set of transaction options, or null if there are none.
+export const tagsOf = (opts: TransactionOptions): string[] | null => {
+  const tags: string[] = []
+  if (opts.tag != null) tags.push(opts.tag)
+  if (opts.tags != null) tags.push(...opts.tags)
+  if (opts.auto_throttle_tag != null) tags.push(opts.auto_throttle_tag)
+  if (opts.auto_throttle_tags != null) tags.push(...opts.auto_throttle_tags)
+  return tags.length ? tags : null
+}
+
+const throttles = new WeakMap<NativeDatabase, TagThrottle>()
+
+export const getTagThrottle = (db: NativeDatabase): TagThrottle => {
+  let t = throttles.get(db)
+  if (t == null) {
+    t = new TagThrottle()
+    throttles.set(db, t)
+  }
+  return t
+}
@@ -9,10 +9,12 @@ import {
 import {
   strInc,
   strNext,
-  asBuf
+  concat2,
+  asBuf,
+  abortReason,
 } from './util'
 import keySelector, { KeySelector } from './keySelector'
-import { eachOption } from './opts'
+import { eachOption, TransactionProfile } from './opts'
 import {
   TransactionOptions,
   TransactionOptionCode,
@@ -21,6 +23,8 @@ import {
   MutationType
 } from './opts.g'
 import Database from './database'
+import { Limiter } from './limiter'
+import { TagThrottle, tagsOf, ERR_TAG_THROTTLED } from './tags'
 
 import {
   Transformer,
@@ -33,6 +37,9 @@ import {
 } from './versionstamp'
 import Subspace, { GetSubspace } from './subspace'
 import { EmptyEventHandler, Operations, TransactionEventHandler } from './customised/operations'
+import { Readable } from 'stream'
+import { performance } from 'perf_hooks'
+import { createTxnReadStream, ReadStreamOptions } from './stream'
 
 const byteZero = Buffer.alloc(1)
 byteZero.writeUInt8(0, 0)
@@ -46,9 +53,33 @@ export interface RangeOptionsBatch {
 }
 
 export interface RangeOptions extends RangeOptionsBatch {
+  /** Same as maxBatchBytes. */
   targetBytes?: undefined | number,
+  /**
+   * Soft cap on the bytes of keys and values fetched by each request to the
+   * database. A batch always contains at least one key value pair. In adaptive
+   * mode this is the largest batch size used (default 256kb).
+   */
+  maxBatchBytes?: undefined | number,
+  /**
+   * Hard cap on the bytes of keys and values the read holds in memory.
+   * getRangeAll rejects once its result would grow past this. Streaming reads
+   * only hold one batch at a time, so for them this caps the size of each
+   * batch. They only reject if a single key value pair is over the cap.
+   */
+  maxBufferedBytes?: undefined | number,
+  /**
+   * Start with small batches, and grow them while the consumer drains each
+   * batch faster than the next one is fetched. Batches shrink again when the
+   * consumer is slow. This keeps scans cheap for consumers which stop early.
+   */
+  adaptive?: undefined | boolean,
 }
 
+// Batch sizes in adaptive mode.
+const ADAPTIVE_MIN_BYTES = 4 * 1024
+const ADAPTIVE_MAX_BYTES = 256 * 1024
+
 export type KVList<Key, Value> = {
   results: [Key, Value][], // [key, value] pair.
   more: boolean,
@@ -75,6 +106,25 @@ interface TxnCtx {
   // the versionstamp from the txn and bake it back into the tuple (or
   // whatever) after the transaction commits.
   toBake: null | BakeItem<any>[]
+
+  // Set when the transaction hands out a future which may outlive it (a watch
+  // or a versionstamp). Pinned transactions are never reset and reused by the
+  // database's transaction pool.
+  pinned: boolean
+
+  // Callbacks to run once the current attempt commits. See _afterCommit.
+  committed: null | (() => void)[]
+
+  // Admission control for reads and commits, shared with the database.
+  limiter: Limiter | null
+  // Set by _exec. Reads and commits waiting for the limiter stop waiting
+  // when it aborts.
+  signal: AbortSignal | null
+
+  // Throttling tags set on the transaction, and the database's client side
+  // throttle state for them. Tags is null if the transaction has none.
+  tags: string[] | null
+  tagThrottle: TagThrottle | null
 }
 
 /**
@@ -146,7 +196,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   constructor(tn: NativeTransaction, snapshot: boolean,
     subspace: Subspace<KeyIn, KeyOut, ValIn, ValOut>,
     // keyEncoding: Transformer<KeyIn, KeyOut>, valueEncoding: Transformer<ValIn, ValOut>,
-    opts?: TransactionOptions, ctx?: TxnCtx) {
+    opts?: TransactionOptions | TransactionProfile, ctx?: TxnCtx, limiter?: Limiter, tagThrottle?: TagThrottle) {
     this._tn = tn
 
     this.isSnapshot = snapshot
@@ -155,42 +205,95 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
     this._valueEncoding = subspace.valueXf
 
     // this._root = root || this
-    if (opts) eachOption(transactionOptionData, opts, (code, val) => tn.setOption(code, val))
+    if (opts instanceof TransactionProfile) {
+      if (opts._packed.length) tn.setOptionsPacked(opts._packed)
+    } else if (opts) eachOption(transactionOptionData(), opts, (code, val) => tn.setOption(code, val))
 
     this._ctx = ctx ? ctx : {
       nextCode: 0,
-      toBake: null
+      toBake: null,
+      pinned: false,
+      committed: null,
+      limiter: limiter || null,
+      signal: null,
+      tags: (tagThrottle == null || opts == null) ? null
+        : opts instanceof TransactionProfile ? opts._tags : tagsOf(opts),
+      tagThrottle: tagThrottle || null,
     }
   }
 
+  /** @internal */
+  _isReusable() { return !this._ctx.pinned }
+
+  // Reads and commits go through the database's concurrency limiter, if it
+  // has one. The deprecated callback API is not limited.
+  private _limitRead<T>(fn: () => Promise<T>): Promise<T> {
+    const limiter = this._ctx.limiter
+    return limiter ? limiter.reads.run(fn, this._ctx.signal) : fn()
+  }
+  private _limitCommit<T>(fn: () => Promise<T>): Promise<T> {
+    const limiter = this._ctx.limiter
+    return limiter ? limiter.commits.run(fn, this._ctx.signal) : fn()
+  }
+
   // Internal method to actually run a transaction retry loop. Do not call
   // this directly - instead use Database.doTn().
 
   /** @internal */
-  async _exec<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions): Promise<T> {
+  async _exec<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>, opts?: TransactionOptions | TransactionProfile, signal: AbortSignal | null = null): Promise<T> {
+    if (signal == null) return this._retryLoop(body)
+    if (signal.aborted) throw abortReason(signal)
+    this._ctx.signal = signal
+
+    // Cancelling the transaction makes all of its outstanding futures (and
+    // any started by the body after this) fail natively with
+    // transaction_cancelled, which isn't retryable. The body may still be
+    // running when we reject, but it can't do any more work.
+    let onAbort!: () => void
+    const aborted = new Promise<never>((_, reject) => {
+      onAbort = () => {
+        this._tn.cancel()
+        reject(abortReason(signal))
+      }
+    })
+    signal.addEventListener('abort', onAbort, {once: true})
+    try {
+      return await Promise.race([this._retryLoop(body), aborted])
+    } finally {
+      signal.removeEventListener('abort', onAbort)
+    }
+  }
+
+  private async _retryLoop<T>(body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>): Promise<T> {
     // Logic described here:
     // https://apple.github.io/foundationdb/api-c.html#c.fdb_transaction_on_error
     do {
       try {
+        if (this._ctx.tags) {
+          const wait = this._ctx.tagThrottle!.acquire(this._ctx.tags)
+          if (wait) await wait
+        }
+
         this.eventHandlers = Transaction.onTransactionRestart?.(this) || this.eventHandlers
         const result = await body(this)
 
-        const stampPromise = (this._ctx.toBake && this._ctx.toBake.length)
-          ? this.getVersionstamp() : null
+        // The commit and versionstamp are resolved together natively. The
+        // stamp is consumed here, so it doesn't need to pin the transaction.
+        const wantStamp = !!(this._ctx.toBake && this._ctx.toBake.length)
         await this.eventHandlers.onPreCommit?.(this)
-        await this.rawCommit()
+        const {versionstamp} = await this._limitCommit(() => this._tn.commitAndFinalize(wantStamp))
         await this.eventHandlers.onPostCommit?.(this)
-        if (stampPromise) {
-          const stamp = await stampPromise.promise
-
-          this._ctx.toBake!.forEach(({ item, transformer, code }) => (
-            transformer.bakeVersionstamp!(item, stamp, code))
-          )
-        }
+        // If the stamp couldn't be read, commitAndFinalize rejects with its error.
+        if (wantStamp) this._ctx.toBake!.forEach(({ item, transformer, code }) => (
+          transformer.bakeVersionstamp!(item, versionstamp!, code))
+        )
+        if (this._ctx.tags) this._ctx.tagThrottle!.onSuccess(this._ctx.tags)
+        this._runCommitted()
         return result // Ok, success.
       } catch (err) {
         // See if we can retry the transaction
         if (err instanceof FDBError) {
+          if (err.code === ERR_TAG_THROTTLED && this._ctx.tags) this._ctx.tagThrottle!.onThrottled(this._ctx.tags)
           await this.rawOnError(err.code) // If this throws, punt error to caller.
           // If that passed, loop.
         } else throw err
@@ -199,9 +302,29 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
       // Reset our local state that will have been filled in by calling the body.
       this._ctx.nextCode = 0
       if (this._ctx.toBake) this._ctx.toBake.length = 0
+      this._ctx.committed = null
     } while (true)
   }
 
+  /**
+   * Call fn once this attempt at the transaction has committed, through
+   * doTn or rawCommit. Layers use this to keep statistics which only count
+   * committed work. Callbacks are dropped if the attempt fails or is retried.
+   *
+   * @internal
+   */
+  _afterCommit(fn: () => void) {
+    if (this._ctx.committed == null) this._ctx.committed = []
+    this._ctx.committed.push(fn)
+  }
+
+  private _runCommitted() {
+    const committed = this._ctx.committed
+    if (committed == null) return
+    this._ctx.committed = null
+    for (const fn of committed) fn()
+  }
+
   /**
    * Set options on the transaction object. These options can have a variety of
    * effects - see TransactionOptionCode for details. For options which are
@@ -253,16 +376,33 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
       await this.eventHandlers.onPreCommit?.(this)
     })();
     if (cb) return preReq.then(() => this._tn.commit(cb)).catch(cb);
-    return preReq.then(() => this._tn.commit());
+    return preReq.then(() => this._limitCommit(() => this._tn.commit())).then(() => this._runCommitted());
   }
 
-  rawReset() { this._tn.reset() }
+  rawReset() {
+    this._ctx.committed = null
+    this._tn.reset()
+  }
   rawCancel() { this._tn.cancel() }
 
+  /**
+   * Destroy the native transaction now, rather than when this object is
+   * garbage collected. The transaction (and every scoped copy of it) can't be
+   * used afterwards. db.doTn() does this automatically once the transaction
+   * has finished. Call it yourself for transactions made with
+   * rawCreateTransaction(), or declare them with `using`.
+   *
+   * Watches created by a transaction which committed keep working after it is
+   * disposed. (db.doTn() leaves transactions which created watches or
+   * versionstamps for the garbage collector anyway.)
+   */
+  dispose() { this._tn.destroy() }
+
   rawOnError(code: number): Promise<void>
   /** @deprecated - Use promises API instead. */
   rawOnError(code: number, cb: Callback<void>): void
   rawOnError(code: number, cb?: Callback<void>) {
+    this._ctx.committed = null
     return cb
       ? this._tn.onError(code, cb)
       : this._tn.onError(code)
@@ -295,7 +435,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
     }
 
     return preReq.then(() => {
-      return this._tn.get(keyBuf, this.isSnapshot)
+      return this._limitRead(() => this._tn.get(keyBuf, this.isSnapshot))
         .then(val => val == null ? undefined : this._valueEncoding.unpack(val))
     })
 
@@ -334,7 +474,8 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
       })
     }
     const sel = keySelector.from(_sel)
-    return this._tn.getKey(this._keyEncoding.pack(sel.key), sel.orEqual, sel.offset, this.isSnapshot)
+    const keyBuf = this._keyEncoding.pack(sel.key)
+    return this._limitRead(() => this._tn.getKey(keyBuf, sel.orEqual, sel.offset, this.isSnapshot))
       .then(key => (
         (key.length === 0 || !this.subspace.contains(key))
           ? undefined
@@ -376,7 +517,8 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   }
 
   // This just destructively edits the result in-place.
-  private _encodeRangeResult(r: [Buffer, Buffer][]): [KeyOut, ValOut][] {
+  /** @internal */
+  _encodeRangeResult(r: [Buffer, Buffer][]): [KeyOut, ValOut][] {
     // This is slightly faster but I have to throw away the TS checks in the process. :/
     for (let i = 0; i < r.length; i++) {
       ; (r as any)[i][0] = this._keyEncoding.unpack(r[i][0])
@@ -385,16 +527,57 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
     return r as any as [KeyOut, ValOut][]
   }
 
+  // Range reads in a prefixed subspace have the prefix checked and removed
+  // natively, so results can be decoded with the subspace's inner key
+  // transformer instead of the baked (prefixed) one.
+  private _stripPrefix(): Buffer | null {
+    return this.subspace.prefix.length ? this.subspace.prefix : null
+  }
+
+  // Same as _encodeRangeResult, for results read with _stripPrefix().
+  private _encodeStrippedRangeResult(r: [Buffer, Buffer][]): [KeyOut, ValOut][] {
+    const keyXf = this.subspace.keyXf
+    for (let i = 0; i < r.length; i++) {
+      ; (r as any)[i][0] = keyXf.unpack(r[i][0])
+        ; (r as any)[i][1] = this._valueEncoding.unpack(r[i][1])
+    }
+    return r as any as [KeyOut, ValOut][]
+  }
+
+  // Decode a batch of range results, through the value encoding's
+  // unpackBatch hook if it has one.
+  private _decodeRangeResult(r: [Buffer, Buffer][], stripped: boolean): [KeyOut, ValOut][] | Promise<[KeyOut, ValOut][]> {
+    const valueXf = this._valueEncoding
+    if (valueXf.unpackBatch == null || r.length === 0) {
+      return stripped ? this._encodeStrippedRangeResult(r) : this._encodeRangeResult(r)
+    }
+
+    const keyXf = stripped ? this.subspace.keyXf : this._keyEncoding
+    return valueXf.unpackBatch(r.map(kv => kv[1])).then(vals => {
+      for (let i = 0; i < r.length; i++) {
+        ; (r as any)[i][0] = keyXf.unpack(r[i][0])
+          ; (r as any)[i][1] = vals[i]
+      }
+      return r as any as [KeyOut, ValOut][]
+    })
+  }
+
   private getRangeNative(start: KeySelector<NativeValue>,
     end: KeySelector<NativeValue> | null,  // If not specified, start is used as a prefix.
     limit: number, targetBytes: number, streamingMode: StreamingMode,
-    iter: number, reverse: boolean): Promise<KVList<Buffer, Buffer>> {
+    iter: number, reverse: boolean, stripPrefix: Buffer | null = null): Promise<KVList<Buffer, Buffer>> {
     const _end = end != null ? end : keySelector.firstGreaterOrEqual(strInc(start.key))
-    return this._tn.getRange(
-      start.key, start.orEqual, start.offset,
-      _end.key, _end.orEqual, _end.offset,
-      limit, targetBytes, streamingMode,
-      iter, this.isSnapshot, reverse)
+    return this._limitRead(() => stripPrefix == null
+      ? this._tn.getRange(
+        start.key, start.orEqual, start.offset,
+        _end.key, _end.orEqual, _end.offset,
+        limit, targetBytes, streamingMode,
+        iter, this.isSnapshot, reverse)
+      : this._tn.getRange(
+        start.key, start.orEqual, start.offset,
+        _end.key, _end.orEqual, _end.offset,
+        limit, targetBytes, streamingMode,
+        iter, this.isSnapshot, reverse, undefined, stripPrefix))
   }
 
   async getRangeRaw(start: KeySelector<KeyIn>, end: KeySelector<KeyIn> | null,
@@ -408,26 +591,25 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
         txn: this
       })
     }
+    const stripPrefix = this._stripPrefix()
     return this.getRangeNative(
       keySelector.toNative(start, this._keyEncoding),
       end != null ? keySelector.toNative(end, this._keyEncoding) : null,
-      limit, targetBytes, streamingMode, iter, reverse)
-      .then(r => ({ more: r.more, results: this._encodeRangeResult(r.results) }))
+      limit, targetBytes, streamingMode, iter, reverse, stripPrefix)
+      .then(async r => ({
+        more: r.more,
+        results: await this._decodeRangeResult(r.results, stripPrefix != null)
+      }))
   }
 
   getEstimatedRangeSizeBytes(start: KeyIn, end: KeyIn): Promise<number> {
-    return this._tn.getEstimatedRangeSizeBytes(
-      this._keyEncoding.pack(start),
-      this._keyEncoding.pack(end)
-    )
+    const startBuf = this._keyEncoding.pack(start), endBuf = this._keyEncoding.pack(end)
+    return this._limitRead(() => this._tn.getEstimatedRangeSizeBytes(startBuf, endBuf))
   }
 
   getRangeSplitPoints(start: KeyIn, end: KeyIn, chunkSize: number): Promise<KeyOut[]> {
-    return this._tn.getRangeSplitPoints(
-      this._keyEncoding.pack(start),
-      this._keyEncoding.pack(end),
-      chunkSize
-    ).then(results => (
+    const startBuf = this._keyEncoding.pack(start), endBuf = this._keyEncoding.pack(end)
+    return this._limitRead(() => this._tn.getRangeSplitPoints(startBuf, endBuf, chunkSize)).then(results => (
       results.map(r => this._keyEncoding.unpack(r))
     ))
   }
@@ -462,41 +644,120 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
         txn: this
       })
     }
+    const [start, end] = this._packRangeSelectors(_start, _end)
+    const stripPrefix = this._stripPrefix()
+    for await (const results of this._getRangeBatchNative(start, end, opts, stripPrefix)) {
+      // This destructively consumes results.
+      yield await this._decodeRangeResult(results, stripPrefix != null)
+    }
+  }
+
+  /** @internal */
+  _packRangeSelectors(
+    _start: KeyIn | KeySelector<KeyIn>,
+    _end?: KeyIn | KeySelector<KeyIn>): [KeySelector<NativeValue>, KeySelector<NativeValue>] {
     // This is a bit of a dog's breakfast. We're trying to handle a lot of different cases here:
     // - The start and end parameters can be specified as keys or as selectors
     // - The end parameter can be missing / null, and if it is we want to "do the right thing" here
     //   - Which normally means searching between [start, strInc(start)]
     //   - But with tuple encoding this means between [start + '\x00', start + '\xff']
-
-    let start: KeySelector<string | Buffer>, end: KeySelector<string | Buffer>
     const startSelEnc = keySelector.from(_start)
 
     if (_end == null) {
       const range = this.subspace.packRange(startSelEnc.key)
-      start = keySelector(range.begin, startSelEnc.orEqual, startSelEnc.offset)
-      end = keySelector.firstGreaterOrEqual(range.end)
+      return [
+        keySelector(range.begin, startSelEnc.orEqual, startSelEnc.offset),
+        keySelector.firstGreaterOrEqual(range.end)
+      ]
     } else {
-      start = keySelector.toNative(startSelEnc, this._keyEncoding)
-      end = keySelector.toNative(keySelector.from(_end), this._keyEncoding)
+      return [
+        keySelector.toNative(startSelEnc, this._keyEncoding),
+        keySelector.toNative(keySelector.from(_end), this._keyEncoding)
+      ]
     }
+  }
 
+  // Same as getRangeBatch, but takes native selectors and yields raw (undecoded)
+  // batches. If stripPrefix is set, it is removed from the yielded keys.
+  //
+  // If accumulate is set the caller keeps every batch, so maxBufferedBytes
+  // caps the total size of the range rather than the size of each batch.
+  /** @internal */
+  async *_getRangeBatchNative(
+    start: KeySelector<NativeValue>,
+    end: KeySelector<NativeValue>,
+    opts: RangeOptions = {},
+    stripPrefix: Buffer | null = null,
+    accumulate: boolean = false) {
     let limit = opts.limit || 0
-    const streamingMode = opts.streamingMode == null ? StreamingMode.Iterator : opts.streamingMode
+    const maxBatchBytes = opts.maxBatchBytes || opts.targetBytes || 0
+    const maxBuffered = opts.maxBufferedBytes || 0
+    const adaptive = !!opts.adaptive
+    const adaptiveMax = Math.max(maxBatchBytes || ADAPTIVE_MAX_BYTES, ADAPTIVE_MIN_BYTES)
+    // In adaptive mode the batch size is set entirely by targetBytes, so
+    // WantAll is used to stop the streaming mode from limiting it further.
+    const streamingMode = opts.streamingMode != null ? opts.streamingMode
+      : adaptive ? StreamingMode.WantAll : StreamingMode.Iterator
+
+    let batchBytes = adaptive ? ADAPTIVE_MIN_BYTES : maxBatchBytes
+    let buffered = 0
 
     let iter = 0
     while (1) {
-      const { results, more } = await this.getRangeNative(start, end,
-        limit, 0, streamingMode, ++iter, opts.reverse || false)
+      let targetBytes = batchBytes
+      if (maxBuffered) {
+        // Don't fetch more than the budget has room for. Streaming reads only
+        // hold one batch at a time, so each batch gets the whole budget.
+        const room = accumulate ? Math.max(maxBuffered - buffered, 1) : maxBuffered
+        targetBytes = targetBytes ? Math.min(targetBytes, room) : room
+      }
+
+      const fetchStart = adaptive ? performance.now() : 0
+      let { results, more } = await this.getRangeNative(start, end,
+        limit, targetBytes, streamingMode, ++iter, opts.reverse || false, stripPrefix)
+      const fetchMs = adaptive ? performance.now() - fetchStart : 0
+
+      if (maxBuffered) {
+        // targetBytes is a soft limit, and FDB includes the row which crosses
+        // it. When streaming, that row is dropped and fetched again as the
+        // start of the next batch.
+        let bytes = 0, n = 0
+        for (; n < results.length; n++) {
+          const kvLen = results[n][0].length + results[n][1].length
+          if (!accumulate && n > 0 && bytes + kvLen > maxBuffered) break
+          bytes += kvLen
+        }
+        if (n < results.length) {
+          results.length = n
+          more = true
+        }
+
+        buffered = accumulate ? buffered + bytes : bytes
+        if (buffered > maxBuffered) {
+          throw new Error(`Range read exceeded maxBufferedBytes (${buffered} > ${maxBuffered})`)
+        }
+      }
 
       if (results.length) {
-        if (!opts.reverse) start = keySelector.firstGreaterThan(results[results.length - 1][0])
-        else end = keySelector.firstGreaterOrEqual(results[results.length - 1][0])
+        const lastKey = results[results.length - 1][0]
+        const last = stripPrefix ? concat2(stripPrefix, lastKey) : lastKey
+        if (!opts.reverse) start = keySelector.firstGreaterThan(last)
+        else end = keySelector.firstGreaterOrEqual(last)
       }
 
-      // This destructively consumes results.
-      yield this._encodeRangeResult(results)
+      const yieldedAt = adaptive ? performance.now() : 0
+      yield results
       if (!more) break
 
+      if (adaptive) {
+        // If the consumer finished with the batch before we could fetch
+        // another, round trips are the bottleneck and bigger batches help.
+        // If it is much slower, smaller batches waste less when it stops early.
+        const consumeMs = performance.now() - yieldedAt
+        if (consumeMs < fetchMs) batchBytes = Math.min(batchBytes * 2, adaptiveMax)
+        else if (consumeMs > fetchMs * 4) batchBytes = Math.max(batchBytes / 2, ADAPTIVE_MIN_BYTES)
+      }
+
       if (limit) {
         limit -= results.length
         if (limit <= 0) break
@@ -545,6 +806,10 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
    * - **streamingMode:** (enum StreamingMode) *(rarely used)* The policy for
    *   how eager FDB should be about prefetching data. See enum StreamingMode in
    *   opts.
+   * - **maxBatchBytes:** (number) Soft cap on the bytes fetched per request.
+   * - **maxBufferedBytes:** (number) Hard cap on the bytes held in memory.
+   * - **adaptive:** (boolean) Grow and shrink batches to match how fast the
+   *   consumer drains them.
    */
   async *getRange(
     start: KeyIn | KeySelector<KeyIn>, // Consider also supporting string / buffers for these.
@@ -587,11 +852,15 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
       })
     }
     const childOpts: RangeOptions = { ...opts }
-    if (childOpts.streamingMode == null) childOpts.streamingMode = StreamingMode.WantAll
+    if (childOpts.streamingMode == null && !childOpts.adaptive) childOpts.streamingMode = StreamingMode.WantAll
 
+    const [s, e] = this._packRangeSelectors(start, end)
+    const stripPrefix = this._stripPrefix()
     const result: [KeyOut, ValOut][] = []
-    for await (const batch of this.getRangeBatch(start, end, childOpts)) {
-      result.push.apply(result, batch)
+    for await (const raw of this._getRangeBatchNative(s, e, childOpts, stripPrefix, true)) {
+      const batch = await this._decodeRangeResult(raw, stripPrefix != null)
+      // push.apply overflows the stack on very large batches.
+      for (let i = 0; i < batch.length; i++) result.push(batch[i])
     }
     return result
   }
@@ -600,6 +869,19 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
     return this.getRangeAll(prefix, undefined, opts)
   }
 
+  /**
+   * Create a node readable stream over the specified range. The next batch is
+   * only fetched from the database once the consumer has drained the
+   * stream's buffer. By default the stream is in object mode and each chunk
+   * is a batch of [key, value] pairs. Pass `{binary: true}` to get a stream of
+   * framed raw keys and values instead (see ReadStreamOptions).
+   *
+   * The stream must be consumed before the transaction expires.
+   */
+  createReadStream(start: KeyIn | KeySelector<KeyIn>, end?: KeyIn | KeySelector<KeyIn>, opts?: ReadStreamOptions): Readable {
+    return createTxnReadStream(this, start, end, opts)
+  }
+
   /**
    * Removes all key value pairs from the database in between start and end.
    *
@@ -638,6 +920,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   watch(key: KeyIn, opts?: WatchOptions): Watch {
     const throwAll = opts && opts.throwAllErrors
     const watch = this._tn.watch(this._keyEncoding.pack(key), !throwAll)
+    this._ctx.pinned = true
     // Suppress the global unhandledRejection handler when a watch errors
     watch.promise.catch(doNothing)
     return watch
@@ -667,7 +950,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   /** @deprecated - Use promises API instead. */
   getReadVersion(cb: Callback<Version>): void
   getReadVersion(cb?: Callback<Version>) {
-    return cb ? this._tn.getReadVersion(cb) : this._tn.getReadVersion()
+    return cb ? this._tn.getReadVersion(cb) : this._limitRead(() => this._tn.getReadVersion())
   }
 
   getCommittedVersion() { return this._tn.getCommittedVersion() }
@@ -678,6 +961,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   /** @deprecated - Use promises API instead. */
   getVersionstamp(cb: Callback<Buffer>): void
   getVersionstamp(cb?: Callback<Buffer>) {
+    this._ctx.pinned = true
     if (cb) return this._tn.getVersionstamp(cb)
     else {
       // This one is surprisingly tricky:
@@ -695,7 +979,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
     }
   }
 
-  getAddressesForKey(key: KeyIn): string[] {
+  getAddressesForKey(key: KeyIn): Promise<string[]> {
     return this._tn.getAddressesForKey(this._keyEncoding.pack(key))
   }
 
@@ -839,7 +1123,8 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
    * using setVersionstampedValue with tuples, just call get().
    */
   async getVersionstampPrefixedValue(key: KeyIn): Promise<{ stamp: Buffer, value?: ValOut } | null> {
-    const val = await this._tn.get(this._keyEncoding.pack(key), this.isSnapshot)
+    const keyBuf = this._keyEncoding.pack(key)
+    const val = await this._limitRead(() => this._tn.get(keyBuf, this.isSnapshot))
 
     if (val == null) {
       return null;
@@ -883,3 +1168,7 @@ export default class Transaction<KeyIn = NativeValue, KeyOut = Buffer, ValIn = N
   //   this.atomicOpKB(MutationType.SetVersionstampedValue, key, valPack)
   // }
 }
+
+// Symbol.dispose (for `using` declarations) only exists in newer versions of node.
+const disposeSymbol: symbol | undefined = (Symbol as any).dispose
+if (disposeSymbol) (Transaction.prototype as any)[disposeSymbol] = Transaction.prototype.dispose
@@ -22,6 +22,10 @@ export type Transformer<In, Out> = {
   /// for the type. Added primarily to make it easier to get a range with some
   /// tuple prefix.
   range?(prefix: In): {begin: Buffer | string, end: Buffer | string},
+
+  /// Optional hook to decode all the values in a range read batch at once (eg
+  /// off the main thread). Results must match calling unpack on each value.
+  unpackBatch?(bufs: Buffer[]): Promise<Out[]>,
 }
 
 const id = <T>(x: T) => x
@@ -1,3 +1,7 @@
+// Type-only, so this leaf module doesn't import them at runtime.
+import type Database from './database'
+import type Transaction from './transaction'
+
 // String increment. Find the next string (well, buffer) after this buffer.
 export const strInc = (val: string | Buffer): Buffer => {
   const buf = typeof val === 'string' ? Buffer.from(val) : val
@@ -18,6 +22,12 @@ export const strInc = (val: string | Buffer): Buffer => {
   return result;
 }
 
+// The end of the range of keys starting with prefix. An empty prefix covers
+// every user key, which all sort before \xff.
+export const prefixEnd = (prefix: Buffer): Buffer => (
+  prefix.length ? strInc(prefix) : Buffer.from([0xff])
+)
+
 const byteZero = Buffer.alloc(1)
 byteZero.writeUInt8(0, 0)
 
@@ -44,3 +54,36 @@ export const concat2 = (a: Buffer, b: Buffer) => {
 export const startsWith = (a: Buffer, prefix: Buffer) => (
   prefix.length <= a.length && prefix.compare(a, 0, prefix.length) === 0
 )
+
+// The error to reject with when an AbortSignal fires. Older versions of node
+// don't set signal.reason.
+export const abortReason = (signal: AbortSignal): any => (
+  signal.reason !== undefined ? signal.reason
+    : Object.assign(new Error('The operation was aborted'), {name: 'AbortError'})
+)
+
+// Wrapper for functions which take a database or a transaction. Databases
+// are told apart by their doTn method, which transactions don't have.
+export const doTxn = <KeyIn, KeyOut, ValIn, ValOut, T>(
+    dbOrTxn: Database<KeyIn, KeyOut, ValIn, ValOut> | Transaction<KeyIn, KeyOut, ValIn, ValOut>,
+    body: (tn: Transaction<KeyIn, KeyOut, ValIn, ValOut>) => Promise<T>): Promise<T> => (
+  typeof (dbOrTxn as Database<KeyIn, KeyOut, ValIn, ValOut>).doTn === 'function'
+    ? (dbOrTxn as Database<KeyIn, KeyOut, ValIn, ValOut>).doTn(body)
+    : body(dbOrTxn as Transaction<KeyIn, KeyOut, ValIn, ValOut>)
+)
+
+// Run fn on every item, with at most concurrency calls running at once. Once
+// a call fails, no more items are started and the error is passed on.
+export const forEachConcurrently = async <T>(items: T[], concurrency: number, fn: (item: T) => Promise<void>) => {
+  let next = 0
+  let failed = false
+  const worker = async () => {
+    try {
+      while (!failed && next < items.length) await fn(items[next++])
+    } catch (e) {
+      failed = true
+      throw e
+    }
+  }
+  await Promise.all(Array.from({length: Math.min(concurrency, items.length)}, worker))
+}
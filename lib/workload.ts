@@ -0,0 +1,183 @@
+// Workload classes. Interactive requests and background jobs often share a
+// database, and the background work should get out of the way when the
+// cluster is busy. A database reference scoped to a workload class (via
+// db.withWorkloadClass(name)) runs its transactions:
+//
+// - At the FDB priority for that class (batch transactions use
+//   priority_batch, system transactions use priority_system_immediate)
+// - Within that class's concurrency budget
+//
+// We also keep an EWMA of how long it takes to get a read version (GRV). GRV
+// latency is the first thing to rise when ratekeeper starts throttling the
+// cluster, so adaptive classes (batch, by default) use it to back off: their
+// budget is halved when the latency goes above the target, and grows again
+// by one slot at a time once it recovers.
+//
+// The scheduler is shared by every Database reference which wraps the same
+// native database.
+
+import { NativeDatabase, NativeTransaction } from './native'
+import { TransactionOptionCode } from './opts.g'
+import { Semaphore, QueueStats } from './limiter'
+
+export type WorkloadClassName = 'interactive' | 'batch' | 'system'
+
+export interface WorkloadClassConfig {
+  /** Maximum number of transactions of this class running at once. 0 / undefined for no limit. */
+  maxConcurrent?: undefined | number,
+  /**
+   * Back off when GRV latency goes above the target. Defaults to true for
+   * batch and false otherwise. Adaptive classes without a maxConcurrent start
+   * with a budget of 100.
+   */
+  adaptive?: undefined | boolean,
+}
+
+export interface WorkloadConfig {
+  interactive?: undefined | WorkloadClassConfig,
+  batch?: undefined | WorkloadClassConfig,
+  system?: undefined | WorkloadClassConfig,
+  /** GRV latency above which adaptive classes back off. Defaults to 20ms. */
+  grvLatencyTargetMs?: undefined | number,
+}
+
+export interface WorkloadClassStats extends QueueStats {
+  /** Smoothed GRV latency observed by transactions of this class. */
+  grvLatencyMs: number,
+  /** Number of times the budget of this class was cut because of GRV latency. */
+  backoffs: number,
+}
+
+export interface WorkloadStats {
+  /** Smoothed GRV latency across all classes. */
+  grvLatencyMs: number,
+  classes: {[name in WorkloadClassName]: WorkloadClassStats},
+}
+
+const classPriority: {[name in WorkloadClassName]: TransactionOptionCode | null} = {
+  interactive: null,
+  batch: TransactionOptionCode.PriorityBatch,
+  system: TransactionOptionCode.PrioritySystemImmediate,
+}
+
+const DEFAULT_GRV_TARGET_MS = 20
+const DEFAULT_ADAPTIVE_LIMIT = 100
+const EWMA_ALPHA = 0.2
+// Don't halve the budget more than once in this window. It takes a little
+// while for a cut to have any effect on the latency we observe.
+const BACKOFF_INTERVAL_MS = 1000
+
+class WorkloadClass {
+  priority: TransactionOptionCode | null
+  sem: Semaphore
+  adaptive = false
+  maxLimit = 0
+  grvLatencyMs = 0
+  backoffs = 0
+  lastBackoff = 0
+
+  constructor(name: WorkloadClassName) {
+    this.priority = classPriority[name]
+    this.sem = new Semaphore(0, Infinity)
+  }
+
+  configure(name: WorkloadClassName, config: WorkloadClassConfig = {}) {
+    this.adaptive = config.adaptive != null ? config.adaptive : name === 'batch'
+    this.maxLimit = config.maxConcurrent || (this.adaptive ? DEFAULT_ADAPTIVE_LIMIT : 0)
+    this.sem.limit = this.maxLimit
+    this.sem._wake()
+  }
+}
+
+export class WorkloadScheduler {
+  grvLatencyMs = 0
+  grvTargetMs = DEFAULT_GRV_TARGET_MS
+  classes: {[name in WorkloadClassName]: WorkloadClass}
+
+  constructor() {
+    this.classes = {
+      interactive: new WorkloadClass('interactive'),
+      batch: new WorkloadClass('batch'),
+      system: new WorkloadClass('system'),
+    }
+    this.configure({})
+  }
+
+  configure(config: WorkloadConfig) {
+    this.grvTargetMs = config.grvLatencyTargetMs || DEFAULT_GRV_TARGET_MS
+    for (const name of Object.keys(this.classes) as WorkloadClassName[]) {
+      this.classes[name].configure(name, config[name])
+    }
+  }
+
+  observeGrvLatency(name: WorkloadClassName, ms: number) {
+    const c = this.classes[name]
+    c.grvLatencyMs = c.grvLatencyMs === 0 ? ms : c.grvLatencyMs + EWMA_ALPHA * (ms - c.grvLatencyMs)
+    this.grvLatencyMs = this.grvLatencyMs === 0 ? ms : this.grvLatencyMs + EWMA_ALPHA * (ms - this.grvLatencyMs)
+
+    // AIMD on the budget of each adaptive class.
+    const now = Date.now()
+    for (const k in this.classes) {
+      const cls = this.classes[k as WorkloadClassName]
+      if (!cls.adaptive) continue
+
+      if (this.grvLatencyMs > this.grvTargetMs) {
+        if (now - cls.lastBackoff >= BACKOFF_INTERVAL_MS && cls.sem.limit > 1) {
+          cls.sem.limit = Math.max(1, cls.sem.limit >> 1)
+          cls.lastBackoff = now
+          cls.backoffs++
+        }
+      } else if (cls.sem.limit < cls.maxLimit) {
+        cls.sem.limit++
+        cls.sem._wake()
+      }
+    }
+  }
+
+  // Run a transaction (via exec) as part of the named class. exec must call
+  // prepare at the start of every attempt. If signal aborts while the
+  // transaction is waiting for a slot, it is dropped from the queue.
+  run<T>(name: WorkloadClassName, exec: (prepare: (tn: NativeTransaction) => void) => Promise<T>, signal: AbortSignal | null = null): Promise<T> {
+    const cls = this.classes[name]
+    if (cls == null) return Promise.reject(new Error(`Unknown workload class ${name}`))
+
+    return cls.sem.run(() => {
+      let first = true
+      return exec(tn => {
+        // Priority options aren't persistent across retries, so they're set on
+        // each attempt.
+        if (cls.priority != null) tn.setOption(cls.priority, null)
+        if (first) {
+          // Reads in the transaction share this read version, so this is free.
+          first = false
+          const start = Date.now()
+          tn.getReadVersion().then(() => this.observeGrvLatency(name, Date.now() - start), () => {})
+        }
+      })
+    }, signal)
+  }
+
+  getStats(): WorkloadStats {
+    const classes = {} as WorkloadStats['classes']
+    for (const k in this.classes) {
+      const cls = this.classes[k as WorkloadClassName]
+      classes[k as WorkloadClassName] = {
+        ...cls.sem.getStats(),
+        grvLatencyMs: cls.grvLatencyMs,
+        backoffs: cls.backoffs,
+      }
+    }
+    return { grvLatencyMs: this.grvLatencyMs, classes }
+  }
+}
+
+const schedulers = new WeakMap<NativeDatabase, WorkloadScheduler>()
+
+export const getScheduler = (db: NativeDatabase): WorkloadScheduler => {
+  let s = schedulers.get(db)
+  if (s == null) {
+    s = new WorkloadScheduler()
+    schedulers.set(db, s)
+  }
+  return s
+}
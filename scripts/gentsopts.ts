@@ -45,6 +45,16 @@ const readOptions = (data: any[]) => (
   }))
 )
 
+// Some options can be set more than once (eg each call to set the tag option
+// adds another tag). Since an options object can only name each option once,
+// these also get a plural alias which takes a list.
+const repeatedAliases: {[scope: string]: {[name: string]: string}} = {
+  TransactionOption: {
+    tag: 'tags',
+    auto_throttle_tag: 'auto_throttle_tags',
+  },
+}
+
 const typeToTs = (type: 'string' | 'int' | 'bytes' | 'none') => ({
   string: 'string',
   int: 'number',
@@ -67,11 +77,13 @@ parseString(xml, (err, result) => {
     // console.log(name)
     if (name.endsWith('Option')) {
       line(`export type ${name}s = {`)
+      const aliases = repeatedAliases[name] || {}
       options.forEach(({name, type, paramDescription, deprecated}) => {
         output.write(`  ${name}?: undefined | ${typeToTs(type)}`)
         if (deprecated) output.write(` ${comment} DEPRECATED`)
         else if (paramDescription) output.write(`  ${comment} ${paramDescription}`)
         line()
+        if (aliases[name]) line(`  ${aliases[name]}?: undefined | ${typeToTs(type)}[]  ${comment} Sets ${name} once for each entry`)
       })
       line(`}\n`)
 
@@ -93,22 +105,33 @@ parseString(xml, (err, result) => {
     line(`}\n`)
   })
 
+  line(`${comment} The option tables are only built the first time they're used, so loading`)
+  line(`${comment} the module doesn't pay for them.`)
+  line(`const lazy = (build: () => OptionData) => {`)
+  line(`  let data: OptionData | null = null`)
+  line(`  return () => data || (data = build())`)
+  line(`}\n`)
+
   result.Options.Scope.forEach((scope: any) => {
     const name: string = scope.$.name
     if (name.endsWith('Option')) {
       const options = readOptions(scope.Option)
 
-      line(`export const ${toLowerFirst(name) + 'Data'}: OptionData = {`)
+      const aliases = repeatedAliases[name] || {}
+      line(`export const ${toLowerFirst(name) + 'Data'} = lazy(() => ({`)
       options.forEach(({name, code, description, paramDescription, type, deprecated}) => {
-        line(`  ${name}: {`)
-        line(`    code: ${code},`)
-        line(`    description: "${description}",`)
-        if (deprecated) line(`    deprecated: ${deprecated},`)
-        line(`    type: '${type}',`)
-        if (type !== 'none') line(`    paramDescription: "${paramDescription}",`)
-        line(`  },\n`)
+        for (const n of aliases[name] ? [name, aliases[name]] : [name]) {
+          line(`  ${n}: {`)
+          line(`    code: ${code},`)
+          line(`    description: "${description}",`)
+          if (deprecated) line(`    deprecated: ${deprecated},`)
+          if (n !== name) line(`    repeated: true,`)
+          line(`    type: '${type}',`)
+          if (type !== 'none') line(`    paramDescription: "${paramDescription}",`)
+          line(`  },\n`)
+        }
       })
-      line(`}\n`)
+      line(`}))\n`)
     }
   })
 
@@ -0,0 +1,541 @@
+// Block compression for values.
+//
+// The block format is LZ4's: a sequence of (token, literals, offset, match
+// length) records. The token's high nibble is the literal length and the low
+// nibble is the match length - 4. A nibble of 15 means the length continues
+// in the following bytes, 255 at a time. Offsets are 2 byte little endian, so
+// matches reach back at most 64KB. The last record has literals only.
+//
+// Compressed values are framed with a header byte so they can live alongside
+// values written before compression was turned on:
+//
+//   0xff <varint rawLen> <block>                 compressed
+//   0xfe <u32 LE dictId> <varint rawLen> <block> compressed with a dictionary
+//   0xfd <bytes>                                 stored as-is
+//   anything else                                legacy, stored as-is
+//
+// Values which don't compress are stored as-is, and only need the 0xfd escape
+// if their first byte collides with a header. None of these bytes can start
+// a UTF-8 string, so existing JSON and string values are never misread.
+//
+// A dictionary is a blob of content which is common across values (eg JSON
+// field names). It's logically prepended to each value, so even small values
+// can match against it.
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "compress.h"
+
+static const uint8_t HDR_STORED = 0xfd;
+static const uint8_t HDR_DICT = 0xfe;
+static const uint8_t HDR_LZ = 0xff;
+
+static const int HASH_LOG = 14;
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+// As in LZ4, the last match must start at least 12 bytes before the end of
+// the input and the last 5 bytes are always literals.
+static const size_t MF_LIMIT = 12;
+static const size_t LAST_LITERALS = 5;
+// Well above FDB's value size limit. This just bounds corrupt headers.
+static const size_t MAX_RAW_LEN = 1 << 30;
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static void writeExtLen(std::string &out, size_t len) {
+  while (len >= 255) {
+    out.push_back((char)255);
+    len -= 255;
+  }
+  out.push_back((char)len);
+}
+
+static bool readExtLen(const uint8_t *src, size_t srcLen, size_t *ip, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= srcLen) return false;
+    b = src[(*ip)++];
+    *len += b;
+    if (*len > MAX_RAW_LEN) return false;
+  } while (b == 255);
+  return true;
+}
+
+static void writeVarint(std::string &out, size_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+static bool readVarint(const uint8_t *src, size_t srcLen, size_t *pos, size_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*pos >= srcLen) return false;
+    uint8_t b = src[(*pos)++];
+    *v |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// matchLen is 0 for the final, literal-only sequence.
+static void emitSequence(std::string &out, const uint8_t *lit, size_t litLen, size_t offset, size_t matchLen) {
+  size_t ml = matchLen ? matchLen - MIN_MATCH : 0;
+  uint8_t token = (uint8_t)((std::min(litLen, (size_t)15) << 4) | std::min(ml, (size_t)15));
+  out.push_back((char)token);
+  if (litLen >= 15) writeExtLen(out, litLen - 15);
+  out.append((const char *)lit, litLen);
+  if (matchLen == 0) return;
+
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (ml >= 15) writeExtLen(out, ml - 15);
+}
+
+// Compress buf[start, end) and append the block to out. buf[0, start) is the
+// dictionary, which matches may refer back into.
+static void lzCompress(const uint8_t *buf, size_t start, size_t end, std::string &out) {
+  std::vector<int32_t> table((size_t)1 << HASH_LOG, -1);
+  size_t dictStart = start > MAX_OFFSET ? start - MAX_OFFSET : 0;
+  for (size_t i = dictStart; i + MIN_MATCH <= start; i++) table[hash4(read32(buf + i))] = (int32_t)i;
+
+  size_t anchor = start, ip = start;
+  if (end - start > MF_LIMIT) {
+    const size_t mfLimit = end - MF_LIMIT;
+    const size_t matchLimit = end - LAST_LITERALS;
+
+    while (ip < mfLimit) {
+      uint32_t seq = read32(buf + ip);
+      uint32_t h = hash4(seq);
+      int32_t ref = table[h];
+      table[h] = (int32_t)ip;
+      if (ref < 0 || ip - ref > MAX_OFFSET || read32(buf + ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      size_t r = ref, len = MIN_MATCH;
+      while (ip + len < matchLimit && buf[r + len] == buf[ip + len]) len++;
+      // Pull the match start back over any literals which also match.
+      while (ip > anchor && r > 0 && buf[ip - 1] == buf[r - 1]) {
+        ip--; r--; len++;
+      }
+
+      emitSequence(out, buf + anchor, ip - anchor, ip - r, len);
+      ip += len;
+      anchor = ip;
+      if (ip - 2 >= start && ip < mfLimit) table[hash4(read32(buf + ip - 2))] = (int32_t)(ip - 2);
+    }
+  }
+  emitSequence(out, buf + anchor, end - anchor, 0, 0);
+}
+
+// Decode a block into dst[dictLen, dictLen + rawLen). dst[0, dictLen) holds the
+// dictionary. Returns false if the block is corrupt.
+static bool lzDecompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dictLen, size_t rawLen) {
+  size_t ip = 0, op = dictLen;
+  const size_t oend = dictLen + rawLen;
+
+  while (true) {
+    if (ip >= srcLen) return false;
+    uint8_t token = src[ip++];
+
+    size_t litLen = token >> 4;
+    if (litLen == 15 && !readExtLen(src, srcLen, &ip, &litLen)) return false;
+    if (litLen > srcLen - ip || litLen > oend - op) return false;
+    memcpy(dst + op, src + ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if (ip == srcLen) return op == oend;
+
+    if (srcLen - ip < 2) return false;
+    size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) return false;
+
+    size_t matchLen = token & 15;
+    if (matchLen == 15 && !readExtLen(src, srcLen, &ip, &matchLen)) return false;
+    matchLen += MIN_MATCH;
+    if (matchLen > oend - op) return false;
+
+    // Matches may overlap the bytes they produce, so this can't be a memcpy.
+    const uint8_t *m = dst + op - offset;
+    for (size_t i = 0; i < matchLen; i++) dst[op + i] = m[i];
+    op += matchLen;
+  }
+}
+
+// Frame and compress a value into out. Returns false (leaving out empty) if
+// the value should be stored exactly as given.
+static bool compressValue(const uint8_t *data, size_t len, const std::string &dict, uint32_t dictId, size_t minBytes, std::string &out) {
+  out.clear();
+  if (len >= minBytes && len > MF_LIMIT && len <= MAX_RAW_LEN) {
+    out.reserve(len + 16);
+    out.push_back((char)(dict.empty() ? HDR_LZ : HDR_DICT));
+    if (!dict.empty()) for (int i = 0; i < 4; i++) out.push_back((char)(dictId >> (8 * i)));
+    writeVarint(out, len);
+
+    if (dict.empty()) lzCompress(data, 0, len, out);
+    else {
+      std::vector<uint8_t> buf(dict.size() + len);
+      memcpy(buf.data(), dict.data(), dict.size());
+      memcpy(buf.data() + dict.size(), data, len);
+      lzCompress(buf.data(), dict.size(), buf.size(), out);
+    }
+
+    if (out.size() < len) return true;
+    out.clear();
+  }
+
+  if (len == 0 || data[0] < HDR_STORED) return false;
+  out.reserve(len + 1);
+  out.push_back((char)HDR_STORED);
+  out.append((const char *)data, len);
+  return true;
+}
+
+enum DecodeResult { DECODE_AS_IS, DECODE_OK, DECODE_CORRUPT, DECODE_NEED_DICT };
+
+// On DECODE_OK the value is out[*start, end).
+static DecodeResult decompressValue(const uint8_t *data, size_t len, const std::string &dict, std::string &out, size_t *start) {
+  *start = 0;
+  if (len == 0 || data[0] < HDR_STORED) return DECODE_AS_IS;
+  if (data[0] == HDR_STORED) {
+    out.assign((const char *)data + 1, len - 1);
+    return DECODE_OK;
+  }
+
+  size_t pos = 1;
+  bool useDict = data[0] == HDR_DICT;
+  if (useDict) {
+    if (len < 5) return DECODE_CORRUPT;
+    if (dict.empty()) return DECODE_NEED_DICT;
+    pos = 5;
+  }
+
+  size_t rawLen;
+  if (!readVarint(data, len, &pos, &rawLen) || rawLen > MAX_RAW_LEN) return DECODE_CORRUPT;
+  size_t dictLen = useDict ? dict.size() : 0;
+  out.resize(dictLen + rawLen);
+  if (dictLen) memcpy(&out[0], dict.data(), dictLen);
+  if (!lzDecompress(data + pos, len - pos, (uint8_t *)&out[0], dictLen, rawLen)) return DECODE_CORRUPT;
+  *start = dictLen;
+  return DECODE_OK;
+}
+
+// Build a dictionary from the byte strings which show up in the most samples.
+// We rank 8 byte substrings by the number of samples they appear in, then
+// take the surrounding segment for each one not already covered. The most
+// common segments go at the end of the dictionary, where offsets are shortest
+// and where they survive if the dictionary is truncated.
+static std::string trainDict(const std::vector<std::string> &samples, size_t size) {
+  const size_t K = 8;
+  const size_t SEGMENT = 32;
+
+  struct Stat { uint32_t count, lastSample, sample, pos; };
+  std::unordered_map<uint64_t, Stat> stats;
+  for (size_t s = 0; s < samples.size(); s++) {
+    const std::string &sample = samples[s];
+    for (size_t i = 0; i + K <= sample.size(); i++) {
+      uint64_t kmer;
+      memcpy(&kmer, sample.data() + i, K);
+      auto it = stats.find(kmer);
+      if (it == stats.end()) stats.emplace(kmer, Stat {1, (uint32_t)s, (uint32_t)s, (uint32_t)i});
+      else if (it->second.lastSample != s) {
+        it->second.count++;
+        it->second.lastSample = (uint32_t)s;
+      }
+    }
+  }
+
+  std::vector<std::pair<uint32_t, uint64_t>> ranked;
+  for (auto &kv : stats) if (kv.second.count > 1) ranked.push_back(std::make_pair(kv.second.count, kv.first));
+  std::sort(ranked.begin(), ranked.end(), [](const std::pair<uint32_t, uint64_t> &a, const std::pair<uint32_t, uint64_t> &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+
+  std::vector<std::string> segments;
+  std::unordered_set<uint64_t> covered;
+  size_t total = 0;
+  for (size_t r = 0; r < ranked.size() && total < size; r++) {
+    if (covered.count(ranked[r].second)) continue;
+    const Stat &stat = stats[ranked[r].second];
+    const std::string &sample = samples[stat.sample];
+
+    // Center the segment on the substring, clamped to the sample.
+    size_t begin = stat.pos > (SEGMENT - K) / 2 ? stat.pos - (SEGMENT - K) / 2 : 0;
+    size_t end = std::min(begin + SEGMENT, sample.size());
+    end = std::min(end, begin + (size - total));
+    segments.push_back(sample.substr(begin, end - begin));
+    total += end - begin;
+
+    for (size_t i = begin; i + K <= end; i++) {
+      uint64_t kmer;
+      memcpy(&kmer, sample.data() + i, K);
+      covered.insert(kmer);
+    }
+  }
+
+  std::string dict;
+  dict.reserve(total);
+  for (size_t i = segments.size(); i > 0; i--) dict.append(segments[i - 1]);
+  return dict;
+}
+
+
+// **** JS bindings
+
+static napi_status getBytes(napi_env env, napi_value value, const uint8_t **data, size_t *len) {
+  return get_buffer_info(env, value, (void **)data, len);
+}
+
+// Only the last 64KB of a dictionary is reachable by a match.
+static napi_status getDict(napi_env env, napi_value value, std::string &dict) {
+  napi_valuetype type;
+  NAPI_OK_OR_RETURN_STATUS(env, typeof_wrap(env, value, &type));
+  if (type == napi_null || type == napi_undefined) return napi_ok;
+
+  const uint8_t *data;
+  size_t len;
+  NAPI_OK_OR_RETURN_STATUS(env, getBytes(env, value, &data, &len));
+  if (len > MAX_OFFSET) {
+    data += len - MAX_OFFSET;
+    len = MAX_OFFSET;
+  }
+  dict.assign((const char *)data, len);
+  return napi_ok;
+}
+
+static napi_status throwDecodeError(napi_env env, DecodeResult result) {
+  NAPI_OK_OR_RETURN_STATUS(env, napi_throw_error(env, NULL, result == DECODE_NEED_DICT
+    ? "Value was compressed with a dictionary, but no dictionary was given"
+    : "Compressed value is corrupt"));
+  return napi_pending_exception;
+}
+
+static napi_status getBufferArray(napi_env env, napi_value value, std::vector<std::string> &out) {
+  uint32_t len;
+  NAPI_OK_OR_RETURN_STATUS(env, napi_get_array_length(env, value, &len));
+  out.resize(len);
+  for (uint32_t i = 0; i < len; i++) {
+    napi_value item;
+    NAPI_OK_OR_RETURN_STATUS(env, napi_get_element(env, value, i, &item));
+    const uint8_t *data;
+    size_t itemLen;
+    NAPI_OK_OR_RETURN_STATUS(env, getBytes(env, item, &data, &itemLen));
+    out[i].assign((const char *)data, itemLen);
+  }
+  return napi_ok;
+}
+
+// compress(data, dict | null, dictId, minBytes) -> Buffer. Returns data itself
+// if it's stored unchanged.
+static napi_value compress(napi_env env, napi_callback_info info) {
+  GET_ARGS(env, info, args, 4);
+
+  const uint8_t *data;
+  size_t len;
+  NAPI_OK_OR_RETURN_NULL(env, getBytes(env, args[0], &data, &len));
+  std::string dict;
+  NAPI_OK_OR_RETURN_NULL(env, getDict(env, args[1], dict));
+  uint32_t dictId, minBytes;
+  NAPI_OK_OR_RETURN_NULL(env, napi_get_value_uint32(env, args[2], &dictId));
+  NAPI_OK_OR_RETURN_NULL(env, napi_get_value_uint32(env, args[3], &minBytes));
+
+  std::string out;
+  if (!compressValue(data, len, dict, dictId, minBytes, out)) return args[0];
+
+  napi_value result;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_buffer_copy(env, out.size(), out.data(), NULL, &result));
+  return result;
+}
+
+// decompress(data, dict | null) -> Buffer.
+static napi_value decompress(napi_env env, napi_callback_info info) {
+  GET_ARGS(env, info, args, 2);
+
+  const uint8_t *data;
+  size_t len;
+  NAPI_OK_OR_RETURN_NULL(env, getBytes(env, args[0], &data, &len));
+  std::string dict;
+  NAPI_OK_OR_RETURN_NULL(env, getDict(env, args[1], dict));
+
+  std::string out;
+  size_t start;
+  DecodeResult r = decompressValue(data, len, dict, out, &start);
+  if (r == DECODE_AS_IS) return args[0];
+  if (r != DECODE_OK) {
+    throwDecodeError(env, r);
+    return NULL;
+  }
+
+  napi_value result;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_buffer_copy(env, out.size() - start, out.data() + start, NULL, &result));
+  return result;
+}
+
+// Batches are copied out of JS memory up front, so the work can run on the
+// libuv threadpool without touching any JS values.
+struct BatchWork {
+  napi_async_work work;
+  napi_deferred deferred;
+  napi_ref inputs; // Returned in place of values which are stored as-is.
+
+  bool isCompress;
+  std::string dict;
+  uint32_t dictId;
+  uint32_t minBytes;
+
+  std::vector<std::string> in;
+  std::vector<std::string> out;
+  std::vector<size_t> start;
+  std::vector<bool> asIs;
+  DecodeResult error;
+};
+
+static void executeBatch(napi_env env, void *data) {
+  BatchWork *w = static_cast<BatchWork *>(data);
+  size_t n = w->in.size();
+  w->out.resize(n);
+  w->start.assign(n, 0);
+  w->asIs.assign(n, false);
+  w->error = DECODE_OK;
+
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *in = (const uint8_t *)w->in[i].data();
+    if (w->isCompress) {
+      w->asIs[i] = !compressValue(in, w->in[i].size(), w->dict, w->dictId, w->minBytes, w->out[i]);
+    } else {
+      DecodeResult r = decompressValue(in, w->in[i].size(), w->dict, w->out[i], &w->start[i]);
+      if (r == DECODE_AS_IS) w->asIs[i] = true;
+      else if (r != DECODE_OK) {
+        w->error = r;
+        return;
+      }
+    }
+    // Free the input as we go, since we're done with it.
+    if (!w->asIs[i]) std::string().swap(w->in[i]);
+  }
+}
+
+static napi_status settleBatch(napi_env env, BatchWork *w, napi_value *result) {
+  if (w->error != DECODE_OK) {
+    NAPI_OK_OR_RETURN_STATUS(env, napi_create_string_utf8(env, w->error == DECODE_NEED_DICT
+      ? "Value was compressed with a dictionary, but no dictionary was given"
+      : "Compressed value is corrupt", NAPI_AUTO_LENGTH, result));
+    NAPI_OK_OR_RETURN_STATUS(env, napi_create_error(env, NULL, *result, result));
+    return napi_ok;
+  }
+
+  napi_value inputs;
+  NAPI_OK_OR_RETURN_STATUS(env, napi_get_reference_value(env, w->inputs, &inputs));
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_array_with_length(env, w->out.size(), result));
+  for (size_t i = 0; i < w->out.size(); i++) {
+    napi_value item;
+    if (w->asIs[i]) NAPI_OK_OR_RETURN_STATUS(env, napi_get_element(env, inputs, (uint32_t)i, &item));
+    else NAPI_OK_OR_RETURN_STATUS(env, napi_create_buffer_copy(env, w->out[i].size() - w->start[i], w->out[i].data() + w->start[i], NULL, &item));
+    NAPI_OK_OR_RETURN_STATUS(env, napi_set_element(env, *result, (uint32_t)i, item));
+  }
+  return napi_ok;
+}
+
+static void completeBatch(napi_env env, napi_status status, void *data) {
+  BatchWork *w = static_cast<BatchWork *>(data);
+
+  // env is NULL if the environment is being torn down.
+  if (env != NULL) {
+    napi_value result;
+    if (status == napi_cancelled) {
+      napi_create_string_utf8(env, "Compression cancelled", NAPI_AUTO_LENGTH, &result);
+      napi_create_error(env, NULL, result, &result);
+      napi_reject_deferred(env, w->deferred, result);
+    } else if (settleBatch(env, w, &result) == napi_ok) {
+      if (w->error == DECODE_OK) napi_resolve_deferred(env, w->deferred, result);
+      else napi_reject_deferred(env, w->deferred, result);
+    } else {
+      napi_get_and_clear_last_exception(env, &result);
+      napi_reject_deferred(env, w->deferred, result);
+    }
+
+    napi_delete_reference(env, w->inputs);
+    napi_delete_async_work(env, w->work);
+  }
+  delete w;
+}
+
+static napi_value startBatch(napi_env env, napi_callback_info info, bool isCompress) {
+  GET_ARGS(env, info, args, 4);
+
+  BatchWork *w = new BatchWork();
+  w->isCompress = isCompress;
+  w->dictId = 0;
+  w->minBytes = 0;
+  napi_status status = getBufferArray(env, args[0], w->in);
+  if (status == napi_ok) status = getDict(env, args[1], w->dict);
+  if (status == napi_ok && isCompress) status = napi_get_value_uint32(env, args[2], &w->dictId);
+  if (status == napi_ok && isCompress) status = napi_get_value_uint32(env, args[3], &w->minBytes);
+  if (status != napi_ok) {
+    delete w;
+    throw_if_not_ok(env, status);
+    return NULL;
+  }
+
+  napi_value promise, name;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_reference(env, args[0], 1, &w->inputs));
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_promise(env, &w->deferred, &promise));
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_string_utf8(env, isCompress ? "fdb:compressBatch" : "fdb:decompressBatch", NAPI_AUTO_LENGTH, &name));
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_async_work(env, NULL, name, executeBatch, completeBatch, w, &w->work));
+  NAPI_OK_OR_RETURN_NULL(env, napi_queue_async_work(env, w->work));
+  return promise;
+}
+
+// compressBatch(values[], dict | null, dictId, minBytes) -> Promise<Buffer[]>
+static napi_value compressBatch(napi_env env, napi_callback_info info) {
+  return startBatch(env, info, true);
+}
+
+// decompressBatch(values[], dict | null) -> Promise<Buffer[]>
+static napi_value decompressBatch(napi_env env, napi_callback_info info) {
+  return startBatch(env, info, false);
+}
+
+// trainDictionary(samples[], size) -> Buffer
+static napi_value trainDictionary(napi_env env, napi_callback_info info) {
+  GET_ARGS(env, info, args, 2);
+
+  std::vector<std::string> samples;
+  NAPI_OK_OR_RETURN_NULL(env, getBufferArray(env, args[0], samples));
+  uint32_t size;
+  NAPI_OK_OR_RETURN_NULL(env, napi_get_value_uint32(env, args[1], &size));
+
+  std::string dict = trainDict(samples, std::min((size_t)size, MAX_OFFSET));
+  napi_value result;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_buffer_copy(env, dict.size(), dict.data(), NULL, &result));
+  return result;
+}
+
+napi_status initCompress(napi_env env, napi_value exports) {
+  napi_property_descriptor desc[] = {
+    FN_DEF(compress),
+    FN_DEF(decompress),
+    FN_DEF(compressBatch),
+    FN_DEF(decompressBatch),
+    FN_DEF(trainDictionary),
+  };
+  return napi_define_properties(env, exports, sizeof(desc) / sizeof(desc[0]), desc);
+}
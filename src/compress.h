@@ -0,0 +1,10 @@
+// Block compression for values. See compress.cpp for the format.
+
+#ifndef FDB_NODE_COMPRESS_H
+#define FDB_NODE_COMPRESS_H
+
+#include "utils.h"
+
+napi_status initCompress(napi_env env, napi_value exports);
+
+#endif
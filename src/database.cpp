@@ -25,8 +25,7 @@
 #include "transaction.h"
 #include "database.h"
 #include "options.h"
-
-static napi_ref cons_ref;
+#include "future.h"
 
 static void finalize(napi_env env, void* database, void* finalize_hint) {
   fdb_database_destroy((FDB_database *)database);
@@ -34,7 +33,7 @@ static void finalize(napi_env env, void* database, void* finalize_hint) {
 
 MaybeValue newDatabase(napi_env env, FDBDatabase *database) {
   napi_value ctor;
-  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, cons_ref, &ctor));
+  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, getInstanceData(env)->database_cons_ref, &ctor));
 
   napi_value obj;
   NAPI_OK_OR_RETURN_MAYBE(env, napi_new_instance(env, ctor, 0, NULL, &obj));
@@ -73,22 +72,47 @@ static napi_value createTransaction(napi_env env, napi_callback_info info) {
   return newTransaction(env, tr).value;
 }
 
+// The client status is a JSON document. It is passed to JS as a buffer, and
+// parsed there.
+static MaybeValue getStatusJSON(napi_env env, FDBFuture *future, fdb_error_t *errOut) {
+  const uint8_t *json;
+  int len;
+  *errOut = fdb_future_get_key(future, &json, &len);
+  if (UNLIKELY(*errOut)) return wrap_null();
+
+  napi_value result;
+  NAPI_OK_OR_RETURN_MAYBE(env, napi_create_buffer_copy(env, (size_t)len, (void *)json, NULL, &result));
+  return wrap_ok(result);
+}
+
+static napi_value getClientStatus(napi_env env, napi_callback_info info) {
+  FDBDatabase *db = (FDBDatabase *)getWrapped(env, info);
+  if (db == NULL) {
+    throw_if_not_ok(env, napi_throw_error(env, NULL, "Cannot get client status after db closed"));
+    return NULL;
+  }
+
+  FDBFuture *f = fdb_database_get_client_status(db);
+  return futureToJS(env, f, NULL, getStatusJSON).value;
+}
+
 
 static napi_value newDatabase(napi_env env, napi_callback_info info) {
   return NULL;
 }
 
-napi_status initDatabase(napi_env env) {
+napi_status initDatabase(napi_env env, InstanceData *inst) {
   napi_property_descriptor desc[] = {
     FN_DEF(setOption),
     FN_DEF(close),
     FN_DEF(createTransaction),
+    FN_DEF(getClientStatus),
   };
 
   napi_value constructor;
   NAPI_OK_OR_RETURN_STATUS(env, napi_define_class(env, "Database", NAPI_AUTO_LENGTH,
     newDatabase, NULL, sizeof(desc)/sizeof(desc[0]), desc, &constructor));
 
-  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &cons_ref));
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &inst->database_cons_ref));
   return napi_ok;
 }
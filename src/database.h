@@ -27,8 +27,9 @@
 #include "fdbversion.h"
 #include <foundationdb/fdb_c.h>
 #include "utils.h"
+#include "instance.h"
 
 MaybeValue newDatabase(napi_env env, FDBDatabase *database);
-napi_status initDatabase(napi_env env);
+napi_status initDatabase(napi_env env, InstanceData *inst);
 
 #endif
@@ -26,15 +26,13 @@
 // This is pretty ugly. We're holding a reference to the exports object. The JS
 // code adds a reference to a JS error class after the module is created.
 
-static napi_ref module;
-
-napi_status initError(napi_env env, napi_value exports) {
-  return napi_create_reference(env, exports, 1, &module);
+napi_status initError(napi_env env, napi_value exports, InstanceData *inst) {
+  return napi_create_reference(env, exports, 1, &inst->module_ref);
 }
 
 MaybeValue create_error(napi_env env, fdb_error_t code) {
   napi_value jsModule;
-  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, module, &jsModule));
+  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, getInstanceData(env)->module_ref, &jsModule));
   napi_value constructor;
   NAPI_OK_OR_RETURN_MAYBE(env, napi_get_named_property(env, jsModule, "FDBError", &constructor));
 
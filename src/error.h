@@ -27,8 +27,9 @@
 #include "fdbversion.h"
 #include <foundationdb/fdb_c.h>
 #include "utils.h"
+#include "instance.h"
 
-napi_status initError(napi_env env, napi_value exports);
+napi_status initError(napi_env env, napi_value exports, InstanceData *inst);
 MaybeValue create_error(napi_env env, fdb_error_t code);
 
 // class FdbError {
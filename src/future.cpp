@@ -1,8 +1,12 @@
 #include <cassert>
+#include <cstdlib>
 #include <thread>
 
+#include <uv.h>
+
 #include "utils.h"
 #include "future.h"
+#include "instance.h"
 
 // #include <cstdio>
 
@@ -13,10 +17,6 @@
 
 // #include "FdbError.h"
 
-static napi_threadsafe_function tsf;
-static int num_outstanding = 0;
-std::thread::id node_main_thread;
-
 
 template<class CtxType> struct CtxBase {
   FDBFuture *future;
@@ -26,15 +26,44 @@ template<class CtxType> struct CtxBase {
   // This is here so when fdb_future_set_callback calls the callback directly we
   // can immediately call trigger.
   napi_env env;
+
+  // The state of the environment which created the future. The threadsafe
+  // function and thread id are copied out so the network thread never
+  // touches inst, which is freed when the environment (eg a worker thread) is
+  // torn down.
+  InstanceData *inst;
+  napi_threadsafe_function tsf;
+  std::thread::id js_thread;
+
+  // When the network thread queued this future for the JS thread (from
+  // uv_hrtime), or 0 if it was resolved on the JS thread directly.
+  uint64_t queued_at;
 };
 
+static void recordCallback(CallbackStats &stats, uint64_t queued_at) {
+  if (queued_at == 0) {
+    stats.inline_++;
+    return;
+  }
+
+  uint64_t delay = uv_hrtime() - queued_at;
+  stats.queued++;
+  stats.delay_ns += delay;
+
+  size_t b = 0;
+  while (b < CALLBACK_DELAY_BUCKETS - 1 && delay > CALLBACK_DELAY_BOUNDS_US[b] * 1000) b++;
+  stats.delay_buckets[b]++;
+}
+
 static void trigger(napi_env env, napi_value _js_callback, void* _context, void* data) {
   CtxBase<void>* ctx = static_cast<CtxBase<void>*>(data);
 
   if (env != NULL) {
-    --num_outstanding;
-    if (num_outstanding == 0) {
-      assert(0 == napi_unref_threadsafe_function(env, tsf));
+    InstanceData *inst = ctx->inst;
+    recordCallback(inst->callback_stats, ctx->queued_at);
+    --inst->num_outstanding;
+    if (inst->num_outstanding == 0) {
+      assert(0 == napi_unref_threadsafe_function(env, inst->tsf));
     }
 
     napi_status status = ctx->fn(env, ctx->future, ctx);
@@ -53,8 +82,6 @@ static void trigger(napi_env env, napi_value _js_callback, void* _context, void*
   delete ctx;
 }
 
-napi_value unused_func;
-
 // napi_create_threadsafe_function requires that we pass a JS function argument.
 // The function is never called, but we still need to pass one anyway:
 // See https://github.com/nodejs/node/issues/27592
@@ -63,61 +90,103 @@ napi_value unused(napi_env, napi_callback_info) {
   return NULL;
 }
 
-napi_status initFuture(napi_env env) {
-  node_main_thread = std::this_thread::get_id();
+napi_status initFuture(napi_env env, InstanceData *inst) {
+  inst->js_thread = std::this_thread::get_id();
+  inst->num_outstanding = 0;
+  inst->callback_stats = CallbackStats();
 
   char name[] = "unused_panic";
+  napi_value unused_func;
   NAPI_OK_OR_RETURN_STATUS(env, napi_create_function(env, name, sizeof(name)-1, unused, NULL, &unused_func));
 
   char resource_name[] = "fdbfuture";
   napi_value str;
   NAPI_OK_OR_RETURN_STATUS(env, napi_create_string_utf8(env, resource_name, sizeof(resource_name)-1, &str));
   NAPI_OK_OR_RETURN_STATUS(env,
-    napi_create_threadsafe_function(env, unused_func, NULL, str, 16 /*queue size*/, 1, NULL, NULL, NULL, trigger, &tsf)
+    napi_create_threadsafe_function(env, unused_func, NULL, str, 16 /*queue size*/, 1, NULL, NULL, NULL, trigger, &inst->tsf)
   );
   // Start the threadsafe function unreferenced, so node can exit cleanly if its never used.
-  NAPI_OK_OR_RETURN_STATUS(env, napi_unref_threadsafe_function(env, tsf));
+  NAPI_OK_OR_RETURN_STATUS(env, napi_unref_threadsafe_function(env, inst->tsf));
 
+  // Node closes the threadsafe function itself when the environment is torn
+  // down. Futures which resolve after that are discarded (see below).
   return napi_ok;
 }
 
-// unused cleanup.
-void closeFuture(napi_env env) {
-  napi_release_threadsafe_function(tsf, napi_tsfn_abort);
-}
-
 
 template<class CtxType> static napi_status resolveFutureInMainLoop(napi_env env, FDBFuture *f, CtxType* ctx, napi_status (*fn)(napi_env env, FDBFuture *f, CtxType*)) {
+  InstanceData *inst = getInstanceData(env);
   ctx->future = f;
   ctx->fn = fn;
   ctx->env = env;
+  ctx->inst = inst;
+  ctx->tsf = inst->tsf;
+  ctx->js_thread = inst->js_thread;
+  ctx->queued_at = 0;
+
+  // Each pending future holds a reference to the threadsafe function, so it
+  // isn't finalized while the network thread might still call it. This
+  // doesn't keep it open once the environment starts closing it (eg when a
+  // worker is terminated). After that, calls fail with napi_closing and node
+  // has already dropped our reference.
+  NAPI_OK_OR_RETURN_STATUS(env, napi_acquire_threadsafe_function(inst->tsf));
 
   // Prevent node from closing until the future has resolved.
-  if (num_outstanding == 0) {
-    NAPI_OK_OR_RETURN_STATUS(env, napi_ref_threadsafe_function(env, tsf));
+  if (inst->num_outstanding == 0) {
+    NAPI_OK_OR_RETURN_STATUS(env, napi_ref_threadsafe_function(env, inst->tsf));
   }
-  num_outstanding++;
+  inst->num_outstanding++;
 
   assert(0 == fdb_future_set_callback(f, [](FDBFuture *f, void *_ctx) {
     // raise(SIGTRAP);
     CtxType* ctx = static_cast<CtxType*>(_ctx);
+    napi_threadsafe_function tsf = ctx->tsf;
 
     // Foundationdb will sometimes resolve this callback in the main thread. In
     // that case, we can't block because doing so could cause a deadlock - see
     // https://github.com/josephg/node-foundationdb/issues/41 .
-    if (node_main_thread == std::this_thread::get_id()) {
+    if (ctx->js_thread == std::this_thread::get_id()) {
       // Trigger immediately without going via threadsafe_function
       trigger(ctx->env, NULL, NULL, ctx);
     } else {
       ctx->env = NULL;
-      assert(napi_ok == napi_call_threadsafe_function(tsf, ctx, napi_tsfn_blocking));
+      ctx->queued_at = uv_hrtime();
+      napi_status status = napi_call_threadsafe_function(tsf, ctx, napi_tsfn_blocking);
+      if (status == napi_closing) {
+        // The environment which made this future has gone away. Nobody is
+        // waiting for the result. Node has already released our reference
+        // to the threadsafe function (and may have freed it), so we must not
+        // release it again.
+        fdb_future_destroy(f);
+        delete ctx;
+        return;
+      }
+      assert(status == napi_ok);
     }
+
+    napi_release_threadsafe_function(tsf, napi_tsfn_release);
   }, ctx));
 
   return napi_ok;
 }
 
 
+// Resolve or reject a promise with the result of an extract function.
+static napi_status settleDeferred(napi_env env, napi_deferred deferred, fdb_error_t errcode, MaybeValue value) {
+  if (errcode != 0) {
+    napi_value err;
+    NAPI_OK_OR_RETURN_STATUS(env, wrap_fdb_error(env, errcode, &err));
+    return napi_reject_deferred(env, deferred, err);
+  } else if (value.status != napi_ok) {
+    napi_value err;
+    NAPI_OK_OR_RETURN_STATUS(env, napi_get_and_clear_last_exception(env, &err));
+    return napi_reject_deferred(env, deferred, err);
+  } else {
+    if (value.value == NULL) NAPI_OK_OR_RETURN_STATUS(env, napi_get_null(env, &value.value));
+    return napi_resolve_deferred(env, deferred, value.value);
+  }
+}
+
 MaybeValue fdbFutureToJSPromise(napi_env env, FDBFuture *f, ExtractValueFn *extractFn) {
   // Using inheritance here because Persistent doesn't seem to like being
   // copied, and this avoids another allocation & indirection.
@@ -204,6 +273,39 @@ MaybeValue fdbFutureToCallback(napi_env env, FDBFuture *f, napi_value cbFunc, Ex
   return wrap_err(status);
 }
 
+MaybeValue futureToJSPromiseWithData(napi_env env, FDBFuture *f, void *data, ExtractDataFn *extractFn) {
+  struct Ctx: CtxBase<Ctx> {
+    napi_deferred deferred;
+    void *data;
+    ExtractDataFn *extractFn;
+  };
+  Ctx *ctx = new Ctx;
+  ctx->data = data;
+  ctx->extractFn = extractFn;
+
+  napi_value promise;
+  napi_status status = napi_create_promise(env, &ctx->deferred, &promise);
+  if (status != napi_ok) {
+    free(data);
+    delete ctx;
+    return wrap_err(status);
+  }
+
+  status = resolveFutureInMainLoop<Ctx>(env, f, ctx, [](napi_env env, FDBFuture *f, Ctx *ctx) {
+    fdb_error_t errcode = 0;
+    MaybeValue value = ctx->extractFn(env, f, ctx->data, &errcode);
+    free(ctx->data);
+    return settleDeferred(env, ctx->deferred, errcode, value);
+  });
+
+  if (status != napi_ok) {
+    napi_resolve_deferred(env, ctx->deferred, NULL); // free the promise
+    free(data);
+    delete ctx;
+    return wrap_err(status);
+  } else return wrap_ok(promise);
+}
+
 MaybeValue futureToJS(napi_env env, FDBFuture *f, napi_value cbOrNull, ExtractValueFn *extractFn) {
   napi_valuetype type;
   NAPI_OK_OR_RETURN_MAYBE(env, typeof_wrap(env, cbOrNull, &type));
@@ -217,6 +319,113 @@ MaybeValue futureToJS(napi_env env, FDBFuture *f, napi_value cbOrNull, ExtractVa
 }
 
 
+// *** Future pairs
+
+// Resolve a single promise once two futures have both resolved. This is used
+// to wait for a commit and its versionstamp together, so JS only sees one
+// promise (and one trip through the threadsafe function in the common case).
+//
+// Errors from the first future reject the promise. Once it succeeds, we wait
+// for the second future (if it isn't ready already) and then call extractFn
+// to build the result. The owner object is referenced until then, so data
+// (eg the FDBTransaction wrapped by owner) stays valid. If the pair fails,
+// releaseFn is called instead.
+struct PairState {
+  napi_deferred deferred;
+  napi_ref owner;
+  FDBFuture *second;
+  void *data;
+  ExtractPairFn *extractFn;
+  ReleasePairFn *releaseFn;
+};
+
+static napi_status settlePair(napi_env env, PairState *st, fdb_error_t errcode, MaybeValue value) {
+  napi_deferred deferred = st->deferred;
+  NAPI_OK_OR_RETURN_STATUS(env, napi_delete_reference(env, st->owner));
+  delete st;
+  return settleDeferred(env, deferred, errcode, value);
+}
+
+// If destroySecond is false, the second future is owned (and destroyed) by
+// the trigger() call which is waiting on it.
+static napi_status finishPair(napi_env env, PairState *st, bool destroySecond) {
+  FDBFuture *second = st->second;
+  fdb_error_t errcode = 0;
+  MaybeValue value = st->extractFn(env, second, st->data, &errcode);
+  napi_status status = settlePair(env, st, errcode, value);
+  if (destroySecond && second != NULL) fdb_future_destroy(second);
+  return status;
+}
+
+MaybeValue futurePairToJSPromise(napi_env env, FDBFuture *first, FDBFuture *second,
+    napi_value owner, void *data, ExtractPairFn *extractFn, ReleasePairFn *releaseFn) {
+  struct FirstCtx: CtxBase<FirstCtx> { PairState *st; };
+  struct SecondCtx: CtxBase<SecondCtx> { PairState *st; };
+
+  PairState *st = new PairState;
+  st->second = second;
+  st->data = data;
+  st->extractFn = extractFn;
+  st->releaseFn = releaseFn;
+
+  napi_value promise;
+  napi_status status = napi_create_promise(env, &st->deferred, &promise);
+  if (status == napi_ok) {
+    status = napi_create_reference(env, owner, 1, &st->owner);
+    if (status != napi_ok) napi_resolve_deferred(env, st->deferred, NULL);
+  }
+  if (status != napi_ok) {
+    fdb_future_destroy(first);
+    if (second != NULL) fdb_future_destroy(second);
+    releaseFn(env, data);
+    delete st;
+    return wrap_err(status);
+  }
+
+  FirstCtx *ctx = new FirstCtx;
+  ctx->st = st;
+
+  status = resolveFutureInMainLoop<FirstCtx>(env, first, ctx, [](napi_env env, FDBFuture *f, FirstCtx *ctx) {
+    PairState *st = ctx->st;
+    fdb_error_t errcode = fdb_future_get_error(f);
+
+    if (errcode != 0) {
+      if (st->second != NULL) fdb_future_destroy(st->second);
+      st->releaseFn(env, st->data);
+      return settlePair(env, st, errcode, wrap_null());
+    } else if (st->second == NULL || fdb_future_is_ready(st->second)) {
+      return finishPair(env, st, true);
+    }
+
+    // Rare: the commit resolved before the second future did. Wait again.
+    SecondCtx *ctx2 = new SecondCtx;
+    ctx2->st = st;
+    napi_status status = resolveFutureInMainLoop<SecondCtx>(env, st->second, ctx2, [](napi_env env, FDBFuture *f, SecondCtx *ctx2) {
+      return finishPair(env, ctx2->st, false);
+    });
+    if (status != napi_ok) {
+      // Nothing is waiting on the second future, so settle the promise (and
+      // drop the owner) here.
+      fdb_future_destroy(st->second);
+      delete ctx2;
+      st->releaseFn(env, st->data);
+      return settlePair(env, st, 0, wrap_err(status));
+    }
+    return napi_ok;
+  });
+
+  if (status != napi_ok) {
+    napi_resolve_deferred(env, st->deferred, NULL); // free the promise
+    releaseFn(env, data);
+    napi_delete_reference(env, st->owner);
+    if (second != NULL) fdb_future_destroy(second);
+    delete st;
+    delete ctx;
+    return wrap_err(status);
+  } else return wrap_ok(promise);
+}
+
+
 // *** Watch
 
 // This seems overcomplicated, and I'd love to be able to use the functions
@@ -231,8 +440,6 @@ MaybeValue futureToJS(napi_env env, FDBFuture *f, napi_value cbOrNull, ExtractVa
 
 // TODO: Using classes here is overwraught.
 
-static napi_ref watch_cons_ref;
-
 static napi_value cancel(napi_env env, napi_callback_info info) {
   // If the future has already been cancelled, napi_unwrap returns an invalid argument error.
   napi_value obj;
@@ -257,7 +464,7 @@ static void finalize(napi_env env, void* tn, void* finalize_hint) {
   fdb_transaction_destroy((FDB_transaction *)tn);
 }
 
-napi_status initWatch(napi_env env) {
+napi_status initWatch(napi_env env, InstanceData *inst) {
   napi_property_descriptor desc[] = {
     FN_DEF(cancel),
   };
@@ -266,7 +473,7 @@ napi_status initWatch(napi_env env) {
   NAPI_OK_OR_RETURN_STATUS(env, napi_define_class(env, "Watch", NAPI_AUTO_LENGTH,
     empty, NULL, sizeof(desc)/sizeof(desc[0]), desc, &constructor));
 
-  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &watch_cons_ref));
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &inst->watch_cons_ref));
   return napi_ok;
 }
 
@@ -285,7 +492,7 @@ MaybeValue watchFuture(napi_env env, FDBFuture *f, bool ignoreStandardErrors) {
   NAPI_OK_OR_RETURN_MAYBE(env, napi_create_promise(env, &ctx->deferred, &promise));
 
   napi_value ctor;
-  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, watch_cons_ref, &ctor));
+  NAPI_OK_OR_RETURN_MAYBE(env, napi_get_reference_value(env, getInstanceData(env)->watch_cons_ref, &ctor));
 
   napi_value jsWatch;
   NAPI_OK_OR_RETURN_MAYBE(env, napi_new_instance(env, ctor, 0, NULL, &jsWatch));
@@ -4,8 +4,9 @@
 #define _FUTURE_H_
 
 #include "utils.h"
+#include "instance.h"
 
-napi_status initFuture(napi_env env);
+napi_status initFuture(napi_env env, InstanceData *inst);
 
 typedef MaybeValue ExtractValueFn(napi_env env, FDBFuture* f, fdb_error_t* errOut);
 
@@ -14,7 +15,28 @@ typedef MaybeValue ExtractValueFn(napi_env env, FDBFuture* f, fdb_error_t* errOu
 
 MaybeValue futureToJS(napi_env env, FDBFuture *f, napi_value cbOrNull, ExtractValueFn *extractFn);
 
-napi_status initWatch(napi_env env);
+// Same as ExtractValueFn, but also passed the data given to futureToJSPromiseWithData.
+typedef MaybeValue ExtractDataFn(napi_env env, FDBFuture* f, void *data, fdb_error_t* errOut);
+
+// Promise-only variant of futureToJS for extract functions which need some
+// extra state. Ownership of data (allocated with malloc) is passed in, and it
+// is freed once the future resolves.
+MaybeValue futureToJSPromiseWithData(napi_env env, FDBFuture *f, void *data, ExtractDataFn *extractFn);
+
+// Called once both futures in a pair have resolved, and the first succeeded.
+// second may be NULL.
+typedef MaybeValue ExtractPairFn(napi_env env, FDBFuture *second, void *data, fdb_error_t *errOut);
+// Called instead of the extract function when the pair fails (or can't be
+// waited on), so data can be released.
+typedef void ReleasePairFn(napi_env env, void *data);
+
+// Returns a promise which resolves once both futures have resolved. owner is
+// kept alive until then. Ownership of both futures is passed in. Exactly one
+// of extractFn and releaseFn is called with data.
+MaybeValue futurePairToJSPromise(napi_env env, FDBFuture *first, FDBFuture *second,
+  napi_value owner, void *data, ExtractPairFn *extractFn, ReleasePairFn *releaseFn);
+
+napi_status initWatch(napi_env env, InstanceData *inst);
 MaybeValue watchFuture(napi_env env, FDBFuture *f, bool ignoreStandardErrors);
 
 #endif
\ No newline at end of file
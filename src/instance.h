@@ -0,0 +1,61 @@
+// Per-environment state for the module.
+//
+// Node can load this module into several environments at once - the main
+// thread and any number of worker_threads. Each environment has its own JS
+// heap, so anything which holds a napi handle (class constructors, the
+// threadsafe function used to deliver futures, etc) is stored here and
+// attached to the environment with napi_set_instance_data, rather than being
+// a static. The FDB network thread itself is process-wide and shared by every
+// environment (see module.cpp).
+
+#ifndef FDB_NODE_INSTANCE_H
+#define FDB_NODE_INSTANCE_H
+
+#include <cstdint>
+#include <thread>
+#include "utils.h"
+
+// Upper bounds (in microseconds) of the histogram buckets for the time
+// resolved futures wait between the network thread and this environment's JS
+// thread. The last bucket catches everything slower.
+static const uint64_t CALLBACK_DELAY_BOUNDS_US[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+#define CALLBACK_DELAY_BUCKETS (sizeof(CALLBACK_DELAY_BOUNDS_US) / sizeof(CALLBACK_DELAY_BOUNDS_US[0]) + 1)
+
+typedef struct CallbackStats {
+  // Futures which resolved on the network thread and were queued through the
+  // threadsafe function, and futures which resolved on the JS thread itself.
+  uint64_t queued;
+  uint64_t inline_;
+  uint64_t delay_ns;
+  uint64_t delay_buckets[CALLBACK_DELAY_BUCKETS];
+} CallbackStats;
+
+typedef struct InstanceData {
+  // Futures resolved on the network thread are passed back to this
+  // environment's JS thread through its threadsafe function.
+  napi_threadsafe_function tsf;
+  int num_outstanding;
+  std::thread::id js_thread;
+  // Only touched on the JS thread.
+  CallbackStats callback_stats;
+
+  napi_ref database_cons_ref;
+  napi_ref transaction_cons_ref;
+  napi_ref watch_cons_ref;
+
+  // The module exports object. The JS code attaches the FDBError class here.
+  napi_ref module_ref;
+
+  // Set if this environment has called startNetwork.
+  bool holds_network;
+} InstanceData;
+
+inline InstanceData *getInstanceData(napi_env env) {
+  void *data = NULL;
+  napi_get_instance_data(env, &data);
+  return (InstanceData *)data;
+}
+
+#endif
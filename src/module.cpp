@@ -22,6 +22,7 @@
  */
 
 #include <cassert>
+#include <mutex>
 
 #include "utils.h"
 
@@ -29,6 +30,16 @@
 // already packaged.
 #include <uv.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <pthread.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
 #include "fdbversion.h"
 #include <foundationdb/fdb_c.h>
 
@@ -37,14 +48,23 @@
 #include "transaction.h"
 #include "error.h"
 #include "options.h"
+#include "compress.h"
+#include "instance.h"
 
 using namespace std;
 
 
+// The FDB client only supports one network thread per process, so this state
+// is shared by every environment (main thread and workers) which loads the
+// module. It is guarded by networkLock.
+static mutex networkLock;
 static uv_thread_t fdbThread;
 
 static bool networkStarted = false;
+static uint64_t networkStartedAt = 0; // from uv_hrtime.
 static int32_t previousApiVersion = 0;
+// Number of environments which have started the network and not stopped it.
+static int networkUsers = 0;
 
 
 static napi_value setAPIVersion(napi_env env, napi_callback_info info) {
@@ -52,6 +72,8 @@ static napi_value setAPIVersion(napi_env env, napi_callback_info info) {
 
   int32_t apiVersion;
   NAPI_OK_OR_RETURN_NULL(env, napi_get_value_int32(env, args[0], &apiVersion));
+
+  lock_guard<mutex> guard(networkLock);
   
   if (previousApiVersion != 0) {
     if (apiVersion != previousApiVersion) {
@@ -71,6 +93,8 @@ static napi_value setAPIVersionImpl(napi_env env, napi_callback_info info) {
   NAPI_OK_OR_RETURN_NULL(env, napi_get_value_int32(env, args[0], &apiVersion));
   int32_t headerVersion;
   NAPI_OK_OR_RETURN_NULL(env, napi_get_value_int32(env, args[1], &headerVersion));
+
+  lock_guard<mutex> guard(networkLock);
   
   if (previousApiVersion != 0) {
     if (apiVersion != previousApiVersion) {
@@ -135,16 +159,39 @@ static napi_value setNetworkOption(napi_env env, napi_callback_info info) {
 }
 
 static napi_value startNetwork(napi_env env, napi_callback_info info) {
+  InstanceData *inst = getInstanceData(env);
+  lock_guard<mutex> guard(networkLock);
+
   if(!networkStarted) {
     networkStarted = true;
+    networkStartedAt = uv_hrtime();
     runNetwork();
   }
+  if (!inst->holds_network) {
+    inst->holds_network = true;
+    networkUsers++;
+  }
   return NULL;
 }
 
+// Must be called with networkLock held. Returns true if this environment was
+// the last one using the network.
+static bool releaseNetwork(InstanceData *inst) {
+  if (inst->holds_network) {
+    inst->holds_network = false;
+    networkUsers--;
+  }
+  return networkUsers == 0;
+}
+
 static napi_value stopNetwork(napi_env env, napi_callback_info info) {
+  lock_guard<mutex> guard(networkLock);
   if (!networkStarted) return NULL;
 
+  // Other environments (worker threads) are still using the network. Leave
+  // it running for them.
+  if (!releaseNetwork(getInstanceData(env))) return NULL;
+
   FDB_OK_OR_RETURN_NULL(env, fdb_stop_network());
 
   assert(0 == uv_thread_join(&fdbThread));
@@ -156,6 +203,74 @@ static napi_value stopNetwork(napi_env env, napi_callback_info info) {
   return NULL;
 }
 
+// CPU time the network thread has used so far in nanoseconds, or -1 if the
+// platform won't tell us. Must be called with networkLock held while the
+// network is running.
+static double networkThreadCpuNs() {
+#if defined(_WIN32)
+  FILETIME created, exited, kernel, user;
+  if (!GetThreadTimes(fdbThread, &created, &exited, &kernel, &user)) return -1;
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+  return (double)(k.QuadPart + u.QuadPart) * 100; // 100ns ticks.
+#elif defined(__APPLE__)
+  thread_basic_info_data_t info;
+  mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+  if (thread_info(pthread_mach_thread_np(fdbThread), THREAD_BASIC_INFO, (thread_info_t)&info, &count) != KERN_SUCCESS) return -1;
+  return (info.user_time.seconds + info.system_time.seconds) * 1e9
+    + (info.user_time.microseconds + info.system_time.microseconds) * 1e3;
+#else
+  clockid_t clock;
+  struct timespec ts;
+  if (pthread_getcpuclockid(fdbThread, &clock) != 0 || clock_gettime(clock, &ts) != 0) return -1;
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static napi_status setNumber(napi_env env, napi_value obj, const char *name, double val) {
+  napi_value v;
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_double(env, val, &v));
+  return napi_set_named_property(env, obj, name, v);
+}
+
+static napi_status setNumberArray(napi_env env, napi_value obj, const char *name, const uint64_t *vals, size_t len) {
+  napi_value arr;
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_array_with_length(env, len, &arr));
+  for (size_t i = 0; i < len; i++) {
+    napi_value v;
+    NAPI_OK_OR_RETURN_STATUS(env, napi_create_double(env, (double)vals[i], &v));
+    NAPI_OK_OR_RETURN_STATUS(env, napi_set_element(env, arr, (uint32_t)i, v));
+  }
+  return napi_set_named_property(env, obj, name, arr);
+}
+
+// How busy the network thread is, and how long futures it resolves wait to be
+// picked up by this environment's JS thread. Everything is cumulative.
+static napi_value getNetworkStats(napi_env env, napi_callback_info info) {
+  napi_value result;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_object(env, &result));
+
+  {
+    lock_guard<mutex> guard(networkLock);
+    napi_value running;
+    NAPI_OK_OR_RETURN_NULL(env, napi_get_boolean(env, networkStarted, &running));
+    NAPI_OK_OR_RETURN_NULL(env, napi_set_named_property(env, result, "running", running));
+    NAPI_OK_OR_RETURN_NULL(env, setNumber(env, result, "threadCpuNs", networkStarted ? networkThreadCpuNs() : 0));
+    NAPI_OK_OR_RETURN_NULL(env, setNumber(env, result, "uptimeNs", networkStarted ? (double)(uv_hrtime() - networkStartedAt) : 0));
+  }
+
+  const CallbackStats &stats = getInstanceData(env)->callback_stats;
+  NAPI_OK_OR_RETURN_NULL(env, setNumber(env, result, "callbacksQueued", (double)stats.queued));
+  NAPI_OK_OR_RETURN_NULL(env, setNumber(env, result, "callbacksInline", (double)stats.inline_));
+  NAPI_OK_OR_RETURN_NULL(env, setNumber(env, result, "callbackDelayNs", (double)stats.delay_ns));
+  NAPI_OK_OR_RETURN_NULL(env, setNumberArray(env, result, "callbackDelayBoundsUs",
+    CALLBACK_DELAY_BOUNDS_US, CALLBACK_DELAY_BUCKETS - 1));
+  NAPI_OK_OR_RETURN_NULL(env, setNumberArray(env, result, "callbackDelayBuckets",
+    stats.delay_buckets, CALLBACK_DELAY_BUCKETS));
+  return result;
+}
+
 // (test, code) -> bool.
 static napi_value errorPredicate(napi_env env, napi_callback_info info) {
   size_t argc = 2;
@@ -175,12 +290,32 @@ static napi_value errorPredicate(napi_env env, napi_callback_info info) {
   return js_result;
 }
 
+// Called when an environment (usually a worker thread) is torn down.
+static void finalizeInstance(napi_env env, void *data, void *hint) {
+  InstanceData *inst = (InstanceData *)data;
+  {
+    // The network keeps running even if this was the last environment using
+    // it, since the FDB client can't restart it once it has been stopped. The
+    // main thread stops it on exit.
+    lock_guard<mutex> guard(networkLock);
+    releaseNetwork(inst);
+  }
+
+  // The constructor references don't need to be deleted here. They're freed
+  // along with the environment.
+  delete inst;
+}
+
 static napi_value init(napi_env env, napi_value exports) {
-  NAPI_OK_OR_RETURN_NULL(env, initFuture(env));
-  NAPI_OK_OR_RETURN_NULL(env, initDatabase(env));
-  NAPI_OK_OR_RETURN_NULL(env, initTransaction(env));
-  NAPI_OK_OR_RETURN_NULL(env, initWatch(env));
-  NAPI_OK_OR_RETURN_NULL(env, initError(env, exports));
+  InstanceData *inst = new InstanceData();
+  NAPI_OK_OR_RETURN_NULL(env, napi_set_instance_data(env, inst, finalizeInstance, NULL));
+
+  NAPI_OK_OR_RETURN_NULL(env, initFuture(env, inst));
+  NAPI_OK_OR_RETURN_NULL(env, initDatabase(env, inst));
+  NAPI_OK_OR_RETURN_NULL(env, initTransaction(env, inst));
+  NAPI_OK_OR_RETURN_NULL(env, initWatch(env, inst));
+  NAPI_OK_OR_RETURN_NULL(env, initError(env, exports, inst));
+  NAPI_OK_OR_RETURN_NULL(env, initCompress(env, exports));
 
   napi_value napi;
   NAPI_OK_OR_RETURN_NULL(env, napi_create_string_utf8(env, "napi", NAPI_AUTO_LENGTH, &napi));
@@ -196,6 +331,8 @@ static napi_value init(napi_env env, napi_value exports) {
     FN_DEF(stopNetwork),
 
     FN_DEF(errorPredicate),
+    FN_DEF(getNetworkStats),
+    FN_DEF(getTransactionStats),
 
     // export type: 'napi' to differentiate it from the nan-based code at runtime.
     {"type", NULL, NULL, NULL, NULL, napi, napi_default, NULL},
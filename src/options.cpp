@@ -55,3 +55,42 @@ napi_status set_option_wrapped(napi_env env, void *target, OptionType type, napi
     return napi_pending_exception;
   } else return napi_ok;
 }
+
+napi_status set_options_packed(napi_env env, void *target, OptionType type, napi_value packed) {
+  // packed is a buffer of [code: u32 LE][length: i32 LE][value bytes] records,
+  // as produced by packOptions() in lib/opts.ts. A negative length means the
+  // option takes no value. Integer values are already encoded as 8 byte int64s.
+  void *data;
+  size_t length;
+  NAPI_OK_OR_RETURN_STATUS(env, get_buffer_info(env, packed, &data, &length));
+
+  const uint8_t *pos = (const uint8_t *)data;
+  const uint8_t *end = pos + length;
+  while (pos < end) {
+    if (end - pos < 8) goto malformed;
+    {
+      uint32_t code = (uint32_t)pos[0] | ((uint32_t)pos[1] << 8) | ((uint32_t)pos[2] << 16) | ((uint32_t)pos[3] << 24);
+      int32_t len = (int32_t)((uint32_t)pos[4] | ((uint32_t)pos[5] << 8) | ((uint32_t)pos[6] << 16) | ((uint32_t)pos[7] << 24));
+      pos += 8;
+
+      const uint8_t *value = NULL;
+      if (len < 0) len = 0;
+      else {
+        if (end - pos < len) goto malformed;
+        value = pos;
+        pos += len;
+      }
+
+      fdb_error_t err = set_option(target, type, code, value, len);
+      if (err) {
+        throw_fdb_error(env, err);
+        return napi_pending_exception;
+      }
+    }
+  }
+  return napi_ok;
+
+malformed:
+  throw_if_not_ok(env, napi_throw_type_error(env, NULL, "Malformed packed options buffer"));
+  return napi_pending_exception;
+}
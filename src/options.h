@@ -11,4 +11,7 @@ enum OptionType {
 
 napi_status set_option_wrapped(napi_env env, void *target, OptionType type, napi_callback_info info);
 
+// Apply a buffer of options packed by packOptions() in lib/opts.ts.
+napi_status set_options_packed(napi_env env, void *target, OptionType type, napi_value packed);
+
 #endif
\ No newline at end of file
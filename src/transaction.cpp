@@ -22,8 +22,10 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 // #include <cstdio>
 #include <cassert>
+#include <atomic>
 
 #include "options.h"
 #include "transaction.h"
@@ -38,27 +40,116 @@ using namespace std;
 #define TRY(expr) NAPI_OK_OR_RETURN_MAYBE(env, (expr))
 #define TRY_V(expr) NAPI_OK_OR_RETURN_NULL(env, (expr))
 
-static napi_ref cons_ref;
-
-
 static napi_value empty(napi_env env, napi_callback_info info) {
   return NULL;
 }
 
-static void finalize(napi_env env, void* tn, void* finalize_hint) {
-  fdb_transaction_destroy((FDB_transaction *)tn);
+// The native state behind each JS transaction object. The handle lives until
+// the JS object is garbage collected, but the FDBTransaction inside it can be
+// destroyed sooner with destroy().
+typedef struct TransactionHandle {
+  FDBTransaction *tr; // NULL once destroyed.
+
+  // Mutations and conflict ranges are buffered natively until the
+  // transaction commits. V8 can't see that memory, so we report it with
+  // napi_adjust_external_memory (in chunks, to keep set() cheap) and give it
+  // back when the transaction is reset or destroyed.
+  int64_t reported_bytes;
+  int64_t unreported_bytes;
+
+  // commitAndFinalize reads the committed version from tr once the commit
+  // resolves, so destroying the transaction is deferred until then.
+  int commits;
+  bool destroy_pending;
+} TransactionHandle;
+
+// Roughly what FDB keeps per mutation on top of the key and value (including
+// the write conflict range it adds).
+#define MUTATION_OVERHEAD 64
+#define REPORT_BYTES_CHUNK (16 * 1024)
+
+// Process-wide, since transactions are created by every environment.
+static atomic<int64_t> liveTransactions(0);
+static atomic<int64_t> externalBytes(0);
+
+static void flushBytes(napi_env env, TransactionHandle *h) {
+  int64_t unused;
+  napi_adjust_external_memory(env, h->unreported_bytes, &unused);
+  externalBytes += h->unreported_bytes;
+  h->reported_bytes += h->unreported_bytes;
+  h->unreported_bytes = 0;
+}
+
+static inline void trackBytes(napi_env env, TransactionHandle *h, size_t bytes) {
+  h->unreported_bytes += bytes + MUTATION_OVERHEAD;
+  if (UNLIKELY(h->unreported_bytes >= REPORT_BYTES_CHUNK)) flushBytes(env, h);
+}
+
+static void releaseBytes(napi_env env, TransactionHandle *h) {
+  if (h->reported_bytes != 0) {
+    int64_t unused;
+    napi_adjust_external_memory(env, -h->reported_bytes, &unused);
+    externalBytes -= h->reported_bytes;
+  }
+  h->reported_bytes = 0;
+  h->unreported_bytes = 0;
+}
+
+static void destroyTransaction(napi_env env, TransactionHandle *h) {
+  releaseBytes(env, h);
+  fdb_transaction_destroy(h->tr);
+  h->tr = NULL;
+  liveTransactions--;
+}
+
+// Called once a commitAndFinalize commit is finished with, whether or not it
+// succeeded. Destroys the transaction if destroy() was deferred for it.
+static void endCommit(napi_env env, TransactionHandle *h) {
+  if (h->commits > 0) h->commits--;
+  if (h->commits == 0 && h->destroy_pending && h->tr != NULL) destroyTransaction(env, h);
+}
+
+static void finalize(napi_env env, void* data, void* finalize_hint) {
+  TransactionHandle *h = (TransactionHandle *)data;
+  if (h->tr != NULL) destroyTransaction(env, h);
+  delete h;
 }
 
 MaybeValue newTransaction(napi_env env, FDBTransaction *transaction) {
   napi_value ctor;
-  TRY(napi_get_reference_value(env, cons_ref, &ctor));
+  TRY(napi_get_reference_value(env, getInstanceData(env)->transaction_cons_ref, &ctor));
 
   napi_value obj;
   TRY(napi_new_instance(env, ctor, 0, NULL, &obj));
-  TRY(napi_wrap(env, obj, (void *)transaction, finalize, NULL, NULL));
+
+  TransactionHandle *h = new TransactionHandle();
+  h->tr = transaction;
+  napi_status status = napi_wrap(env, obj, (void *)h, finalize, NULL, NULL);
+  if (status != napi_ok) {
+    delete h;
+    fdb_transaction_destroy(transaction);
+    return wrap_err(throw_if_not_ok(env, status));
+  }
+  liveTransactions++;
   return wrap_ok(obj);
 }
 
+// Returns NULL and throws if the transaction has been destroyed.
+static TransactionHandle *getHandle(napi_env env, napi_callback_info info) {
+  TransactionHandle *h = (TransactionHandle *)getWrapped(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  if (UNLIKELY(h->tr == NULL)) {
+    throw_if_not_ok(env, napi_throw_error(env, NULL, "Transaction has been disposed"));
+    return NULL;
+  }
+  return h;
+}
+
+static inline FDBTransaction *getTransaction(napi_env env, napi_callback_info info) {
+  TransactionHandle *h = getHandle(env, info);
+  return UNLIKELY(h == NULL) ? NULL : h->tr;
+}
+
 // This is a helper struct to move strings out of passed buffers into a format
 // accessible to foundationdb. Objects of this class shouldn't be created
 // directly - they should only be created and destroyed via toStringParams and
@@ -82,8 +173,10 @@ typedef struct StringParams {
 // This is a small buffer to avoid thrashing the allocator when reading keys and values.
 // Its a very 95% solution, but it improves performance in the average case.
 // TODO: Many functions make 2 string params objects; not 1. Add a second buffer here.
-static bool buf_in_use = false;
-static uint8_t sp_buf[1024];
+// The buffer is only ever used synchronously by the calling JS thread, so each
+// thread (ie each worker) gets its own.
+static thread_local bool buf_in_use = false;
+static thread_local uint8_t sp_buf[1024];
 
 // String arguments can either be buffers or strings. If they're strings we
 // need to copy the bytes locally in order to utf8 convert the content.
@@ -199,7 +292,14 @@ static MaybeValue getKey(napi_env env, FDBFuture* future, fdb_error_t* errOut) {
   return wrap_ok(result);
 }
 
-static MaybeValue getKeyValueList(napi_env env, FDBFuture* future, fdb_error_t* errOut) {
+// Data for getKeyValueListStripped. The prefix bytes follow the struct.
+struct StripPrefix {
+  size_t len;
+};
+
+// If prefix is non-null, every key must start with it, and the prefix is
+// removed from the returned keys.
+static MaybeValue getKeyValueListImpl(napi_env env, FDBFuture* future, const StripPrefix *prefix, fdb_error_t* errOut) {
   const FDBKeyValue *kv;
   int len;
   fdb_bool_t more;
@@ -207,6 +307,18 @@ static MaybeValue getKeyValueList(napi_env env, FDBFuture* future, fdb_error_t*
   *errOut = fdb_future_get_keyvalue_array(future, &kv, &len, &more);
   if (UNLIKELY(*errOut)) return wrap_null();
 
+  size_t strip = 0;
+  if (prefix != NULL) {
+    strip = prefix->len;
+    const uint8_t *prefixBytes = (const uint8_t *)(prefix + 1);
+    for (int i = 0; i < len; i++) {
+      if (UNLIKELY((size_t)kv[i].key_length < strip || memcmp(kv[i].key, prefixBytes, strip) != 0)) {
+        throw_if_not_ok(env, napi_throw_error(env, NULL, "Cannot unpack key outside of prefix range."));
+        return wrap_err(napi_pending_exception);
+      }
+    }
+  }
+
   /*
    * Constructing a JavaScript object with:
    * { results: [[key, value], [key, value], ...], more }
@@ -222,7 +334,7 @@ static MaybeValue getKeyValueList(napi_env env, FDBFuture* future, fdb_error_t*
     
     // TODO: Again, should be able to avoid this copy with clever use of references.
     napi_value keyBuf;
-    TRY(napi_create_buffer_copy(env, kv[i].key_length, kv[i].key, NULL, &keyBuf));
+    TRY(napi_create_buffer_copy(env, kv[i].key_length - strip, (const uint8_t *)kv[i].key + strip, NULL, &keyBuf));
     napi_value valBuf;
     TRY(napi_create_buffer_copy(env, kv[i].value_length, kv[i].value, NULL, &valBuf));
 
@@ -239,6 +351,14 @@ static MaybeValue getKeyValueList(napi_env env, FDBFuture* future, fdb_error_t*
   return wrap_ok(returnObj);
 }
 
+static MaybeValue getKeyValueList(napi_env env, FDBFuture* future, fdb_error_t* errOut) {
+  return getKeyValueListImpl(env, future, NULL, errOut);
+}
+
+static MaybeValue getKeyValueListStripped(napi_env env, FDBFuture* future, void *data, fdb_error_t* errOut) {
+  return getKeyValueListImpl(env, future, (const StripPrefix *)data, errOut);
+}
+
 static MaybeValue getKeyList(napi_env env, FDBFuture* future, fdb_error_t* errOut) {
   const FDBKey *keyArr;
   int len;
@@ -309,16 +429,26 @@ static MaybeValue getInt64ToNumber(napi_env env, FDBFuture* future, fdb_error_t*
 
 
 static napi_value setOption(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
   set_option_wrapped(env, tr, OptTransaction, info);
   return NULL;
 }
 
+// setOptionsPacked(buf)
+static napi_value setOptionsPacked(napi_env env, napi_callback_info info) {
+  GET_ARGS(env, info, args, 1);
+  FDBTransaction *tr = getTransaction(env, info);
+  if (UNLIKELY(tr == NULL)) return NULL;
+
+  set_options_packed(env, tr, OptTransaction, args[0]);
+  return NULL;
+}
+
 // commit()
 static napi_value commit(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
   FDBFuture *f = fdb_transaction_commit(tr);
@@ -327,45 +457,187 @@ static napi_value commit(napi_env env, napi_callback_info info) {
   return futureToJS(env, f, args[0], ignoreResult).value;
 }
 
+// Builds {committedVersion, versionstamp} once a commit has succeeded. The
+// versionstamp is left undefined if it wasn't requested. If it was requested
+// but couldn't be read, the promise is rejected with its error.
+static MaybeValue getCommitResult(napi_env env, FDBFuture *stampFuture, void *data, fdb_error_t *errOut) {
+  TransactionHandle *h = (TransactionHandle *)data;
+
+  int64_t version;
+  // The transaction is only missing here if it was reset and destroyed while
+  // the commit was in flight.
+  *errOut = h->tr == NULL ? 1025 /* transaction_cancelled */ : fdb_transaction_get_committed_version(h->tr, &version);
+  endCommit(env, h);
+  if (UNLIKELY(*errOut)) return wrap_null();
+
+  napi_value result;
+  TRY(napi_create_object(env, &result));
+  MaybeValue versionBuf = versionToJSBuffer(env, version);
+  TRY(versionBuf.status);
+  TRY(napi_set_named_property(env, result, "committedVersion", versionBuf.value));
+
+  if (stampFuture != NULL) {
+    const uint8_t *stamp;
+    int len;
+    *errOut = fdb_future_get_key(stampFuture, &stamp, &len);
+    if (UNLIKELY(*errOut)) return wrap_null();
+
+    napi_value stampBuf;
+    TRY(napi_create_buffer_copy(env, (size_t)len, (void *)stamp, NULL, &stampBuf));
+    TRY(napi_set_named_property(env, result, "versionstamp", stampBuf));
+  }
+  return wrap_ok(result);
+}
+
+static void releaseCommit(napi_env env, void *data) {
+  endCommit(env, (TransactionHandle *)data);
+}
+
+// commitAndFinalize(wantVersionstamp) -> Promise<{committedVersion, versionstamp?}>
+//
+// Commit, and resolve once with the committed version (and the versionstamp,
+// if requested) rather than needing separate calls for each.
+static napi_value commitAndFinalize(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value args[1] = {};
+  napi_value jsTn;
+  NAPI_OK_OR_RETURN_NULL(env, napi_get_cb_info(env, info, &argc, args, &jsTn, NULL));
+
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
+
+  bool wantStamp = false;
+  napi_valuetype type;
+  NAPI_OK_OR_RETURN_NULL(env, typeof_wrap(env, args[0], &type));
+  if (type == napi_boolean) NAPI_OK_OR_RETURN_NULL(env, napi_get_value_bool(env, args[0], &wantStamp));
+
+  // The versionstamp must be requested before the commit is issued.
+  FDBFuture *stampFuture = wantStamp ? fdb_transaction_get_versionstamp(tr) : NULL;
+  FDBFuture *commitFuture = fdb_transaction_commit(tr);
+  h->commits++;
+  return futurePairToJSPromise(env, commitFuture, stampFuture, jsTn, h, getCommitResult, releaseCommit).value;
+}
+
 // Reset the transaction so it can be reused.
 static napi_value reset(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (LIKELY(tr != NULL)) fdb_transaction_reset(tr);
+  TransactionHandle *h = getHandle(env, info);
+  if (LIKELY(h != NULL)) {
+    h->commits = 0; // Any failed commit is abandoned.
+    // If destroy() was waiting on that commit, there's nothing to reset.
+    if (h->destroy_pending) destroyTransaction(env, h);
+    else {
+      fdb_transaction_reset(h->tr);
+      releaseBytes(env, h);
+    }
+  }
   return NULL;
 }
 
 static napi_value cancel(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (LIKELY(tr != NULL)) fdb_transaction_cancel(tr);
+  TransactionHandle *h = (TransactionHandle *)getWrapped(env, info);
+  // Cancelling a destroyed transaction does nothing.
+  if (LIKELY(h != NULL && h->tr != NULL)) fdb_transaction_cancel(h->tr);
   return NULL;
 }
 
+// Destroy the native transaction now rather than waiting for the JS object to
+// be garbage collected. Any further calls on the object throw. Futures the
+// transaction has handed out (eg watches) may still resolve.
+static napi_value destroy(napi_env env, napi_callback_info info) {
+  TransactionHandle *h = (TransactionHandle *)getWrapped(env, info);
+  if (UNLIKELY(h == NULL) || h->tr == NULL) return NULL;
+  if (h->commits > 0) h->destroy_pending = true;
+  else destroyTransaction(env, h);
+  return NULL;
+}
+
+// getTransactionStats() -> {live, externalBytes}
+napi_value getTransactionStats(napi_env env, napi_callback_info info) {
+  napi_value result, live, bytes;
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_object(env, &result));
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_int64(env, liveTransactions.load(), &live));
+  NAPI_OK_OR_RETURN_NULL(env, napi_set_named_property(env, result, "live", live));
+  NAPI_OK_OR_RETURN_NULL(env, napi_create_int64(env, externalBytes.load(), &bytes));
+  NAPI_OK_OR_RETURN_NULL(env, napi_set_named_property(env, result, "externalBytes", bytes));
+  return result;
+}
+
 // See fdb_transaction_on_error documentation to see how to handle this.
 // This is all wrapped by JS.
 static napi_value onError(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
 
   GET_ARGS(env, info, args, 2);
 
   fdb_error_t errorCode;
   TRY_V(napi_get_value_int32(env, args[0], &errorCode));
-  FDBFuture *f = fdb_transaction_on_error(tr, errorCode);
+
+  h->commits = 0; // Any failed commit is abandoned.
+  if (h->destroy_pending) {
+    // destroy() was waiting on that commit. There's nothing left to retry.
+    destroyTransaction(env, h);
+    throw_if_not_ok(env, napi_throw_error(env, NULL, "Transaction has been disposed"));
+    return NULL;
+  }
+
+  FDBFuture *f = fdb_transaction_on_error(h->tr, errorCode);
+  // The transaction is reset if the error is retryable, and otherwise it's
+  // finished with. Either way its buffered mutations are released.
+  releaseBytes(env, h);
   return futureToJS(env, f, args[1], ignoreResult).value;
 }
 
+typedef struct SizeData {
+  TransactionHandle *h;
+  napi_ref owner; // Keeps the handle alive.
+} SizeData;
+
+// The approximate size is a better estimate of the transaction's buffered
+// mutations than our running total, so the reported memory is topped up to
+// match it.
+static MaybeValue getApproximateSizeResult(napi_env env, FDBFuture *future, void *data, fdb_error_t *errOut) {
+  SizeData *sd = (SizeData *)data;
+  TransactionHandle *h = sd->h;
+  MaybeValue result = getInt64ToNumber(env, future, errOut);
+
+  int64_t size;
+  if (*errOut == 0 && h->tr != NULL && fdb_future_get_int64(future, &size) == 0) {
+    int64_t known = h->reported_bytes + h->unreported_bytes;
+    if (size > known) {
+      h->unreported_bytes += size - known;
+      flushBytes(env, h);
+    }
+  }
+
+  napi_delete_reference(env, sd->owner);
+  return result;
+}
+
 static napi_value getApproximateSize(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  napi_value jsTn;
+  NAPI_OK_OR_RETURN_NULL(env, napi_get_cb_info(env, info, 0, NULL, &jsTn, NULL));
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+
+  SizeData *sd = (SizeData *)malloc(sizeof(SizeData));
+  sd->h = h;
+  napi_status status = napi_create_reference(env, jsTn, 1, &sd->owner);
+  if (status != napi_ok) {
+    free(sd);
+    throw_if_not_ok(env, status);
+    return NULL;
+  }
 
-  FDBFuture *f = fdb_transaction_get_approximate_size(tr);
-  return futureToJS(env, f, NULL, getInt64ToNumber).value;
+  FDBFuture *f = fdb_transaction_get_approximate_size(h->tr);
+  return futureToJSPromiseWithData(env, f, sd, getApproximateSizeResult).value;
 }
 
 
 // Get(key, isSnapshot, [cb])
 static napi_value get(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
   GET_ARGS(env, info, args, 3);
@@ -386,7 +658,7 @@ static napi_value get(napi_env env, napi_callback_info info) {
  */
 // GetKey(key, selOrEq, offset, isSnapshot, [cb])
 static napi_value getKey(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
   GET_ARGS(env, info, args, 5);
@@ -410,8 +682,9 @@ static napi_value getKey(napi_env env, napi_callback_info info) {
 
 // set(key, val). Syncronous.
 static napi_value set(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
   GET_ARGS(env, info, args, 2);
 
   StringParams key;
@@ -419,6 +692,7 @@ static napi_value set(napi_env env, napi_callback_info info) {
   StringParams val;
   TRY_V(toStringParams(env, args[1], &val));
   fdb_transaction_set(tr, key.str, key.len, val.str, val.len);
+  trackBytes(env, h, key.len + val.len);
 
   destroyStringParams(&key);
   destroyStringParams(&val);
@@ -428,14 +702,16 @@ static napi_value set(napi_env env, napi_callback_info info) {
 // Delete value stored for key.
 // clear("somekey")
 static napi_value clear(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
   GET_ARGS(env, info, args, 1);
 
   StringParams key;
   TRY_V(toStringParams(env, args[0], &key));
 
   fdb_transaction_clear(tr, key.str, key.len);
+  trackBytes(env, h, key.len);
 
   destroyStringParams(&key);
   return NULL;
@@ -443,8 +719,9 @@ static napi_value clear(napi_env env, napi_callback_info info) {
 
 // atomicOp(key, operand key, mutationtype)
 static napi_value atomicOp(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
   GET_ARGS(env, info, args, 3);
 
   int32_t operationType; // actually a FDBMutationType, but we'll store an int worth of memory.
@@ -456,6 +733,7 @@ static napi_value atomicOp(napi_env env, napi_callback_info info) {
   TRY_V(toStringParams(env, args[2], &operand));
 
   fdb_transaction_atomic_op(tr, key.str, key.len, operand.str, operand.len, (FDBMutationType)operationType);
+  trackBytes(env, h, key.len + operand.len);
 
   destroyStringParams(&key);
   destroyStringParams(&operand);
@@ -468,13 +746,17 @@ static napi_value atomicOp(napi_env env, napi_callback_info info) {
 //   limit or 0, target_bytes or 0,
 //   streamingMode, iteration,
 //   snapshot, reverse,
-//   [cb]
+//   [cb], [stripPrefix]
 // )
+//
+// If stripPrefix is passed, every returned key must start with it, and the
+// prefix is removed from keys as they're copied out. This is only supported
+// with promises.
 static napi_value getRange(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
-  GET_ARGS(env, info, args, 13);
+  GET_ARGS(env, info, args, 14);
 
   StringParams start;
   TRY_V(toStringParams(env, args[0], &start));
@@ -507,6 +789,25 @@ static napi_value getRange(napi_env env, napi_callback_info info) {
   bool reverse;
   TRY_V(napi_get_value_bool(env, args[11], &reverse));
 
+  napi_valuetype prefixType;
+  TRY_V(napi_typeof(env, args[13], &prefixType));
+  StripPrefix *strip = NULL;
+  if (prefixType != napi_undefined && prefixType != napi_null) {
+    napi_valuetype cbType;
+    TRY_V(napi_typeof(env, args[12], &cbType));
+    if (cbType != napi_undefined && cbType != napi_null) {
+      throw_if_not_ok(env, napi_throw_error(env, NULL, "getRange prefix stripping requires the promise API"));
+      return NULL;
+    }
+
+    StringParams prefix;
+    TRY_V(toStringParams(env, args[13], &prefix));
+    strip = (StripPrefix *)malloc(sizeof(StripPrefix) + prefix.len);
+    strip->len = prefix.len;
+    memcpy(strip + 1, prefix.str, prefix.len);
+    destroyStringParams(&prefix);
+  }
+
   FDBFuture *f = fdb_transaction_get_range(tr,
     start.str, start.len, (fdb_bool_t)startOrEqual, startOffset,
     end.str, end.len, (fdb_bool_t)endOrEqual, endOffset,
@@ -517,13 +818,15 @@ static napi_value getRange(napi_env env, napi_callback_info info) {
   destroyStringParams(&start);
   destroyStringParams(&end);
 
+  if (strip != NULL) return futureToJSPromiseWithData(env, f, strip, getKeyValueListStripped).value;
   return futureToJS(env, f, args[12], getKeyValueList).value;
 }
 
 // clearRange(start, end). Clears range [start, end).
 static napi_value clearRange(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
   GET_ARGS(env, info, args, 2);
 
   StringParams start;
@@ -531,6 +834,7 @@ static napi_value clearRange(napi_env env, napi_callback_info info) {
   StringParams end;
   TRY_V(toStringParams(env, args[1], &end));
   fdb_transaction_clear_range(tr, start.str, start.len, end.str, end.len);
+  trackBytes(env, h, start.len + end.len);
 
   destroyStringParams(&start);
   destroyStringParams(&end);
@@ -539,7 +843,7 @@ static napi_value clearRange(napi_env env, napi_callback_info info) {
 
 // getEstimatedRangeSizeBytes(start, end) -> Future<number>.
 static napi_value getEstimatedRangeSizeBytes(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 3);
 
@@ -557,7 +861,7 @@ static napi_value getEstimatedRangeSizeBytes(napi_env env, napi_callback_info in
 
 // getRangeSplitPoints(start, end, count).
 static napi_value getRangeSplitPoints(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 4);
 
@@ -581,7 +885,7 @@ static napi_value getRangeSplitPoints(napi_env env, napi_callback_info info) {
 // even after cancel has been called. The callback callback is *always* called
 // even if the owning txn is cancelled, conflicts, or is discarded.
 static napi_value watch(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 2);
 
@@ -601,8 +905,9 @@ static napi_value addConflictRange(napi_env env, napi_callback_info info, FDBCon
   // Its weird we're returning a value in these cases - we *always* return 0.
   // Doing it that way because it makes the macros simpler. Hopefully that gets
   // compiled out.
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
-  if (UNLIKELY(tr == NULL)) return NULL;
+  TransactionHandle *h = getHandle(env, info);
+  if (UNLIKELY(h == NULL)) return NULL;
+  FDBTransaction *tr = h->tr;
   GET_ARGS(env, info, args, 2);
 
   StringParams start;
@@ -610,6 +915,7 @@ static napi_value addConflictRange(napi_env env, napi_callback_info info, FDBCon
   StringParams end;
   TRY_V(toStringParams(env, args[1], &end));
   fdb_error_t errorCode = fdb_transaction_add_conflict_range(tr, start.str, start.len, end.str, end.len, type);
+  trackBytes(env, h, start.len + end.len);
 
   destroyStringParams(&start);
   destroyStringParams(&end);
@@ -630,7 +936,7 @@ static napi_value addWriteConflictRange(napi_env env, napi_callback_info info) {
 
 
 static napi_value getReadVersion(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 1);
 
@@ -640,7 +946,7 @@ static napi_value getReadVersion(napi_env env, napi_callback_info info) {
 
 // setReadVersion(version)
 static napi_value setReadVersion(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 1);
 
@@ -661,7 +967,7 @@ static napi_value setReadVersion(napi_env env, napi_callback_info info) {
 
 
 static napi_value getCommittedVersion(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
 
   int64_t version;
@@ -672,7 +978,7 @@ static napi_value getCommittedVersion(napi_env env, napi_callback_info info) {
 }
 
 static napi_value getVersionstamp(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 1);
 
@@ -682,7 +988,7 @@ static napi_value getVersionstamp(napi_env env, napi_callback_info info) {
 
 // getAddressesForKey("somekey", [cb])
 static napi_value getAddressesForKey(napi_env env, napi_callback_info info) {
-  FDBTransaction *tr = (FDBTransaction *)getWrapped(env, info);
+  FDBTransaction *tr = getTransaction(env, info);
   if (UNLIKELY(tr == NULL)) return NULL;
   GET_ARGS(env, info, args, 2);
 
@@ -696,12 +1002,15 @@ static napi_value getAddressesForKey(napi_env env, napi_callback_info info) {
 
 
 
-napi_status initTransaction(napi_env env) {
+napi_status initTransaction(napi_env env, InstanceData *inst) {
   napi_property_descriptor desc[] = {
     FN_DEF(setOption),
+    FN_DEF(setOptionsPacked),
     FN_DEF(commit),
+    FN_DEF(commitAndFinalize),
     FN_DEF(reset),
     FN_DEF(cancel),
+    FN_DEF(destroy),
     FN_DEF(onError),
 
     FN_DEF(getApproximateSize),
@@ -736,6 +1045,6 @@ napi_status initTransaction(napi_env env) {
   NAPI_OK_OR_RETURN_STATUS(env, napi_define_class(env, "Transaction", NAPI_AUTO_LENGTH,
     empty, NULL, sizeof(desc)/sizeof(desc[0]), desc, &constructor));
 
-  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &cons_ref));
+  NAPI_OK_OR_RETURN_STATUS(env, napi_create_reference(env, constructor, 1, &inst->transaction_cons_ref));
   return napi_ok;
 }
\ No newline at end of file
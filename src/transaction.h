@@ -25,11 +25,16 @@
 #define FDB_NODE_TRANSACTION_H
 
 #include "utils.h"
+#include "instance.h"
 #include "fdbversion.h"
 #include <foundationdb/fdb_c.h>
 
 MaybeValue newTransaction(napi_env env, FDBTransaction *tr);
-napi_status initTransaction(napi_env env);
+napi_status initTransaction(napi_env env, InstanceData *inst);
+
+// Module level. Counts of live native transactions and the memory reported
+// to V8 for them, across every environment.
+napi_value getTransactionStats(napi_env env, napi_callback_info info);
 
 
 // class Transaction: public node::ObjectWrap {
@@ -0,0 +1,56 @@
+import 'mocha'
+import assert = require('assert')
+import { promises as fsp } from 'fs'
+import { tmpdir } from 'os'
+import * as path from 'path'
+import { dumpRange, restoreRange, inspectDump } from '../lib'
+import {
+  numXF,
+  withEachDb,
+} from './util'
+
+withEachDb(db => describe('dump and restore', () => {
+  let dir: string
+  before(async () => { dir = await fsp.mkdtemp(path.join(tmpdir(), 'fdbdump-')) })
+  after(() => fsp.rm(dir, {recursive: true, force: true}))
+
+  it('round trips a range into another subspace', async () => {
+    const src = db.at('src/', numXF, numXF)
+    const dest = db.at('dest/', numXF, numXF)
+    await src.doTn(async tn => { for (let i = 0; i < 500; i++) tn.set(i, i * 2) })
+
+    const file = path.join(dir, 'a.dump')
+    const stats = await dumpRange(src, 0, 500, file, {blockBytes: 256, chunkBytes: 1000})
+    assert.strictEqual(stats.rows, 500)
+    assert(stats.blocks > 1)
+
+    const info = await inspectDump(file)
+    assert.strictEqual(info.rows, 500)
+    assert.deepStrictEqual(info.lastKey, numXF.pack(499))
+
+    const loaded = await restoreRange(dest, file, {maxBytes: 1000})
+    assert.strictEqual(loaded.rows, 500)
+
+    const result = await dest.getRangeAll(0, 500)
+    assert.strictEqual(result.length, 500)
+    result.forEach(([k, v], i) => {
+      assert.strictEqual(k, i)
+      assert.strictEqual(v, i * 2)
+    })
+  })
+
+  it('rejects corrupt blocks', async () => {
+    await db.set('x', 'some value which is long enough')
+    const file = path.join(dir, 'b.dump')
+    await dumpRange(db, 'x', 'y', file)
+
+    const buf = await fsp.readFile(file)
+    buf[20] ^= 0xff // Inside the first block's payload.
+    await fsp.writeFile(file, buf)
+
+    await restoreRange(db.at('copy/'), file).then(
+      () => Promise.reject(Error('should have thrown')),
+      (e) => assert(/checksum/.test(e.message))
+    )
+  })
+}))
@@ -0,0 +1,36 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('blobs', () => {
+  const data = Buffer.alloc(100000)
+  for (let i = 0; i < data.length; i++) data[i] = (i * 7 + (i >> 8)) & 0xff
+
+  it('writes blobs across transactions and reads them back', async () => {
+    const blobs = new fdb.BlobStore(db, {chunkSize: 1000, maxTxnBytes: 8000, concurrency: 3})
+    assert.deepStrictEqual(await blobs.put(db, 'a', data), {size: 100000, chunkSize: 1000, chunks: 100})
+    assert.deepStrictEqual(await blobs.get(db, 'a'), data)
+    assert.deepStrictEqual(await blobs.get(db, 'a', {start: 1500, end: 4321}), data.subarray(1500, 4321))
+    assert.deepStrictEqual(await db.doTn(tn => blobs.get(tn, 'a', {start: 99990})), data.subarray(99990))
+
+    // Overwriting clears the old chunks.
+    await blobs.put(db, 'a', 'hi there')
+    assert.strictEqual((await blobs.get(db, 'a'))!.toString(), 'hi there')
+    assert.strictEqual((await db.at(blobs.subspace).getRangeAllStartsWith(['a'])).length, 1)
+
+    await blobs.delete(db, 'a')
+    assert.strictEqual(await blobs.get(db, 'a'), undefined)
+    assert.strictEqual(await blobs.stat(db, 'a'), undefined)
+  })
+
+  it('streams byte ranges of a blob in order', async () => {
+    const blobs = new fdb.BlobStore(db, {chunkSize: 1000, maxTxnBytes: 4000, concurrency: 2})
+    await blobs.put(db, 'b', data)
+
+    const chunks: Buffer[] = []
+    for await (const chunk of blobs.createReadStream(db, 'b', {start: 2500, end: 50001})) chunks.push(chunk)
+    assert(chunks.length > 1)
+    assert.deepStrictEqual(Buffer.concat(chunks), data.subarray(2500, 50001))
+  })
+}))
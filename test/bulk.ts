@@ -0,0 +1,76 @@
+import 'mocha'
+import assert = require('assert')
+import { Readable, pipeline } from 'stream'
+import { promisify } from 'util'
+import {
+  numXF,
+  withEachDb,
+} from './util'
+
+withEachDb(db => describe('bulk loading', () => {
+  function *rows(n: number): Iterable<[number, number]> {
+    for (let i = 0; i < n; i++) yield [i, i]
+  }
+
+  it('loads all rows across multiple transactions', async () => {
+    const _db = db.at(null, numXF, numXF)
+    const stats = await _db.bulkLoad(rows(1000), {maxBytes: 1000, maxInFlight: 3})
+
+    assert.strictEqual(stats.rows, 1000)
+    assert(stats.transactions > 1)
+
+    const result = await _db.getRangeAll(0, 1000)
+    assert.strictEqual(result.length, 1000)
+    result.forEach(([k, v], i) => {
+      assert.strictEqual(k, i)
+      assert.strictEqual(v, i)
+    })
+  })
+
+  it('accepts async iterables', async () => {
+    const _db = db.at(null, numXF, numXF)
+    async function *gen() { yield* rows(100) }
+    const stats = await _db.bulkLoad(gen())
+    assert.strictEqual(stats.rows, 100)
+    assert.strictEqual((await _db.getRangeAll(0, 100)).length, 100)
+  })
+
+  it('loads rows piped into createWriteStream', async () => {
+    const _db = db.at(null, numXF, numXF)
+    const out = _db.createWriteStream({maxBytes: 500})
+    await promisify(pipeline)(Readable.from(rows(200)), out)
+
+    assert.strictEqual(out.stats!.rows, 200)
+    assert.strictEqual((await _db.getRangeAll(0, 200)).length, 200)
+  })
+
+  it('rethrows errors from the source', async () => {
+    async function *gen(): AsyncIterable<[string, string]> {
+      yield ['a', 'b']
+      throw Error('nope')
+    }
+    await db.bulkLoad(gen()).then(
+      () => Promise.reject(Error('should have thrown')),
+      (e) => assert.strictEqual(e.message, 'nope')
+    )
+  })
+
+  it('waits for in-flight batches before rethrowing source errors', async () => {
+    const _db = db.at(null, numXF, numXF)
+    function *gen(): Iterable<[number, number]> {
+      yield* rows(100)
+      throw Error('nope')
+    }
+    let progress = 0
+    const committed = await _db.bulkLoad(gen(), {maxBytes: 100, maxInFlight: 4, onProgress: s => { progress = s.rows }}).then(
+      () => Promise.reject(Error('should have thrown')),
+      (e) => { assert.strictEqual(e.message, 'nope'); return progress }
+    )
+
+    // Every dispatched batch had settled, so nothing more gets written.
+    assert(committed > 0)
+    await new Promise(resolve => setTimeout(resolve, 20))
+    assert.strictEqual(progress, committed)
+    assert.strictEqual((await _db.getRangeAll(0, 100)).length, committed)
+  })
+}))
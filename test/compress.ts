@@ -0,0 +1,50 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('value compression', () => {
+  const doc = (i: number) => ({id: i, name: `user ${i}`, email: 'someone@example.com', tags: ['alpha', 'beta', 'gamma'], padding: 'x'.repeat(200)})
+
+  it('reads compressed and legacy values through the same encoding', async () => {
+    const legacy = db.withValueEncoding(fdb.encoders.json)
+    await legacy.set('old', {legacy: true})
+
+    // minBatchBytes: 0 makes range reads go through the threadpool.
+    const docs = db.withValueEncoding(fdb.compressed(fdb.encoders.json, {minBatchBytes: 0}))
+    await docs.doTn(async tn => {
+      for (let i = 0; i < 10; i++) tn.set('doc' + i, doc(i))
+      tn.set('small', 'hi')
+    })
+
+    const raw = await db.get('doc0')
+    assert(raw!.length < JSON.stringify(doc(0)).length)
+    assert.strictEqual((await db.get('small'))!.toString(), '"hi"')
+
+    assert.deepStrictEqual(await docs.get('old'), {legacy: true})
+    assert.deepStrictEqual(await docs.get('doc3'), doc(3))
+    const all = await docs.getRangeAllStartsWith('doc')
+    assert.deepStrictEqual(all.map(([, v]) => v), Array.from({length: 10}, (_, i) => doc(i)))
+  })
+
+  it('keeps values written with older dictionaries readable', async () => {
+    const samples = Array.from({length: 50}, (_, i) => JSON.stringify(doc(i)))
+    const d1 = fdb.trainDictionary(samples, 1024)
+    const d2 = fdb.trainDictionary(samples.slice(10), 2048)
+    assert.notStrictEqual(d1.id, d2.id)
+
+    const v1 = fdb.compressed(fdb.encoders.json, {dictionary: d1})
+    const [packed] = await v1.packBatch([doc(1)])
+    await db.set('a', packed)
+
+    const v2 = db.withValueEncoding(fdb.compressed(fdb.encoders.json, {dictionary: d2, dictionaries: [d1], minBatchBytes: 0}))
+    await v2.set('b', doc(2))
+    assert.deepStrictEqual((await v2.getRangeAll('a', 'c')).map(([, v]) => v), [doc(1), doc(2)])
+
+    const unknown = db.withValueEncoding(fdb.compressed(fdb.encoders.json, {dictionary: d2}))
+    await unknown.get('a').then(
+      () => Promise.reject(Error('should have thrown')),
+      (e: Error) => assert.strictEqual(e.message, `Value was compressed with unknown dictionary ${d1.id}`)
+    )
+  })
+}))
@@ -0,0 +1,37 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+import { int64LE } from '../lib/counter'
+
+withEachDb(db => describe('sharded counters', () => {
+  it('round trips negative values through the int64 encoding', () => {
+    for (const n of [0, 1, -1, 2 ** 40, -(2 ** 40) - 3, Number.MAX_SAFE_INTEGER, Number.MIN_SAFE_INTEGER]) {
+      assert.strictEqual(int64LE.unpack(int64LE.pack(n) as Buffer), n)
+    }
+  })
+
+  it('sums increments spread across shards', async () => {
+    const counters = new fdb.ShardedCounter(db, {shards: 8})
+    await Promise.all(Array.from({length: 20}, () => db.doTn(async tn => {
+      counters.add(tn, 'hits')
+      counters.add(tn, 'bytes', 100)
+    })))
+    await db.doTn(async tn => counters.add(tn, 'bytes', -500))
+
+    assert.strictEqual(await counters.get(db, 'hits'), 20)
+    assert.strictEqual(await counters.get(db, 'bytes'), 1500)
+    assert.strictEqual(await counters.get(db, 'nothing'), 0)
+  })
+
+  it('compacts shards into a single key', async () => {
+    const counters = new fdb.ShardedCounter(db, {shards: 8})
+    for (let i = 0; i < 20; i++) await db.doTn(async tn => counters.add(tn, 'hits', 2))
+
+    assert.strictEqual(await counters.compactAll(db), 1)
+    assert.strictEqual(await counters.get(db, 'hits'), 40)
+    const keys = await db.at(counters.subspace).getRangeAllStartsWith(['hits'])
+    assert.strictEqual(keys.length, 1)
+    assert.strictEqual(await counters.compactAll(db), 0)
+  })
+}))
@@ -145,6 +145,51 @@ withEachDb(db => describe('directory layer', () => {
       assert.strictEqual(entries[0][1].toString(), 'val b')
     })
 
+    it('lists and removes large trees in pages', async () => {
+      const root = await dl.create(db, 'big')
+      const names = Array.from({length: 25}, (_, i) => 'c' + String(i).padStart(2, '0'))
+      await db.doTn(async tn => {
+        for (const n of names) {
+          const dir = await root.create(tn, [n, 'leaf'])
+          tn.at(dir).set('item', n)
+        }
+      })
+
+      const first = await root.listPage(db, [], {limit: 10})
+      assert.deepStrictEqual(first.names, names.slice(0, 10))
+      const second = await root.listPage(db, [], {after: first.next, limit: 10})
+      assert.deepStrictEqual(second.names, names.slice(10, 20))
+
+      const pages = []
+      for await (const page of root.listPages(db, [], {pageSize: 10})) pages.push(page)
+      assert.deepStrictEqual(pages.map(p => p.length), [10, 10, 5])
+
+      await root.remove(db)
+      assert.strictEqual(await dl.exists(db, 'big'), false)
+      const entries = await db.at(dl._contentSubspace.withKeyEncoding(defaultTransformer))
+        .getRangeAllStartsWith(Buffer.alloc(0))
+      assert.strictEqual(entries.length, 0)
+    })
+
+    it('resumes interrupted removals', async () => {
+      const dir = await dl.create(db, 'gone')
+      const child = await dir.create(db, 'child')
+      await db.at(child).set('item', 'x')
+
+      // Unlink the directory and record its removal, as remove(db) does
+      // before it clears the subtree.
+      await db.doTn(async tn => {
+        tn.at(dl._rootNode).set([Buffer.from('removing'), dir.getSubspace().prefix], Buffer.alloc(0))
+        tn.at(dl._rootNode).clear([0, 'gone'])
+      })
+
+      await dl.resumeRemovals(db)
+      const entries = await db.at(dl._contentSubspace.withKeyEncoding(defaultTransformer))
+        .getRangeAllStartsWith(Buffer.alloc(0))
+      assert.strictEqual(entries.length, 0)
+      assert.deepStrictEqual(await db.at(dl._rootNode).getRangeAllStartsWith([Buffer.from('removing')]), [])
+    })
+
     it('can make a partition', async () => {
       const part = await dl.create(db, 'part', 'partition')
       assert(part.isPartition())
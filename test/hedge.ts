@@ -0,0 +1,29 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('hedged reads', () => {
+  it('reads keys at one version and counts hedges', async () => {
+    await db.doTn(async tn => {
+      for (let i = 0; i < 10; i++) tn.set('k' + i, 'v' + i)
+    })
+
+    // With no delay every read is hedged, and either read may win.
+    const reader = new fdb.HedgedReader(db, {delayMs: 0})
+    assert.strictEqual((await reader.get('k3'))!.toString(), 'v3')
+    const vals = await reader.getMany(['k1', 'missing', 'k9'])
+    assert.deepStrictEqual(vals.map(v => v && v.toString()), ['v1', undefined, 'v9'])
+
+    const stats = reader.getStats()
+    assert.strictEqual(stats.reads, 4)
+    assert(stats.hedged <= 4)
+    assert(stats.hedgeWins <= stats.hedged)
+    assert.strictEqual(stats.delayMs, 0)
+
+    // A long delay never hedges.
+    const patient = new fdb.HedgedReader(db, {delayMs: 10000})
+    assert.strictEqual((await patient.get('k0'))!.toString(), 'v0')
+    assert.strictEqual(patient.getStats().hedged, 0)
+  })
+}))
@@ -7,8 +7,10 @@ import {
   bufToNum,
   withEachDb,
 } from './util'
-import {MutationType, tuple, TupleItem, encoders, Watch, keySelector} from '../lib'
+import {MutationType, tuple, TupleItem, encoders, Watch, keySelector, open} from '../lib'
 import { Transformer } from '../lib/transformer'
+import { Semaphore } from '../lib/limiter'
+import { forEachConcurrently } from '../lib/util'
 
 process.on('unhandledRejection', err => { throw err })
 
@@ -92,6 +94,25 @@ withEachDb(db => describe('key value functionality', () => {
     }, {read_your_writes_disable: true})
   })
 
+  it('obeys transaction options from a profile', async () => {
+    const profile = db.createTransactionProfile({read_your_writes_disable: true, timeout: 5000, retry_limit: 10})
+    assert.deepStrictEqual(profile.options, {read_your_writes_disable: true, timeout: 5000, retry_limit: 10})
+
+    // Profiles are reusable.
+    for (let i = 0; i < 2; i++) {
+      await db.doTransaction(async tn => {
+        tn.set('x', 'hi there')
+        assert.equal(await tn.get('x'), null)
+      }, profile)
+    }
+  })
+
+  it('rejects invalid options when creating a profile', () => {
+    assert.throws(() => db.createTransactionProfile({not_an_option: true} as any), TypeError)
+    assert.throws(() => db.createTransactionProfile({timeout: 'soon'} as any), TypeError)
+    assert.throws(() => db.createTransactionProfile({snapshot_ryw_enable: 5} as any), TypeError)
+  })
+
   it('retries conflicts', async function() {
     // Transactions do exponential backoff when they conflict, so the time
     // this test takes to run is super variable based on how unlucky we get
@@ -122,6 +143,224 @@ withEachDb(db => describe('key value functionality', () => {
     assert(txnAttempts > concurrentWrites)
   })
 
+  describe('transaction pool', () => {
+    afterEach(() => db.setTransactionPoolSize(0))
+
+    it('reuses reset transactions across doTn calls', async () => {
+      db.setTransactionPoolSize(2)
+      for (let i = 0; i < 5; i++) {
+        await db.doTn(async tn => {
+          assert.deepStrictEqual(await tn.get('pooled'), i === 0 ? undefined : Buffer.from('v' + (i - 1)))
+          tn.set('pooled', 'v' + i)
+        })
+      }
+
+      const stats = db.getTransactionPoolStats()!
+      assert.strictEqual(stats.created, 1)
+      assert.strictEqual(stats.reused, 4)
+      assert.strictEqual(stats.idle, 1)
+    })
+
+    it('does not reuse transactions which handed out a versionstamp', async () => {
+      db.setTransactionPoolSize(2)
+      const stamp = await db.doTn(async tn => {
+        tn.set('pooled', 'x')
+        return tn.getVersionstamp()
+      })
+      assert.strictEqual((await stamp.promise).length, 10)
+
+      const stats = db.getTransactionPoolStats()!
+      assert.strictEqual(stats.discarded, 1)
+      assert.strictEqual(stats.idle, 0)
+    })
+  })
+
+  describe('concurrency limits', () => {
+    afterEach(() => db.setConcurrencyLimits({}))
+
+    it('queues reads beyond the limit', async () => {
+      db.setConcurrencyLimits({maxReads: 2})
+      await db.doTn(async tn => {
+        for (let i = 0; i < 8; i++) tn.set('k' + i, 'v' + i)
+      })
+
+      // Reads are admitted in order, but may complete in any order.
+      await db.doTn(async tn => {
+        await Promise.all(new Array(8).fill(0).map(async (_, i) => {
+          assert.strictEqual((await tn.get('k' + i))?.toString(), 'v' + i)
+        }))
+      })
+
+      const {reads} = db.getConcurrencyStats()!
+      assert.strictEqual(reads.inFlight, 0)
+      assert.strictEqual(reads.maxQueued, 6)
+      assert.strictEqual(reads.waited, 6)
+    })
+
+    it('admits queued operations in FIFO order', async () => {
+      const sem = new Semaphore(2, Infinity)
+      const admitted: number[] = []
+      let unblock!: () => void
+      const blocked = new Promise<void>(resolve => { unblock = resolve })
+      const all = Promise.all(new Array(8).fill(0).map((_, i) => sem.run(() => {
+        admitted.push(i)
+        return blocked
+      })))
+      assert.deepStrictEqual(admitted, [0, 1])
+      unblock()
+      await all
+      assert.deepStrictEqual(admitted, [0, 1, 2, 3, 4, 5, 6, 7])
+    })
+
+    it('stops starting work once a concurrent worker fails', async () => {
+      const started: number[] = []
+      await forEachConcurrently([0, 1, 2, 3, 4, 5, 6, 7], 2, async i => {
+        started.push(i)
+        await new Promise(resolve => setImmediate(resolve))
+        if (i === 0) throw Error('nope')
+      }).then(() => Promise.reject(Error('should have thrown')),
+        e => assert.strictEqual(e.message, 'nope'))
+      await new Promise(resolve => setTimeout(resolve, 10))
+      assert.deepStrictEqual(started, [0, 1])
+    })
+
+    it('rejects operations once the queue is full', async () => {
+      db.setConcurrencyLimits({maxReads: 1, maxQueued: 1})
+      const results = await db.doTn(tn => Promise.allSettled([tn.get('a'), tn.get('b'), tn.get('c')]))
+      assert.deepStrictEqual(results.map(r => r.status), ['fulfilled', 'fulfilled', 'rejected'])
+      assert.strictEqual(db.getConcurrencyStats()!.reads.rejected, 1)
+    })
+  })
+
+  describe('workload classes', () => {
+    it('runs transactions at the priority and budget of their class', async () => {
+      db.configureWorkloads({batch: {maxConcurrent: 2}})
+      const batchDb = db.withWorkloadClass('batch')
+      assert.strictEqual(batchDb.at('sub').workloadClass, 'batch')
+
+      let running = 0, maxRunning = 0
+      await Promise.all(new Array(6).fill(0).map((_, i) => batchDb.doTn(async tn => {
+        maxRunning = Math.max(maxRunning, ++running)
+        tn.set('b' + i, 'x')
+        await tn.get('b' + i)
+        running--
+      })))
+
+      assert.strictEqual(maxRunning, 2)
+      const {classes} = db.getWorkloadStats()
+      assert.strictEqual(classes.batch.admitted, 6)
+      assert.strictEqual(classes.batch.waited, 4)
+      assert.strictEqual(classes.interactive.admitted, 0)
+      assert(classes.batch.grvLatencyMs >= 0)
+    })
+  })
+
+  it('prewarms new connections', async () => {
+    const warm = open(undefined, {prewarm: true, transaction_timeout: 5000})
+    try {
+      await warm.ready
+      // Every reference to the database shares the warmup.
+      assert.strictEqual(warm.at('x').ready, warm.ready)
+      assert.strictEqual(warm.prewarm(), warm.ready)
+      await warm.getRoot().get('__nonexistent')
+    } finally {
+      warm.close()
+    }
+  })
+
+  describe('abort signals', () => {
+    it('cancels running transactions when the signal aborts', async () => {
+      const ac = new AbortController()
+      const sdb = db.withSignal(ac.signal)
+      assert.strictEqual(sdb.at('sub').signal, ac.signal)
+
+      let unblock!: () => void
+      const blocked = new Promise<void>(resolve => { unblock = resolve })
+      let bodyErr: any = null
+      const result = sdb.doTn(async tn => {
+        tn.set('aborted', 'x')
+        await blocked
+        try { await tn.get('aborted') } catch (e) { bodyErr = e }
+      })
+
+      ac.abort()
+      await result.then(() => Promise.reject(Error('should have thrown')),
+        e => assert.strictEqual(e.name, 'AbortError'))
+
+      // The body can't do anything else with the cancelled transaction.
+      unblock()
+      await new Promise(resolve => setTimeout(resolve, 10))
+      assert(bodyErr != null)
+      assert.strictEqual(await db.get('aborted'), undefined)
+
+      // Later operations reject straight away.
+      await sdb.get('aborted').then(() => Promise.reject(Error('should have thrown')),
+        e => assert.strictEqual(e.name, 'AbortError'))
+    })
+
+    it('does not return aborted transactions to the pool', async () => {
+      db.setTransactionPoolSize(2)
+      try {
+        const ac = new AbortController()
+        let unblock!: () => void
+        const blocked = new Promise<void>(resolve => { unblock = resolve })
+        let bodyErr: any = null
+        const result = db.withSignal(ac.signal).doTn(async tn => {
+          await blocked
+          try { tn.set('leaked', 'x') } catch (e) { bodyErr = e }
+        })
+
+        ac.abort()
+        await result.then(() => Promise.reject(Error('should have thrown')),
+          e => assert.strictEqual(e.name, 'AbortError'))
+        const stats = db.getTransactionPoolStats()!
+        assert.strictEqual(stats.discarded, 1)
+        assert.strictEqual(stats.idle, 0)
+
+        // The abandoned body's write can't end up in the next transaction.
+        unblock()
+        await db.doTn(async tn => { tn.set('other', 'y') })
+        assert(bodyErr != null)
+        assert.strictEqual(await db.get('leaked'), undefined)
+      } finally {
+        db.setTransactionPoolSize(0)
+      }
+    })
+
+    it('removes aborted transactions from the workload queue', async () => {
+      db.configureWorkloads({batch: {maxConcurrent: 1}})
+      const batchDb = db.withWorkloadClass('batch')
+      let unblock!: () => void
+      const blocked = new Promise<void>(resolve => { unblock = resolve })
+      const first = batchDb.doTn(() => blocked)
+
+      const ac = new AbortController()
+      const second = batchDb.withSignal(ac.signal).doTn(async () => {})
+      assert.strictEqual(db.getWorkloadStats().classes.batch.queued, 1)
+      ac.abort()
+      await second.then(() => Promise.reject(Error('should have thrown')),
+        e => assert.strictEqual(e.name, 'AbortError'))
+      assert.strictEqual(db.getWorkloadStats().classes.batch.queued, 0)
+
+      unblock()
+      await first
+      db.configureWorkloads({})
+    })
+  })
+
+  describe('transaction tags', () => {
+    it('applies each tag and counts transactions per tag', async () => {
+      await db.doTn(async tn => { tn.set('tagged', 'x') }, {tags: ['tagA', 'tagB']})
+      await db.doTn(async tn => { await tn.get('tagged') }, db.createTransactionProfile({tags: ['tagA'], auto_throttle_tag: 'tagC'}))
+
+      const stats = db.getTagStats()
+      assert.strictEqual(stats.tagA.started, 2)
+      assert.strictEqual(stats.tagB.started, 1)
+      assert.strictEqual(stats.tagC.started, 1)
+      assert.strictEqual(stats.tagA.rate, Infinity)
+    })
+  })
+
   describe('native encoding', () => {
     // This is a test for a regression.
     const setGetAssertEqual = async (val: any, valueEncoding: Transformer<any, any>) => {
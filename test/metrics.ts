@@ -0,0 +1,70 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('client metrics', () => {
+  it('reports the client status', async () => {
+    const status = await db.getClientStatus()
+    assert.strictEqual(typeof status, 'object')
+  })
+
+  it('counts callbacks and samples network thread load', async () => {
+    const sampler = new fdb.NetworkSampler()
+    const before = fdb.getNetworkStats()
+    for (let i = 0; i < 10; i++) await db.get('x' + i)
+    const after = fdb.getNetworkStats()
+
+    assert(after.running)
+    assert(after.callbacksQueued + after.callbacksInline > before.callbacksQueued + before.callbacksInline)
+    const buckets = after.callbackDelayBuckets
+    assert.strictEqual(buckets[buckets.length - 1].le, Infinity)
+    assert.strictEqual(buckets[buckets.length - 1].count, after.callbacksQueued)
+
+    const sample = sampler.sample()
+    assert(sample.busy <= 1)
+    assert(sample.callbacksPerSecond >= 0)
+  })
+
+  it('disposes transactions once doTn finishes', async () => {
+    const txns: fdb.Transaction[] = []
+    const live = fdb.getTransactionStats().live
+    await db.doTn(async tn => {
+      txns.push(tn)
+      tn.set('a', 'b')
+      assert.strictEqual(fdb.getTransactionStats().live, live + 1)
+    })
+    assert.strictEqual(fdb.getTransactionStats().live, live)
+    assert.throws(() => txns[0].set('a', 'c'))
+
+    // Disposing twice is fine.
+    const raw = db.rawCreateTransaction()
+    raw.dispose()
+    raw.dispose()
+    assert.strictEqual(fdb.getTransactionStats().live, live)
+  })
+
+  it('disposes transactions aborted while they commit', async () => {
+    const live = fdb.getTransactionStats().live
+    const ac = new AbortController()
+    await db.withSignal(ac.signal).doTn(async tn => {
+      tn.set('a', 'b')
+      // Fires once the commit has been issued.
+      setImmediate(() => ac.abort())
+    }).catch(e => assert.strictEqual(e.name, 'AbortError'))
+
+    // The cancelled commit settles in the background, and then the
+    // transaction is destroyed.
+    for (let i = 0; i < 100 && fdb.getTransactionStats().live !== live; i++) {
+      await new Promise(resolve => setTimeout(resolve, 10))
+    }
+    assert.strictEqual(fdb.getTransactionStats().live, live)
+  })
+
+  it('renders prometheus metrics', () => {
+    const text = fdb.prometheusMetrics({labels: {service: 'test'}})
+    assert(text.includes('# TYPE fdb_callback_delay_seconds histogram\n'))
+    assert(/^fdb_callback_delay_seconds_bucket\{service="test",le="\+Inf"\} \d+$/m.test(text))
+    assert(/^fdb_callbacks_total\{service="test",path="queued"\} \d+$/m.test(text))
+  })
+}))
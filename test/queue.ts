@@ -0,0 +1,76 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('queue', () => {
+  const makeQueue = (opts?: fdb.QueueOptions) => new fdb.Queue(db.at('q/').withValueEncoding(fdb.encoders.string), opts)
+
+  it('delivers items in order and tracks depth', async () => {
+    const q = makeQueue({window: 1})
+    await q.push(db, ['a', 'b', 'c'])
+    assert.strictEqual(await q.getDepth(db), 3)
+
+    const claimed = await q.claim(db, {max: 2})
+    assert.deepStrictEqual(claimed.map(i => i.value), ['a', 'b'])
+    for (const item of claimed) assert.strictEqual(await q.ack(db, item), true)
+    assert.strictEqual(await q.ack(db, claimed[0]), false)
+
+    assert.deepStrictEqual((await q.claim(db, {max: 5})).map(i => i.value), ['c'])
+    assert.strictEqual(await q.getDepth(db), 1)
+    assert.deepStrictEqual(await q.claim(db), [])
+
+    const stats = q.getStats()
+    assert.strictEqual(stats.enqueued, 3)
+    assert.strictEqual(stats.claimed, 3)
+    assert.strictEqual(stats.acked, 2)
+  })
+
+  it('returns released and expired items to the queue', async () => {
+    const q = makeQueue({leaseMs: 1})
+    await q.push(db, ['x'])
+
+    const [item] = await q.claim(db)
+    assert.strictEqual(await q.release(db, item), true)
+
+    const [again] = await q.claim(db)
+    assert.strictEqual(again.value, 'x')
+    await new Promise(resolve => setTimeout(resolve, 10))
+    assert.strictEqual(await q.requeueExpired(db), 1)
+    assert.strictEqual(await q.ack(db, again), false)
+    assert.strictEqual((await q.claim(db))[0].value, 'x')
+  })
+
+  it('requeues expired leases behind live ones', async () => {
+    const q = makeQueue({leaseMs: 1, window: 1})
+    await q.push(db, ['live', 'expired'])
+    const [live] = await q.claim(db)
+    const [expired] = await q.claim(db)
+    assert.strictEqual(await q.extend(db, live, 60000), true)
+
+    await new Promise(resolve => setTimeout(resolve, 10))
+    assert.strictEqual(await q.requeueExpired(db), 1)
+    assert.strictEqual(await q.ack(db, expired), false)
+    assert.strictEqual(await q.ack(db, live), true)
+  })
+
+  it('only counts operations which commit', async () => {
+    const q = makeQueue()
+    await db.doTn(async tn => {
+      q.enqueue(tn, 'never')
+      throw Error('rolled back')
+    }).catch(() => {})
+    assert.strictEqual(q.getStats().enqueued, 0)
+
+    await db.doTn(async tn => { q.enqueue(tn, 'kept') })
+    assert.strictEqual(q.getStats().enqueued, 1)
+  })
+
+  it('wakes waiting consumers when items are enqueued', async () => {
+    // The short lease also bounds how long a consumer sleeps between checks.
+    const q = makeQueue({leaseMs: 200})
+    const waiting = q.claim(db, {waitMs: 5000})
+    setTimeout(() => q.push(db, ['late']), 20)
+    assert.deepStrictEqual((await waiting).map(i => i.value), ['late'])
+  })
+}))
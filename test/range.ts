@@ -116,6 +116,124 @@ withEachDb(db => describe('key value functionality', () => {
     keys.forEach(x => assert(typeof x === 'number'))
   })
 
+  it('rejects range results which escape the subspace prefix', async () => {
+    const child = db.at('child/')
+    await child.set('a', 'yes')
+    await db.set('child0', 'outside')
+
+    assert.deepStrictEqual(batchToStrUnprefix(await child.getRangeAllStartsWith('')), [['a', 'yes']])
+    const end = fdb.keySelector.add(fdb.keySelector.firstGreaterOrEqual('\xff'), 1)
+    await child.getRangeAll('', end).then(
+      () => Promise.reject(Error('should have thrown')),
+      (e: Error) => assert.strictEqual(e.message, 'Cannot unpack key outside of prefix range.')
+    )
+  })
+
+  it('maps keys to shards with a ShardMap', async () => {
+    await prefill()
+    const prefix = db.getPrefix()
+    const shards = new fdb.locality.ShardMap(db, {begin: prefix, end: fdb.util.strInc(prefix)})
+
+    const all = await shards.getShards()
+    assert(all.length >= 1)
+    assert.deepStrictEqual(all[0].begin, prefix)
+    assert.deepStrictEqual(all[all.length - 1].end, fdb.util.strInc(prefix))
+    for (let i = 1; i < all.length; i++) assert.deepStrictEqual(all[i].begin, all[i - 1].end)
+
+    const key = Buffer.concat([prefix, Buffer.from('x')])
+    const shard = await shards.locate(key)
+    assert(Buffer.compare(shard.begin, key) <= 0 && Buffer.compare(key, shard.end) < 0)
+    assert(Array.isArray(shard.addresses))
+
+    assert.strictEqual(shards.noteError(new fdb.FDBError('wrong_shard_server', 1001)), true)
+    assert.strictEqual(shards.noteError(new fdb.FDBError('not_committed', 1020)), false)
+  })
+
+  it('streams a range in batches through createReadStream', async () => {
+    const _db = await prefill()
+    await _db.doTransaction(async tn => {
+      let i = 0
+      for await (const batch of tn.createReadStream(0, 1000, {highWaterMark: 1})) {
+        for (const [key, val] of batch) {
+          assert.strictEqual(key, i)
+          assert.strictEqual(val, i)
+          i++
+        }
+      }
+      assert.strictEqual(i, 1000)
+    })
+  })
+
+  it('streams framed raw pairs from the database in binary mode', async () => {
+    const _db = await prefill()
+    const chunks: Buffer[] = []
+    for await (const chunk of _db.createReadStream(0, 10, {binary: true})) chunks.push(chunk)
+    const data = Buffer.concat(chunks)
+
+    let pos = 0, count = 0
+    while (pos < data.length) {
+      const keyLen = data.readUInt32BE(pos); pos += 4
+      assert.strictEqual(_db.getSubspace().unpackKey(data.slice(pos, pos + keyLen)), count)
+      pos += keyLen
+      const valLen = data.readUInt32BE(pos); pos += 4 + valLen
+      count++
+    }
+    assert.strictEqual(count, 10)
+  })
+
+  it('caps the bytes fetched and buffered by range reads', async () => {
+    const _db = db.withValueEncoding(fdb.encoders.string)
+    await _db.doTn(async tn => {
+      for (let i = 0; i < 100; i++) tn.set('k' + String(i).padStart(3, '0'), 'x'.repeat(1000))
+    })
+
+    await _db.doTn(async tn => {
+      let batches = 0, count = 0
+      for await (const batch of tn.getRangeBatch('k', 'l', {maxBatchBytes: 5000})) {
+        assert(batch.length <= 5)
+        batches++
+        count += batch.length
+      }
+      assert.strictEqual(count, 100)
+      assert(batches >= 20)
+
+      let first = -1
+      count = 0
+      for await (const batch of tn.getRangeBatch('k', 'l', {adaptive: true})) {
+        if (first < 0) first = batch.length
+        count += batch.length
+      }
+      assert.strictEqual(count, 100)
+      assert(first <= 5) // Adaptive reads start with 4kb batches.
+    })
+
+    // Streaming reads split the range into batches which fit in the budget.
+    await _db.doTn(async tn => {
+      let count = 0
+      for await (const batch of tn.getRangeBatch('k', 'l', {maxBufferedBytes: 5000})) {
+        const bytes = batch.reduce((n, [k, v]) => n + Buffer.byteLength(k as any) + v.length, 0)
+        assert(batch.length > 0 && bytes <= 5000)
+        count += batch.length
+      }
+      assert.strictEqual(count, 100)
+
+      count = 0
+      for await (const batch of tn.createReadStream('k', 'l', {maxBufferedBytes: 5000})) count += batch.length
+      assert.strictEqual(count, 100)
+
+      await (async () => { for await (const _ of tn.getRangeBatch('k', 'l', {maxBufferedBytes: 500})) {} })().then(
+        () => Promise.reject(Error('should have thrown')),
+        (e: Error) => assert(/maxBufferedBytes/.test(e.message))
+      )
+    })
+
+    assert.strictEqual((await _db.getRangeAll('k', 'l', {maxBufferedBytes: 200000})).length, 100)
+    await _db.getRangeAll('k', 'l', {maxBufferedBytes: 20000}).then(
+      () => Promise.reject(Error('should have thrown')),
+      (e: Error) => assert(/maxBufferedBytes/.test(e.message))
+    )
+  })
+
   describe('selectors', () => {
     const data = [['a', 'A'], ['b', 'B'], ['c', 'C']]
     beforeEach(async () => {
@@ -0,0 +1,56 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('secondary indexes', () => {
+  type User = {name: string, city: string}
+  const users = db.at('users/').withKeyEncoding(fdb.encoders.string).withValueEncoding(fdb.encoders.json)
+  const byCity = () => new fdb.SecondaryIndex<string, string, User, User>(users, db.at('by-city/'), u => [u.city])
+
+  it('maintains index entries in the same transaction as the row', async () => {
+    const index = byCity()
+    await db.doTn(async tn => {
+      await index.set(tn, 'alice', {name: 'Alice', city: 'Paris'})
+      await index.set(tn, 'bob', {name: 'Bob', city: 'Oslo'})
+    })
+    assert.deepStrictEqual(await db.doTn(tn => index.lookup(tn, ['Paris'])), ['alice'])
+
+    await db.doTn(tn => index.set(tn, 'bob', {name: 'Bob', city: 'Paris'}))
+    assert.deepStrictEqual(await db.doTn(tn => index.lookup(tn, ['Paris'])), ['alice', 'bob'])
+    assert.deepStrictEqual(await db.doTn(tn => index.lookup(tn, ['Oslo'])), [])
+
+    await db.doTn(tn => index.clear(tn, 'alice'))
+    assert.deepStrictEqual(await db.doTn(tn => index.lookup(tn, ['Paris'])), ['bob'])
+    assert.strictEqual(await users.get('alice'), undefined)
+  })
+
+  it('rejects an index stored inside the primary subspace', () => {
+    assert.throws(() => new fdb.SecondaryIndex(db, db.at('by-city/'), () => []), /inside the primary subspace/)
+    assert.throws(() => new fdb.SecondaryIndex(users, users.at('idx/'), () => []), /inside the primary subspace/)
+  })
+
+  it('backfills existing rows and verifies the result', async () => {
+    await users.doTn(async tn => {
+      for (let i = 0; i < 50; i++) tn.set('u' + i, {name: 'u' + i, city: i % 2 ? 'Oslo' : 'Paris'})
+    })
+
+    const index = byCity()
+    const before = await index.verify()
+    assert.strictEqual(before.rows, 50)
+    assert.strictEqual(before.missing, 50)
+
+    const stats = await index.backfill({batchRows: 7, concurrency: 2})
+    assert.strictEqual(stats.rows, 50)
+    assert.strictEqual(stats.entries, 50)
+    assert.strictEqual((await db.doTn(tn => index.lookup(tn, ['Oslo']))).length, 25)
+
+    // Break the index by writing around it.
+    await users.set('u0', {name: 'u0', city: 'Rome'})
+    const after = await index.verify()
+    assert.strictEqual(after.entries, 50)
+    assert.strictEqual(after.missing, 1)
+    assert.strictEqual(after.dangling, 1)
+    assert.deepStrictEqual(after.danglingKeys, ['u0'])
+  })
+}))
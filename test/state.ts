@@ -1,8 +1,10 @@
 import 'mocha'
 import assert = require('assert')
 import * as fdb from '../lib'
-import {testApiVersion} from './util'
+import {testApiVersion, prefix} from './util'
 import mod from '../lib/native'
+import { Worker } from 'worker_threads'
+import * as path from 'path'
 
 fdb.setAPIVersion(testApiVersion)
 
@@ -28,6 +30,37 @@ describe('state tests', () => {
 
   })
 
+  it('can be used from worker threads alongside the main thread', async function() {
+    this.timeout(20000)
+    const db = fdb.open().at(prefix)
+    await db.set('main', 'x')
+
+    // Workers share the network thread, and each resolves its own futures.
+    const code = `
+      const { parentPort, workerData } = require('worker_threads')
+      require('ts-node/register')
+      const fdb = require(workerData.lib)
+      fdb.setAPIVersion(workerData.version)
+      const db = fdb.open().at(workerData.prefix)
+      const key = 'worker' + workerData.i
+      db.set(key, 'hi')
+        .then(() => db.get('main'))
+        .then(main => db.get(key).then(v => parentPort.postMessage(main.toString() + v.toString())))
+    `
+    const results = await Promise.all([0, 1, 2].map(i => new Promise((resolve, reject) => {
+      const w = new Worker(code, {eval: true, workerData: {
+        lib: path.resolve(__dirname, '../lib'), version: testApiVersion, prefix, i
+      }})
+      w.once('message', resolve)
+      w.once('error', reject)
+    })))
+    assert.deepStrictEqual(results, ['xhi', 'xhi', 'xhi'])
+
+    // The main thread can still use the database after the workers exit.
+    assert.strictEqual((await db.get('worker0'))!.toString(), 'hi')
+    await db.clearRangeStartsWith('')
+  })
+
   it('does nothing if the native module has setAPIVersion called again', () => {
     mod.setAPIVersion(testApiVersion)
     mod.setAPIVersionImpl(testApiVersion, testApiVersion)
@@ -0,0 +1,63 @@
+import 'mocha'
+import fdb = require('../lib')
+import assert = require('assert')
+import { withEachDb } from './util'
+
+withEachDb(db => describe('struct encoding', () => {
+  const user = fdb.encoders.struct({
+    id: 'uint32',
+    balance: 'int64',
+    score: 'float64',
+    active: 'bool',
+    name: 'string',
+    email: {optional: 'string'},
+    age: {optional: 'uint8'},
+    avatar: {optional: 'buffer'},
+    tags: {array: 'string'},
+    history: {array: {struct: {at: 'float64', amount: 'int32'}}},
+  })
+
+  const alice = {
+    id: 1, balance: -(2 ** 40), score: 0.5, active: true, name: 'alice ✓',
+    email: 'alice@example.com', age: 30, avatar: undefined,
+    tags: ['a', 'bb'], history: [{at: 1.5, amount: -3}, {at: 2, amount: 4}],
+  }
+
+  it('round trips values through the database', async () => {
+    const users = db.withValueEncoding(user)
+    await users.set('alice', alice)
+    await users.set('bob', {...alice, id: 2, email: undefined, age: undefined, avatar: Buffer.from([1, 2]), tags: [], history: []})
+
+    assert.deepStrictEqual(await users.get('alice'), alice)
+    const bob = await users.get('bob')
+    assert.strictEqual(bob!.email, undefined)
+    assert.strictEqual(bob!.age, undefined)
+    assert.deepStrictEqual(Buffer.from(bob!.avatar!), Buffer.from([1, 2]))
+    assert.deepStrictEqual(bob!.tags, [])
+  })
+
+  it('reads single fields without decoding the rest', () => {
+    const buf = user.pack(alice) as Buffer
+    assert.strictEqual(user.readField(buf, 'name'), 'alice ✓')
+    assert.strictEqual(user.readField(buf, 'balance'), -(2 ** 40))
+    assert.strictEqual(user.readField(buf, 'avatar'), undefined)
+    assert.deepStrictEqual(user.fieldReader('tags')(buf), ['a', 'bb'])
+    assert.throws(() => user.unpack(buf.subarray(0, 10)))
+  })
+
+  it('stores structs as ordered tuple keys', async () => {
+    const point = fdb.encoders.struct({x: 'int32', label: {optional: 'string'}})
+    const points = db.withKeyEncoding(point.tupleKey())
+    await points.set({x: 2}, 'b')
+    await points.set({x: -1, label: 'neg'}, 'a')
+    assert.deepStrictEqual((await points.getRangeAll({x: -10}, {x: 10})).map(([k]) => k), [{x: -1, label: 'neg'}, {x: 2, label: undefined}])
+    assert.deepStrictEqual(user.toTuple(alice, ['name', 'avatar']), ['alice ✓', null])
+
+    // Integral and fractional floats sort together.
+    const reading = fdb.encoders.struct({v: 'float64', w: 'float32'})
+    const readings = db.withKeyEncoding(reading.tupleKey())
+    for (const v of [2, 1.5, -3, 0.25]) await readings.set({v, w: v}, 'x')
+    assert.deepStrictEqual((await readings.getRangeAll({v: -10, w: 0}, {v: 10, w: 0})).map(([k]) => k),
+      [-3, 0.25, 1.5, 2].map(v => ({v, w: v})))
+  })
+}))